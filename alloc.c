@@ -0,0 +1,265 @@
+/* alloc.c hands out free clusters for new data. Allocation is next-fit:
+* the search starts at FSI_Nxt_Free and wraps around. It first looks
+* for one free run long enough for the whole request, so a new file is
+* contiguous and reads back sequentially. Only when no such run exists
+* does it take free runs in order until it has enough. Chains are
+* linked in the in-memory FAT, which is write-back: setFATEntry only
+* marks the sector it touched, and flushFAT later writes the dirty
+* sectors in ascending order, merging neighbours into one write, to
+* every FAT copy in use. A PUT of any size then costs a few large
+* writes per FAT rather than two tiny ones per cluster.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include "alloc.h"
+#include "freemap.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define FAT_ENTRY_MASK 0x0FFFFFFF
+#define FAT_RESERVED_BITS 0xF0000000
+#define FAT_EOC 0x0FFFFFFF
+#define FAT_EOC_MIN 0x0FFFFFF8
+#define FSI_UNKNOWN 0xFFFFFFFF
+#define EXTFLAGS_NO_MIRROR 0x80 // Only the active FAT is in use
+#define EXTFLAGS_ACTIVE_FAT 0x0F
+
+/* Length of the free run starting at N, capped at want */
+static uint32_t freeRunAt(fat32Head* h, uint32_t N, uint32_t last, uint32_t want) {
+    uint32_t run = 0;
+    while(N + run <= last && run < want && isClusterFree(h, N + run)) {
+        run++;
+    }
+    return run;
+}
+
+/* Distance from used cluster N to the next cluster that might be free */
+static uint32_t skipUsed(fat32Head* h, uint32_t N) {
+    uint64_t bits = h->freeMap[N/64] >> (N % 64);
+    return bits == 0 ? 64 - N % 64 : (uint32_t)__builtin_ctzll(bits);
+}
+
+/* Find and claim count free clusters, starting the search at hint.
+    The clusters are linked into one chain ending in EOC in the in-memory
+    FAT and marked used in the free map; nothing is written to the image.
+    *extents gets the runs in chain order. Returns the number of runs, or
+    -1 when the volume doesn't have count free clusters. */
+int allocateExtents(fat32Head* h, uint32_t count, uint32_t hint, fat32Extent **extents) {
+    pthread_mutex_lock(&h->lock);
+    if(h->freeMap == NULL) {
+        buildFreeMap(h);
+    }
+    if(count == 0 || count > h->freeCount) {
+        pthread_mutex_unlock(&h->lock);
+        return -1;
+    }
+    uint32_t first = 2;
+    uint32_t last = h->clusterCount + 1;
+    if(last >= h->fatEntries) {
+        last = h->fatEntries - 1;
+    }
+    if(hint < first || hint > last) {
+        hint = first;
+    }
+
+    int capacity = 8;
+    int runs = 0;
+    fat32Extent *list = malloc(capacity*sizeof(fat32Extent));
+    if(list == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", capacity*sizeof(fat32Extent));
+        abort();
+    }
+
+    /* Pass 1: one run that fits everything */
+    uint64_t span = (uint64_t)last - first + 1;
+    for(uint64_t i = 0; i < span && runs == 0; ) {
+        uint32_t N = first + (hint - first + i) % span;
+        uint32_t run = freeRunAt(h, N, last, count);
+        if(run == count) {
+            list[0].clus = N;
+            list[0].count = count;
+            runs = 1;
+        }
+        i += run > 0 ? run : skipUsed(h, N);
+    }
+
+    /* Pass 2: free runs in next-fit order until there are enough */
+    uint32_t found = runs == 1 ? count : 0;
+    for(uint64_t i = 0; i < span && found < count; ) {
+        uint32_t N = first + (hint - first + i) % span;
+        uint32_t run = freeRunAt(h, N, last, count - found);
+        if(run > 0) {
+            if(runs == capacity) {
+                capacity *= 2;
+                list = realloc(list, capacity*sizeof(fat32Extent));
+                if(list == NULL) {
+                    fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", capacity*sizeof(fat32Extent));
+                    abort();
+                }
+            }
+            list[runs].clus = N;
+            list[runs].count = run;
+            runs++;
+            found += run;
+            /* Claim now so a wrapped search doesn't find the same run twice */
+            for(uint32_t c = 0; c < run; c++) {
+                markCluster(h, N + c, false);
+            }
+        }
+        i += run > 0 ? run : skipUsed(h, N);
+    }
+
+    /* Link the chain and claim the clusters */
+    uint32_t prev = 0;
+    for(int r = 0; r < runs; r++) {
+        for(uint32_t c = 0; c < list[r].count; c++) {
+            uint32_t N = list[r].clus + c;
+            markCluster(h, N, false);
+            if(prev != 0) {
+                setFATEntry(h, prev, N);
+            }
+            prev = N;
+        }
+    }
+    setFATEntry(h, prev, FAT_EOC);
+
+    /* The next search picks up right after this allocation */
+    if(h->fsi != NULL) {
+        h->fsi->FSI_Nxt_Free = prev + 1 > last ? first : prev + 1;
+        h->fsi->FSI_Free_Count = h->freeCount;
+        h->fsiDirty = true;
+    }
+    pthread_mutex_unlock(&h->lock);
+    STAT_ADD(h->stats, allocations, 1);
+    STAT_ADD(h->stats, clustersAllocated, count);
+
+    *extents = list;
+    return runs;
+}
+
+/* Give every cluster of the chain back, in memory only */
+void freeChain(fat32Head* h, uint32_t firstClus) {
+    pthread_mutex_lock(&h->lock);
+    uint32_t N = firstClus;
+    uint32_t steps = 0;
+    while(N >= 2 && N < h->fatEntries && steps++ < h->fatEntries) {
+        uint32_t next = h->fat[N] & FAT_ENTRY_MASK;
+        setFATEntry(h, N, 0);
+        markCluster(h, N, true);
+        if(next >= FAT_EOC_MIN) {
+            break;
+        }
+        N = next;
+    }
+    if(h->fsi != NULL && h->freeMap != NULL) {
+        h->fsi->FSI_Free_Count = h->freeCount;
+        h->fsiDirty = true;
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+/* Change entry N of the in-memory FAT, keeping its reserved top bits,
+    and mark its sector for the next flushFAT */
+void setFATEntry(fat32Head* h, uint32_t N, uint32_t value) {
+    if(N >= h->fatEntries) {
+        return;
+    }
+    uint32_t entry = (h->fat[N] & FAT_RESERVED_BITS) | (value & FAT_ENTRY_MASK);
+    if(entry == h->fat[N]) {
+        return;
+    }
+    h->fat[N] = entry;
+    if(h->fatDirty != NULL) {
+        uint32_t sector = (uint32_t)(((uint64_t)N*sizeof(uint32_t))/h->bs->BPB_BytesPerSec);
+        uint64_t bit = 1ULL << (sector % 64);
+        if(!(h->fatDirty[sector/64] & bit)) {
+            h->fatDirty[sector/64] |= bit;
+            h->fatDirtyCount++;
+        }
+    }
+}
+
+/* Dirty sectors from first on: sets *start to the first one and returns
+    how many follow it back to back, 0 when there are none left */
+static uint32_t nextDirtyRun(fat32Head* h, uint32_t first, uint32_t *start) {
+    uint32_t S = first;
+    while(S < h->fatSectors) {
+        uint64_t bits = h->fatDirty[S/64] >> (S % 64);
+        if(bits == 0) {
+            S += 64 - S % 64;
+            continue;
+        }
+        S += __builtin_ctzll(bits);
+        break;
+    }
+    if(S >= h->fatSectors) {
+        return 0;
+    }
+    uint32_t run = 0;
+    while(S + run < h->fatSectors && (h->fatDirty[(S + run)/64] >> ((S + run) % 64) & 1)) {
+        run++;
+    }
+    *start = S;
+    return run;
+}
+
+/* Write the in-memory FSInfo (free count, next free hint) back */
+static int writeFSInfo(int fd, fat32Head* h) {
+    off_t offset = (off_t)h->bs->BPB_FSInfo*h->bs->BPB_BytesPerSec;
+    return writeImage(fd, h, offset, h->fsi, sizeof(FSI)) == sizeof(FSI) ? 0 : -1;
+}
+
+/* Write every dirty FAT sector to every FAT copy in use, then FSInfo.
+    Runs of adjacent dirty sectors go out as one write, in ascending
+    order through each copy. Sectors stay dirty if their write fails.
+    Returns the number of writes issued, or -1 on failure. */
+int flushFAT(int fd, fat32Head* h) {
+    if(h->fatDirty == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&h->lock);
+    fat32BS *bs = h->bs;
+    uint32_t secBytes = bs->BPB_BytesPerSec;
+    off_t fatBytes = (off_t)bs->BPB_FATSz32*secBytes;
+    off_t fatStart = (off_t)bs->BPB_RsvdSecCnt*secBytes;
+    int writes = 0;
+    bool failed = false;
+
+    for(int copy = 0; copy < bs->BPB_NumFATs && h->fatDirtyCount > 0; copy++) {
+        if((bs->BPB_ExtFlags & EXTFLAGS_NO_MIRROR) && copy != (bs->BPB_ExtFlags & EXTFLAGS_ACTIVE_FAT)) {
+            continue;
+        }
+        uint32_t start = 0;
+        uint32_t run;
+        for(uint32_t S = 0; (run = nextDirtyRun(h, S, &start)) > 0; S = start + run) {
+            size_t len = (size_t)run*secBytes;
+            off_t offset = fatStart + copy*fatBytes + (off_t)start*secBytes;
+            if(writeImage(fd, h, offset, (unsigned char*)h->fat + (size_t)start*secBytes, len) != (ssize_t)len) {
+                failed = true;
+            }
+            writes++;
+        }
+    }
+    if(!failed) {
+        memset(h->fatDirty, 0, ((h->fatSectors + 63)/64)*sizeof(uint64_t));
+        h->fatDirtyCount = 0;
+    }
+
+    if(h->fsiDirty && h->fsi != NULL && !failed) {
+        if(writeFSInfo(fd, h) == -1) {
+            failed = true;
+        }
+        else {
+            h->fsiDirty = false;
+            writes++;
+        }
+    }
+    pthread_mutex_unlock(&h->lock);
+    STAT_ADD(h->stats, fatFlushWrites, writes);
+    return failed ? -1 : writes;
+}
@@ -0,0 +1,17 @@
+/* Cluster allocation and FAT/FSInfo updates.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "fat32.h"
+
+int allocateExtents(fat32Head* h, uint32_t count, uint32_t hint, fat32Extent **extents);
+void freeChain(fat32Head* h, uint32_t firstClus);
+void setFATEntry(fat32Head* h, uint32_t N, uint32_t value);
+int flushFAT(int fd, fat32Head* h);
+
+#endif
@@ -0,0 +1,679 @@
+/* Batch mode: run a list of shell commands against one mount without
+* prompts, writing one JSON object per command (JSON Lines) so scripts
+* don't have to scrape the human output.
+* Commands come from -c, separated by ';' or new lines, or with -c -
+* from stdin, one or more per line. Every record has "cmd" and "ok";
+* failures add "error". Commands provided:
+* INFO, DIR, CD, GET, MGET, PUT, FREE, CACHE, SYNC, STATS, FSCK, FIND, DU,
+* VERIFY, DEFRAG, CAT.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "batch.h"
+#include "libfat32.h"
+
+#define BUF_SIZE 256
+#define BATCH_SEPARATORS ";\n"
+#define BATCH_FSCK_PROBLEMS 100 // Problems listed in an FSCK record, the rest are only counted
+#define BATCH_DEFRAG_FILES 100 // Files listed in a DEFRAG record, the rest are only counted
+#define BATCH_CAT_CHUNK (64*1024) // Bytes CAT reads at a time
+
+/* Where a batch is, carried from one command to the next */
+struct batchState {
+	fat32Vol *v;
+	uint32_t curDirClus;
+	int failed; // Commands that reported ok:false
+};
+
+/* Write len bytes of s as the inside of a JSON string. Bytes outside
+	printable ASCII are escaped as \u00XX so the output is always valid
+	UTF-8. */
+static void jsonBytes(const char *s, size_t len) {
+	for(const unsigned char *p = (const unsigned char*)s; p < (const unsigned char*)s + len; p++) {
+		if(*p == '"' || *p == '\\') {
+			putchar('\\');
+			putchar(*p);
+		}
+		else if(*p < 0x20 || *p >= 0x7F) {
+			printf("\\u%04x", *p);
+		}
+		else {
+			putchar(*p);
+		}
+	}
+}
+
+static void jsonString(const char *s) {
+	putchar('"');
+	jsonBytes(s, strlen(s));
+	putchar('"');
+}
+
+/* Start a record: {"cmd":"X","ok":true */
+static void beginRecord(const char *cmd, bool ok) {
+	printf("{\"cmd\":");
+	jsonString(cmd);
+	printf(",\"ok\":%s", ok ? "true" : "false");
+}
+
+static void endRecord(void) {
+	printf("}\n");
+}
+
+static void failRecord(struct batchState *state, const char *cmd, const char *error) {
+	beginRecord(cmd, false);
+	printf(",\"error\":");
+	jsonString(error);
+	endRecord();
+	state->failed++;
+}
+
+/* A fixed-width boot sector field, trimmed of its padding */
+static void jsonField(const char *field, int length) {
+	char copy[BUF_SIZE];
+	memcpy(copy, field, length);
+	copy[length] = '\0';
+	for(int i = length - 1; i >= 0 && (copy[i] == ' ' || copy[i] == '\0'); i--) {
+		copy[i] = '\0';
+	}
+	jsonString(copy);
+}
+
+static void batchInfo(struct batchState *state) {
+	const fat32BS *bs = fat32BootSector(state->v);
+	beginRecord("INFO", true);
+	printf(",\"oemName\":");
+	jsonField(bs->BS_OEMName, BS_OEMName_LENGTH);
+	printf(",\"label\":");
+	jsonField(bs->BS_VolLab, BS_VolLab_LENGTH);
+	printf(",\"fsType\":");
+	jsonField(bs->BS_FilSysType, BS_FilSysType_LENGTH);
+	printf(",\"volumeId\":");
+	jsonField((const char*)fat32VolumeEntry(state->v)->DIR_Name, 11);
+	printf(",\"media\":%u", bs->BPB_Media);
+	printf(",\"size\":%" PRIu64, (uint64_t)bs->BPB_BytesPerSec*bs->BPB_TotSec32);
+	printf(",\"bytesPerSector\":%u", bs->BPB_BytesPerSec);
+	printf(",\"sectorsPerCluster\":%u", bs->BPB_SecPerClus);
+	printf(",\"totalSectors\":%u", bs->BPB_TotSec32);
+	printf(",\"reservedSectors\":%u", bs->BPB_RsvdSecCnt);
+	printf(",\"fats\":%u", bs->BPB_NumFATs);
+	printf(",\"fatSize\":%u", bs->BPB_FATSz32);
+	printf(",\"mirrored\":%s", bs->BPB_ExtFlags == 0 ? "true" : "false");
+	printf(",\"rootCluster\":%u", bs->BPB_RootClus);
+	printf(",\"totalClusters\":%u", fat32TotalClusters(state->v));
+	endRecord();
+}
+
+static int jsonDirEntry(const fat32Entry *entry, void *arg) {
+	int *count = arg;
+	printf("%s{\"name\":", *count > 0 ? "," : "");
+	jsonString(entry->name);
+	printf(",\"dir\":%s,\"size\":%u,\"cluster\":%u}", entry->isDir ? "true" : "false", entry->size, entry->firstClus);
+	(*count)++;
+	return 0;
+}
+
+static void batchDir(struct batchState *state) {
+	const fat32BS *bs = fat32BootSector(state->v);
+	int count = 0;
+	beginRecord("DIR", true);
+	printf(",\"entries\":[");
+	fat32Readdir(state->v, state->curDirClus, jsonDirEntry, &count);
+	printf("]");
+	uint64_t bytesFree = (uint64_t)fat32FreeClusters(state->v)*bs->BPB_BytesPerSec*bs->BPB_SecPerClus;
+	printf(",\"bytesFree\":%" PRIu64, bytesFree);
+	endRecord();
+}
+
+/* CD and GET take paths, see fat32Lookup */
+static void batchCD(struct batchState *state, const char *folderName) {
+	fat32Entry dir;
+	if(fat32Lookup(state->v, state->curDirClus, folderName, &dir) == FAT32_OK && dir.isDir) {
+		state->curDirClus = dir.firstClus;
+	}
+	else {
+		failRecord(state, "CD", "folder not found");
+		return;
+	}
+	beginRecord("CD", true);
+	printf(",\"name\":");
+	jsonString(folderName);
+	printf(",\"cluster\":%u", state->curDirClus);
+	endRecord();
+}
+
+static void batchGet(struct batchState *state, const char *fileName) {
+	fat32Entry file;
+	if(fat32Lookup(state->v, state->curDirClus, fileName, &file) != FAT32_OK || file.isDir) {
+		failRecord(state, "GET", "file not found");
+		return;
+	}
+	const char *slash = strrchr(fileName, '/');
+	bool checksum = fat32ChecksumsEnabled(state->v);
+	uint32_t crc;
+	int result = fat32ExtractChecksum(state->v, &file, slash != NULL ? slash + 1 : fileName, checksum ? &crc : NULL);
+	if(result != FAT32_OK) {
+		failRecord(state, "GET", fat32Strerror(result));
+		return;
+	}
+	beginRecord("GET", true);
+	printf(",\"name\":");
+	jsonString(file.name);
+	printf(",\"size\":%u", file.size);
+	if(checksum) {
+		printf(",\"crc32c\":\"%08" PRIx32 "\"", crc);
+	}
+	endRecord();
+}
+
+/* VERIFY <file> <hostpath>: the file name is matched upper case, the
+	host path keeps its case */
+static void batchVerify(struct batchState *state, const char *arg, const char *argRaw) {
+	const char *space = strchr(arg, ' ');
+	if(space == NULL) {
+		failRecord(state, "VERIFY", "missing argument");
+		return;
+	}
+	char fileName[BUF_SIZE];
+	memcpy(fileName, arg, space - arg);
+	fileName[space - arg] = '\0';
+	const char *hostPath = argRaw + (space - arg) + 1;
+
+	fat32Entry file;
+	if(fat32Lookup(state->v, state->curDirClus, fileName, &file) != FAT32_OK || file.isDir) {
+		failRecord(state, "VERIFY", "file not found");
+		return;
+	}
+	uint64_t differsAt = 0;
+	int result = fat32Verify(state->v, &file, hostPath, &differsAt);
+	if(result != FAT32_OK && result != FAT32_ERR_DIFFERENT) {
+		failRecord(state, "VERIFY", fat32Strerror(result));
+		return;
+	}
+	beginRecord("VERIFY", true);
+	printf(",\"name\":");
+	jsonString(file.name);
+	printf(",\"size\":%u,\"same\":%s", file.size, result == FAT32_OK ? "true" : "false");
+	if(result == FAT32_ERR_DIFFERENT) {
+		printf(",\"differsAt\":%" PRIu64, differsAt);
+	}
+	endRecord();
+}
+
+/* What MGET's record says about one file */
+struct batchMgetFile {
+	char name[DIR_PRINT_NAME_LENGTH];
+	uint32_t size;
+	int result;
+};
+
+/* MGET's results, held until the record's ok flag is known */
+struct batchMget {
+	struct batchMgetFile *files;
+	int count;
+	int capacity;
+	int copied;
+};
+
+static void keepExtracted(const fat32Entry *file, int result, void *arg) {
+	struct batchMget *mget = arg;
+	if(mget->count == mget->capacity) {
+		mget->capacity = mget->capacity > 0 ? mget->capacity*2 : 64;
+		mget->files = realloc(mget->files, mget->capacity*sizeof(struct batchMgetFile));
+		if(mget->files == NULL) {
+			fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", mget->capacity*sizeof(struct batchMgetFile));
+			abort();
+		}
+	}
+	struct batchMgetFile *kept = &mget->files[mget->count++];
+	memcpy(kept->name, file->name, DIR_PRINT_NAME_LENGTH);
+	kept->size = file->size;
+	kept->result = result;
+	mget->copied += result == FAT32_OK;
+}
+
+static void batchMultiGet(struct batchState *state, const char *patterns) {
+	struct batchMget mget;
+	memset(&mget, 0, sizeof(mget));
+	if(fat32MultiExtract(state->v, state->curDirClus, patterns, keepExtracted, &mget) == 0) {
+		failRecord(state, "MGET", "file not found");
+		return;
+	}
+
+	beginRecord("MGET", mget.copied == mget.count);
+	printf(",\"copied\":%d,\"matched\":%d,\"files\":[", mget.copied, mget.count);
+	for(int i = 0; i < mget.count; i++) {
+		printf("%s{\"name\":", i > 0 ? "," : "");
+		jsonString(mget.files[i].name);
+		if(mget.files[i].result == FAT32_OK) {
+			printf(",\"ok\":true,\"size\":%u}", mget.files[i].size);
+		}
+		else {
+			printf(",\"ok\":false,\"error\":");
+			jsonString(fat32Strerror(mget.files[i].result));
+			printf("}");
+		}
+	}
+	printf("]");
+	endRecord();
+	if(mget.copied != mget.count) {
+		state->failed++;
+	}
+	free(mget.files);
+}
+
+static void batchPut(struct batchState *state, const char *hostPath) {
+	const char *name = strrchr(hostPath, '/');
+	name = name != NULL ? name + 1 : hostPath;
+	int result = fat32Put(state->v, state->curDirClus, hostPath, name);
+	if(result != FAT32_OK) {
+		failRecord(state, "PUT", fat32Strerror(result));
+		return;
+	}
+	beginRecord("PUT", true);
+	printf(",\"name\":");
+	jsonString(name);
+	endRecord();
+}
+
+static void batchFree(struct batchState *state) {
+	const fat32BS *bs = fat32BootSector(state->v);
+	uint32_t freeClusters = fat32FreeClusters(state->v);
+	uint32_t hint = fat32FSInfo(state->v)->FSI_Free_Count;
+	beginRecord("FREE", true);
+	printf(",\"freeClusters\":%u,\"totalClusters\":%u", freeClusters, fat32TotalClusters(state->v));
+	printf(",\"bytesFree\":%" PRIu64, (uint64_t)freeClusters*bs->BPB_BytesPerSec*bs->BPB_SecPerClus);
+	if(hint == 0xFFFFFFFF) {
+		printf(",\"fsinfoFreeCount\":null");
+	}
+	else {
+		printf(",\"fsinfoFreeCount\":%u", hint);
+	}
+	endRecord();
+}
+
+static void batchCache(struct batchState *state) {
+	uint64_t hits, misses;
+	int used, capacity;
+	beginRecord("CACHE", true);
+	if(fat32CacheCounters(state->v, &hits, &misses, &used, &capacity)) {
+		printf(",\"used\":%d,\"capacity\":%d", used, capacity);
+		printf(",\"hits\":%" PRIu64 ",\"misses\":%" PRIu64, hits, misses);
+	}
+	else {
+		printf(",\"capacity\":0");
+	}
+	fat32DentryCounters(state->v, &hits, &misses, &used, &capacity);
+	printf(",\"names\":{\"used\":%d,\"capacity\":%d", used, capacity);
+	printf(",\"hits\":%" PRIu64 ",\"misses\":%" PRIu64 "}", hits, misses);
+	endRecord();
+}
+
+static void batchStats(struct batchState *state) {
+	if(!fat32StatsEnabled(state->v)) {
+		failRecord(state, "STATS", "stats are off, start with -s");
+		return;
+	}
+	beginRecord("STATS", true);
+	printf(",\"stats\":");
+	fat32WriteStats(state->v, stdout);
+	endRecord();
+}
+
+static void batchSync(struct batchState *state) {
+	int result = fat32Sync(state->v);
+	if(result != FAT32_OK) {
+		failRecord(state, "SYNC", fat32Strerror(result));
+		return;
+	}
+	beginRecord("SYNC", true);
+	endRecord();
+}
+
+/* One element of the FSCK record's problems array */
+static void jsonFsckProblem(int problem, const char *path, uint32_t clus, void *arg) {
+	int *listed = arg;
+	if(*listed == BATCH_FSCK_PROBLEMS) {
+		return;
+	}
+	printf("%s{\"problem\":", *listed > 0 ? "," : "");
+	jsonString(fat32FsckProblemName(problem));
+	if(path != NULL) {
+		printf(",\"path\":");
+		jsonString(path);
+	}
+	printf(",\"cluster\":%u}", clus);
+	(*listed)++;
+}
+
+/* The problems are written as they are found, so the record is opened
+	before the check and closed with the totals */
+static void batchFsck(struct batchState *state) {
+	fat32FsckReport report;
+	int listed = 0;
+	beginRecord("FSCK", true);
+	printf(",\"problems\":[");
+	fat32Fsck(state->v, &report, jsonFsckProblem, &listed);
+	uint32_t total = 0;
+	printf("],\"counts\":{");
+	for(int i = 0; i < FSCK_PROBLEM_KINDS; i++) {
+		printf("%s", i > 0 ? "," : "");
+		jsonString(fat32FsckProblemName(i));
+		printf(":%u", report.problems[i]);
+		total += report.problems[i];
+	}
+	printf("},\"clean\":%s,\"dirs\":%u,\"files\":%u", total == 0 ? "true" : "false", report.dirs, report.files);
+	printf(",\"clustersInUse\":%" PRIu64 ",\"lostClusters\":%" PRIu64 ",\"mirrorEntries\":%" PRIu64,
+		report.clustersInUse, report.lostClusters, report.mirrorEntries);
+	endRecord();
+}
+
+/* FIND streams its matches into the record's array as they are found */
+struct batchFind {
+	pthread_mutex_t lock;
+	int matches;
+};
+
+static void jsonFound(const char *path, const fat32Entry *entry, void *arg) {
+	struct batchFind *find = arg;
+	pthread_mutex_lock(&find->lock);
+	printf("%s{\"path\":", find->matches > 0 ? "," : "");
+	jsonString(path);
+	printf(",\"dir\":%s,\"size\":%u,\"cluster\":%u}", entry->isDir ? "true" : "false", entry->size, entry->firstClus);
+	find->matches++;
+	pthread_mutex_unlock(&find->lock);
+}
+
+static void batchFind(struct batchState *state, const char *pattern) {
+	struct batchFind find;
+	pthread_mutex_init(&find.lock, NULL);
+	find.matches = 0;
+	beginRecord("FIND", true);
+	printf(",\"matches\":[");
+	int folders = fat32Find(state->v, pattern, jsonFound, &find);
+	printf("],\"count\":%d,\"folders\":%d", find.matches, folders);
+	endRecord();
+	pthread_mutex_destroy(&find.lock);
+}
+
+static void jsonDuTotals(const fat32DuTotals *totals) {
+	printf("\"size\":%" PRIu64 ",\"clusters\":%" PRIu64 ",\"files\":%u,\"dirs\":%u",
+		totals->size, totals->clusters, totals->files, totals->dirs);
+}
+
+static void jsonDuDir(const char *path, const fat32DuTotals *totals, void *arg) {
+	int *count = arg;
+	printf("%s{\"path\":", *count > 0 ? "," : "");
+	jsonString(path);
+	printf(",");
+	jsonDuTotals(totals);
+	printf("}");
+	(*count)++;
+}
+
+/* DU [dir], from the current directory when dir is left out */
+static void batchDu(struct batchState *state, const char *folderName) {
+	uint32_t clus = state->curDirClus;
+	if(folderName[0] != '\0') {
+		fat32Entry dir;
+		if(fat32Lookup(state->v, state->curDirClus, folderName, &dir) != FAT32_OK || !dir.isDir) {
+			failRecord(state, "DU", "folder not found");
+			return;
+		}
+		clus = dir.firstClus;
+	}
+	else {
+		folderName = ".";
+	}
+	fat32DuTotals total;
+	int count = 0;
+	beginRecord("DU", true);
+	printf(",\"folders\":[");
+	fat32Du(state->v, clus, folderName, &total, jsonDuDir, &count);
+	printf("],");
+	jsonDuTotals(&total);
+	endRecord();
+}
+
+/* DEFRAG can fail before moving anything, so its record is only opened
+	with the first file moved */
+struct batchDefrag {
+	int listed;
+	bool opened;
+};
+
+static void openDefragRecord(struct batchDefrag *defrag) {
+	if(!defrag->opened) {
+		beginRecord("DEFRAG", true);
+		printf(",\"moved\":[");
+		defrag->opened = true;
+	}
+}
+
+static void jsonMoved(const char *path, uint32_t before, uint32_t after, void *arg) {
+	struct batchDefrag *defrag = arg;
+	openDefragRecord(defrag);
+	if(defrag->listed == BATCH_DEFRAG_FILES) {
+		return;
+	}
+	printf("%s{\"path\":", defrag->listed > 0 ? "," : "");
+	jsonString(path);
+	printf(",\"before\":%u,\"after\":%u}", before, after);
+	defrag->listed++;
+}
+
+static void batchDefrag(struct batchState *state) {
+	fat32DefragReport report;
+	struct batchDefrag defrag = { 0, false };
+	int result = fat32Defrag(state->v, &report, jsonMoved, &defrag);
+	if(!defrag.opened && result != FAT32_OK && report.files == 0) {
+		failRecord(state, "DEFRAG", fat32Strerror(result));
+		return;
+	}
+	openDefragRecord(&defrag);
+	printf("],\"files\":%u,\"fragmented\":%u,\"movedCount\":%u,\"noRoom\":%u,\"damaged\":%u,\"failed\":%u",
+		report.files, report.fragmented, report.moved, report.noRoom, report.damaged, report.failed);
+	printf(",\"extentsBefore\":%" PRIu64 ",\"extentsAfter\":%" PRIu64 ",\"clustersMoved\":%" PRIu64,
+		report.extentsBefore, report.extentsAfter, report.clustersMoved);
+	endRecord();
+}
+
+/* CAT <file> [offset [length]]. The data is streamed into the record's
+	"data" string, each byte as one character. */
+static void batchCat(struct batchState *state, const char *arg) {
+	char fileName[BUF_SIZE];
+	uint64_t offset = 0;
+	uint64_t length = UINT64_MAX;
+	sscanf(arg, "%255s %" SCNu64 " %" SCNu64, fileName, &offset, &length);
+	fat32Entry file;
+	if(fat32Lookup(state->v, state->curDirClus, fileName, &file) != FAT32_OK || file.isDir) {
+		failRecord(state, "CAT", "file not found");
+		return;
+	}
+	char *data = malloc(BATCH_CAT_CHUNK);
+	if(data == NULL) {
+		fprintf(stderr, "Fatal: failed to allocate %d bytes.\n", BATCH_CAT_CHUNK);
+		abort();
+	}
+	/* The first read is made before the record is opened, so a bad
+		chain is reported as a failure */
+	ssize_t readd = fat32Read(state->v, &file, data, length < BATCH_CAT_CHUNK ? length : BATCH_CAT_CHUNK, offset);
+	if(readd < 0) {
+		failRecord(state, "CAT", fat32Strerror(readd));
+		free(data);
+		return;
+	}
+	beginRecord("CAT", true);
+	printf(",\"name\":");
+	jsonString(file.name);
+	printf(",\"offset\":%" PRIu64 ",\"data\":\"", offset);
+	uint64_t total = 0;
+	while(readd > 0) {
+		jsonBytes(data, readd);
+		total += readd;
+		length -= readd;
+		if(length == 0) {
+			break;
+		}
+		readd = fat32Read(state->v, &file, data, length < BATCH_CAT_CHUNK ? length : BATCH_CAT_CHUNK, offset + total);
+	}
+	printf("\",\"length\":%" PRIu64, total);
+	if(readd < 0) {
+		printf(",\"error\":");
+		jsonString(fat32Strerror(readd));
+	}
+	endRecord();
+	free(data);
+}
+
+/* Run one command. Like the shell, the command word is matched upper
+	case; names in the image are upper cased too, host paths are not. */
+static void batchCommand(struct batchState *state, char *line) {
+	while(isspace((unsigned char)*line)) {
+		line++;
+	}
+	size_t length = strlen(line);
+	while(length > 0 && isspace((unsigned char)line[length-1])) {
+		line[--length] = '\0';
+	}
+	if(length == 0) {
+		return;
+	}
+	if(length >= BUF_SIZE) {
+		failRecord(state, "", "command too long");
+		return;
+	}
+
+	char cmd[BUF_SIZE];
+	char arg[BUF_SIZE];
+	char argRaw[BUF_SIZE];
+	size_t cmdLength = strcspn(line, " \t");
+	for(size_t i = 0; i < cmdLength; i++) {
+		cmd[i] = toupper((unsigned char)line[i]);
+	}
+	cmd[cmdLength] = '\0';
+	const char *rest = line + cmdLength;
+	while(*rest == ' ' || *rest == '\t') {
+		rest++;
+	}
+	strcpy(argRaw, rest);
+	for(size_t i = 0; i <= strlen(argRaw); i++) {
+		arg[i] = toupper((unsigned char)argRaw[i]);
+	}
+
+	uint64_t started = fat32CommandBegin(state->v);
+	bool needsArg = strcmp(cmd, "CD") == 0 || strcmp(cmd, "GET") == 0 || strcmp(cmd, "MGET") == 0 || strcmp(cmd, "PUT") == 0
+		|| strcmp(cmd, "FIND") == 0 || strcmp(cmd, "VERIFY") == 0 || strcmp(cmd, "CAT") == 0;
+	if(needsArg && arg[0] == '\0') {
+		failRecord(state, cmd, "missing argument");
+	}
+	else if(strcmp(cmd, "INFO") == 0) {
+		batchInfo(state);
+	}
+	else if(strcmp(cmd, "DIR") == 0) {
+		batchDir(state);
+	}
+	else if(strcmp(cmd, "CD") == 0) {
+		batchCD(state, arg);
+	}
+	else if(strcmp(cmd, "GET") == 0) {
+		batchGet(state, arg);
+	}
+	else if(strcmp(cmd, "MGET") == 0) {
+		batchMultiGet(state, arg);
+	}
+	else if(strcmp(cmd, "PUT") == 0) {
+		batchPut(state, argRaw);
+	}
+	else if(strcmp(cmd, "FREE") == 0) {
+		batchFree(state);
+	}
+	else if(strcmp(cmd, "CACHE") == 0) {
+		batchCache(state);
+	}
+	else if(strcmp(cmd, "SYNC") == 0) {
+		batchSync(state);
+	}
+	else if(strcmp(cmd, "STATS") == 0) {
+		batchStats(state);
+	}
+	else if(strcmp(cmd, "FIND") == 0) {
+		batchFind(state, arg);
+	}
+	else if(strcmp(cmd, "DU") == 0) {
+		batchDu(state, arg);
+	}
+	else if(strcmp(cmd, "VERIFY") == 0) {
+		batchVerify(state, arg, argRaw);
+	}
+	else if(strcmp(cmd, "CAT") == 0) {
+		batchCat(state, arg);
+	}
+	else if(strcmp(cmd, "DEFRAG") == 0) {
+		batchDefrag(state);
+	}
+	else if(strcmp(cmd, "FSCK") == 0) {
+		batchFsck(state);
+	}
+	else {
+		failRecord(state, cmd, "command not found");
+	}
+	if(started != 0) {
+		fat32CommandEnd(state->v, cmd, started);
+	}
+}
+
+/* Run every command of text, which is changed in place */
+static void batchText(struct batchState *state, char *text) {
+	char *save;
+	for(char *line = strtok_r(text, BATCH_SEPARATORS, &save); line != NULL; line = strtok_r(NULL, BATCH_SEPARATORS, &save)) {
+		batchCommand(state, line);
+	}
+}
+
+/* Mount fd and run commands, or the script on stdin when commands is
+	"-". Returns the number of commands that failed, or -1 when the
+	volume couldn't be mounted. */
+int batchRun(int fd, const fat32Options *options, const char *commands) {
+	int error;
+	struct batchState state;
+	state.failed = 0;
+	state.v = fat32Open(fd, options, &error);
+	if(state.v == NULL) {
+		failRecord(&state, "MOUNT", fat32Strerror(error));
+		fflush(stdout);
+		return -1;
+	}
+	state.curDirClus = fat32RootCluster(state.v);
+
+	if(strcmp(commands, "-") == 0) {
+		char *line = NULL;
+		size_t capacity = 0;
+		while(getline(&line, &capacity, stdin) != -1) {
+			batchText(&state, line);
+		}
+		free(line);
+	}
+	else {
+		char *text = strdup(commands);
+		if(text == NULL) {
+			fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", strlen(commands) + 1);
+			abort();
+		}
+		batchText(&state, text);
+		free(text);
+	}
+
+	fat32Close(state.v);
+	fflush(stdout);
+	return state.failed;
+}
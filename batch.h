@@ -0,0 +1,12 @@
+/* Non-interactive runs of shell commands with JSON Lines output.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "fat32types.h"
+
+int batchRun(int fd, const fat32Options *options, const char *commands);
+
+#endif
@@ -0,0 +1,336 @@
+/* fat32bench times the operations behind the shell's INFO, DIR, CD and
+* GET commands on an image, through libfat32 in process so that only
+* the engine is measured, not the terminal:
+* INFO: mounting the volume (the boot sector, FAT and FSInfo checks
+*       every session pays for before INFO can print anything).
+* DIR:  listing every directory of the image.
+* CD:   looking every directory up by name in its parent.
+* GET:  extracting files into a scratch directory (up to -g of them).
+* For each it reports latency percentiles, throughput, and the read and
+* write syscalls (from /proc/self/io) and page faults per operation.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "libfat32.h"
+
+#define DEFAULT_ITERATIONS 5
+#define DEFAULT_MAX_GETS 1000
+
+/* A directory found by the walk, and where it hangs from */
+struct benchDir {
+	uint32_t clus;
+	uint32_t parent;
+	char name[DIR_PRINT_NAME_LENGTH];
+};
+
+/* Everything the walk found */
+struct benchTree {
+	struct benchDir *dirs;
+	int dirCount;
+	int dirCapacity;
+	fat32Entry *files;
+	int fileCount;
+	int fileCapacity;
+	uint32_t walking; // Cluster of the directory being listed
+};
+
+/* Counters sampled around each phase */
+struct benchCounters {
+	uint64_t syscr;
+	uint64_t syscw;
+	uint64_t faults;
+};
+
+/* Latencies of one phase, in nanoseconds */
+struct benchSamples {
+	uint64_t *ns;
+	int count;
+	int capacity;
+	uint64_t bytes;
+	struct benchCounters before;
+};
+
+static uint64_t nowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void *growArray(void *array, int *capacity, size_t size) {
+	*capacity = *capacity == 0 ? 64 : *capacity*2;
+	array = realloc(array, *capacity*size);
+	if(array == NULL) {
+		fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", *capacity*size);
+		abort();
+	}
+	return array;
+}
+
+static void readCounters(struct benchCounters *c) {
+	c->syscr = 0;
+	c->syscw = 0;
+	FILE *io = fopen("/proc/self/io", "r");
+	if(io != NULL) {
+		char key[64];
+		unsigned long long value;
+		while(fscanf(io, "%63[^:]: %llu\n", key, &value) == 2) {
+			if(strcmp(key, "syscr") == 0) {
+				c->syscr = value;
+			}
+			else if(strcmp(key, "syscw") == 0) {
+				c->syscw = value;
+			}
+		}
+		fclose(io);
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	c->faults = usage.ru_minflt + usage.ru_majflt;
+}
+
+static void startPhase(struct benchSamples *s) {
+	s->count = 0;
+	s->bytes = 0;
+	readCounters(&s->before);
+}
+
+static void addSample(struct benchSamples *s, uint64_t ns) {
+	if(s->count == s->capacity) {
+		s->ns = growArray(s->ns, &s->capacity, sizeof(uint64_t));
+	}
+	s->ns[s->count++] = ns;
+}
+
+static int compareNs(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Index of the sample at the given percentile of count sorted samples */
+static int nearestRank(int count, int percentile) {
+	int rank = (count*percentile + 99)/100;
+	return rank < 1 ? 0 : rank - 1;
+}
+
+/* Print one row of the report. The counters are read first so the
+	sorting and printing aren't counted. */
+static void reportPhase(const char *name, struct benchSamples *s) {
+	struct benchCounters after;
+	readCounters(&after);
+	if(s->count == 0) {
+		printf("%-5s %8s\n", name, "-");
+		return;
+	}
+	uint64_t total = 0;
+	for(int i = 0; i < s->count; i++) {
+		total += s->ns[i];
+	}
+	qsort(s->ns, s->count, sizeof(uint64_t), compareNs);
+	double mean = (double)total/s->count/1000;
+	double p50 = s->ns[nearestRank(s->count, 50)]/1000.0;
+	double p99 = s->ns[nearestRank(s->count, 99)]/1000.0;
+	double max = s->ns[s->count - 1]/1000.0;
+	double opsPerSec = total > 0 ? s->count/(total/1e9) : 0;
+	double mbPerSec = total > 0 ? s->bytes/(total/1e9)/(1024*1024) : 0;
+	double reads = (double)(after.syscr - s->before.syscr)/s->count;
+	double writes = (double)(after.syscw - s->before.syscw)/s->count;
+	double faults = (double)(after.faults - s->before.faults)/s->count;
+	printf("%-5s %8d %10.1f %10.1f %10.1f %10.1f %11.0f %9.1f %9.2f %9.2f %9.2f\n",
+		name, s->count, mean, p50, p99, max, opsPerSec, mbPerSec, reads, writes, faults);
+}
+
+static int collectEntry(const fat32Entry *entry, void *arg) {
+	struct benchTree *tree = arg;
+	if(strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+		return 0;
+	}
+	if(entry->isDir) {
+		if(tree->dirCount == tree->dirCapacity) {
+			tree->dirs = growArray(tree->dirs, &tree->dirCapacity, sizeof(struct benchDir));
+		}
+		struct benchDir *dir = &tree->dirs[tree->dirCount++];
+		dir->clus = entry->firstClus;
+		dir->parent = tree->walking;
+		strcpy(dir->name, entry->name);
+	}
+	else {
+		if(tree->fileCount == tree->fileCapacity) {
+			tree->files = growArray(tree->files, &tree->fileCapacity, sizeof(fat32Entry));
+		}
+		memcpy(&tree->files[tree->fileCount++], entry, sizeof(fat32Entry));
+	}
+	return 0;
+}
+
+/* Breadth first walk of the whole image; dirs[0] is the root */
+static void walkTree(fat32Vol *v, struct benchTree *tree) {
+	memset(tree, 0, sizeof(struct benchTree));
+	tree->dirs = growArray(NULL, &tree->dirCapacity, sizeof(struct benchDir));
+	tree->dirs[0].clus = fat32RootCluster(v);
+	tree->dirs[0].parent = 0;
+	strcpy(tree->dirs[0].name, "/");
+	tree->dirCount = 1;
+	for(int i = 0; i < tree->dirCount; i++) {
+		tree->walking = tree->dirs[i].clus;
+		/* Skip directories pointing back at the root, which would loop */
+		if(i > 0 && tree->walking == fat32RootCluster(v)) {
+			continue;
+		}
+		fat32Readdir(v, tree->walking, collectEntry, tree);
+	}
+}
+
+static int countEntry(const fat32Entry *entry, void *arg) {
+	(*(int*)arg)++;
+	return 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-m] [-p] [-k] [-C clusters] [-r clusters] [-x index] [-i iterations] [-g max gets] <image>\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	fat32Options options = { 0, FAT32_DEFAULT_CACHE_BLOCKS, FAT32_DEFAULT_PREFETCH };
+	int iterations = DEFAULT_ITERATIONS;
+	int maxGets = DEFAULT_MAX_GETS;
+	int c;
+	while((c = getopt(argc, argv, "mpkC:r:x:i:g:")) != -1) {
+		switch(c) {
+		case 'm': options.flags |= FAT32_OPT_MMAP; break;
+		case 'p': options.flags |= FAT32_OPT_PIPELINE; break;
+		case 'k': options.flags |= FAT32_OPT_CHECKSUM; break;
+		case 'C': options.cacheBlocks = atoi(optarg); break;
+		case 'r': options.prefetchClusters = atoi(optarg); break;
+		case 'x': options.indexPath = optarg; break;
+		case 'i': iterations = atoi(optarg); break;
+		case 'g': maxGets = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if(argc - optind != 1 || iterations < 1) {
+		usage(argv[0]);
+	}
+	const char *image = argv[optind];
+	int fd = open(image, O_RDONLY);
+	if(fd == -1) {
+		perror("opening image");
+		return 1;
+	}
+
+	int error;
+	fat32Vol *v = fat32Open(fd, &options, &error);
+	if(v == NULL) {
+		fprintf(stderr, "Can't mount %s: %s\n", image, fat32Strerror(error));
+		return 1;
+	}
+	struct benchTree tree;
+	walkTree(v, &tree);
+	fat32Close(v);
+
+	printf("%s%s%s%s, cache %d clusters, prefetch %d clusters: %d dirs, %d files, %d iterations\n", image,
+		(options.flags & FAT32_OPT_MMAP) ? ", mmap" : "", (options.flags & FAT32_OPT_PIPELINE) ? ", pipelined" : "",
+		(options.flags & FAT32_OPT_CHECKSUM) ? ", crc32c" : "",
+		options.cacheBlocks, options.prefetchClusters, tree.dirCount, tree.fileCount, iterations);
+	printf("%-5s %8s %10s %10s %10s %10s %11s %9s %9s %9s %9s\n",
+		"op", "count", "mean us", "p50 us", "p99 us", "max us", "ops/s", "MB/s", "reads/op", "writes/op", "faults/op");
+
+	struct benchSamples samples;
+	memset(&samples, 0, sizeof(samples));
+
+	/* INFO: a fresh mount each time */
+	startPhase(&samples);
+	for(int i = 0; i < iterations; i++) {
+		uint64_t start = nowNs();
+		v = fat32Open(fd, &options, &error);
+		if(v != NULL) {
+			fat32BootSector(v);
+			fat32VolumeEntry(v);
+		}
+		addSample(&samples, nowNs() - start);
+		if(v == NULL) {
+			fprintf(stderr, "Mount failed: %s\n", fat32Strerror(error));
+			return 1;
+		}
+		fat32Close(v);
+	}
+	reportPhase("INFO", &samples);
+
+	/* The rest share one mount, like a shell session */
+	v = fat32Open(fd, &options, &error);
+	if(v == NULL) {
+		fprintf(stderr, "Mount failed: %s\n", fat32Strerror(error));
+		return 1;
+	}
+
+	startPhase(&samples);
+	for(int i = 0; i < iterations; i++) {
+		for(int d = 0; d < tree.dirCount; d++) {
+			int entries = 0;
+			uint64_t start = nowNs();
+			fat32Readdir(v, tree.dirs[d].clus, countEntry, &entries);
+			addSample(&samples, nowNs() - start);
+			samples.bytes += (uint64_t)entries*sizeof(fat32Dir);
+		}
+	}
+	reportPhase("DIR", &samples);
+
+	startPhase(&samples);
+	for(int i = 0; i < iterations; i++) {
+		for(int d = 1; d < tree.dirCount; d++) {
+			fat32Entry entry;
+			uint64_t start = nowNs();
+			int result = fat32Stat(v, tree.dirs[d].parent, tree.dirs[d].name, &entry);
+			addSample(&samples, nowNs() - start);
+			if(result != FAT32_OK || entry.firstClus != tree.dirs[d].clus) {
+				fprintf(stderr, "CD %s went to the wrong place\n", tree.dirs[d].name);
+			}
+		}
+	}
+	reportPhase("CD", &samples);
+
+	char scratch[] = "/tmp/fat32bench.XXXXXX";
+	if(mkdtemp(scratch) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	int gets = tree.fileCount < maxGets ? tree.fileCount : maxGets;
+	startPhase(&samples);
+	for(int f = 0; f < gets; f++) {
+		/* Spread the picks over the whole tree */
+		const fat32Entry *file = &tree.files[(int64_t)f*tree.fileCount/gets];
+		char hostPath[PATH_MAX];
+		snprintf(hostPath, PATH_MAX, "%s/%s", scratch, file->name);
+		uint64_t start = nowNs();
+		uint32_t crc;
+		int result = fat32ExtractChecksum(v, file, hostPath, fat32ChecksumsEnabled(v) ? &crc : NULL);
+		addSample(&samples, nowNs() - start);
+		if(result != FAT32_OK) {
+			fprintf(stderr, "GET %s failed: %s\n", file->name, fat32Strerror(result));
+		}
+		samples.bytes += file->size;
+		unlink(hostPath);
+	}
+	reportPhase("GET", &samples);
+	rmdir(scratch);
+
+	fat32Close(v);
+	close(fd);
+	free(samples.ns);
+	free(tree.dirs);
+	free(tree.files);
+	return 0;
+}
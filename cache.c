@@ -0,0 +1,236 @@
+/* cache.c keeps recently read blocks of the image (whole clusters)
+* in memory, keyed by their first sector number. All blocks come out
+* of one slab allocated up front; when the cache is full the least
+* recently used block is reused. Lookups copy the block out under the
+* cache lock, so any number of threads can share one cache.
+* A block read from the image while a write to it was going on could
+* be the old data, so every invalidation bumps a generation count, and
+* a block is only put in if no invalidation happened since its read
+* started.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#include "cache.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define NO_ENTRY -1
+
+struct cacheEntry {
+    uint64_t sector;
+    int prev; // Towards the most recently used end
+    int next; // Towards the least recently used end
+    int hashNext; // Next entry in the same bucket
+    bool used;
+};
+
+struct blockCache {
+    unsigned char *slab; // capacity blocks of blockSize bytes
+    struct cacheEntry *entries;
+    int *buckets;
+    int bucketCount; // Power of two
+    int capacity;
+    int used;
+    uint32_t blockSize;
+    int mru; // Most recently used entry
+    int lru; // Least recently used entry, the next victim
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t generation; // Invalidations so far
+    pthread_mutex_t lock;
+};
+
+static int bucketOf(blockCache *c, uint64_t sector) {
+    /* Fibonacci hashing spreads consecutive cluster sectors out */
+    return (int)((sector*11400714819323198485ull) >> 32) & (c->bucketCount - 1);
+}
+
+static void *allocOrDie(size_t bytes) {
+    void *p = malloc(bytes);
+    if(p == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", bytes);
+        abort();
+    }
+    return p;
+}
+
+blockCache *createCache(int blocks, uint32_t blockSize) {
+    if(blocks < 1) {
+        return NULL;
+    }
+    blockCache *c = allocOrDie(sizeof(blockCache));
+    c->slab = allocOrDie((size_t)blocks*blockSize);
+    c->entries = allocOrDie(blocks*sizeof(struct cacheEntry));
+    c->bucketCount = 1;
+    while(c->bucketCount < 2*blocks) {
+        c->bucketCount *= 2;
+    }
+    c->buckets = allocOrDie(c->bucketCount*sizeof(int));
+    for(int i = 0; i < c->bucketCount; i++) {
+        c->buckets[i] = NO_ENTRY;
+    }
+    for(int i = 0; i < blocks; i++) {
+        c->entries[i].used = false;
+    }
+    c->capacity = blocks;
+    c->used = 0;
+    c->blockSize = blockSize;
+    c->mru = NO_ENTRY;
+    c->lru = NO_ENTRY;
+    c->hits = 0;
+    c->misses = 0;
+    c->generation = 0;
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+}
+
+void destroyCache(blockCache *c) {
+    if(c == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&c->lock);
+    free(c->buckets);
+    free(c->entries);
+    free(c->slab);
+    free(c);
+}
+
+static int findEntryLocked(blockCache *c, uint64_t sector) {
+    for(int i = c->buckets[bucketOf(c, sector)]; i != NO_ENTRY; i = c->entries[i].hashNext) {
+        if(c->entries[i].sector == sector) {
+            return i;
+        }
+    }
+    return NO_ENTRY;
+}
+
+static void unlinkLocked(blockCache *c, int i) {
+    struct cacheEntry *e = &c->entries[i];
+    if(e->prev != NO_ENTRY) {
+        c->entries[e->prev].next = e->next;
+    }
+    else {
+        c->mru = e->next;
+    }
+    if(e->next != NO_ENTRY) {
+        c->entries[e->next].prev = e->prev;
+    }
+    else {
+        c->lru = e->prev;
+    }
+}
+
+static void pushFrontLocked(blockCache *c, int i) {
+    struct cacheEntry *e = &c->entries[i];
+    e->prev = NO_ENTRY;
+    e->next = c->mru;
+    if(c->mru != NO_ENTRY) {
+        c->entries[c->mru].prev = i;
+    }
+    c->mru = i;
+    if(c->lru == NO_ENTRY) {
+        c->lru = i;
+    }
+}
+
+static void unhashLocked(blockCache *c, int i) {
+    int *link = &c->buckets[bucketOf(c, c->entries[i].sector)];
+    while(*link != i) {
+        link = &c->entries[*link].hashNext;
+    }
+    *link = c->entries[i].hashNext;
+}
+
+/* Copy the block starting at sector into dst. Returns false on a miss. */
+bool cacheGet(blockCache *c, uint64_t sector, void *dst) {
+    pthread_mutex_lock(&c->lock);
+    int i = findEntryLocked(c, sector);
+    if(i == NO_ENTRY) {
+        c->misses++;
+        pthread_mutex_unlock(&c->lock);
+        return false;
+    }
+    c->hits++;
+    unlinkLocked(c, i);
+    pushFrontLocked(c, i);
+    memcpy(dst, c->slab + (size_t)i*c->blockSize, c->blockSize);
+    pthread_mutex_unlock(&c->lock);
+    return true;
+}
+
+/* The generation to pass to cachePut, taken before reading the block */
+uint64_t cacheGeneration(blockCache *c) {
+    pthread_mutex_lock(&c->lock);
+    uint64_t generation = c->generation;
+    pthread_mutex_unlock(&c->lock);
+    return generation;
+}
+
+/* Remember the block starting at sector, evicting the LRU block if full.
+    Nothing is kept if anything was invalidated since generation. */
+void cachePut(blockCache *c, uint64_t sector, const void *src, uint64_t generation) {
+    pthread_mutex_lock(&c->lock);
+    if(c->generation != generation) {
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+    int i = findEntryLocked(c, sector);
+    if(i != NO_ENTRY) {
+        unlinkLocked(c, i);
+    }
+    else if(c->used < c->capacity) {
+        i = c->used++;
+    }
+    else {
+        i = c->lru;
+        unlinkLocked(c, i);
+        if(c->entries[i].used) {
+            unhashLocked(c, i);
+            c->entries[i].used = false;
+        }
+    }
+    if(!c->entries[i].used) {
+        int b = bucketOf(c, sector);
+        c->entries[i].sector = sector;
+        c->entries[i].hashNext = c->buckets[b];
+        c->buckets[b] = i;
+        c->entries[i].used = true;
+    }
+    pushFrontLocked(c, i);
+    memcpy(c->slab + (size_t)i*c->blockSize, src, c->blockSize);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Forget the block starting at sector, after the image was written there */
+void cacheInvalidate(blockCache *c, uint64_t sector) {
+    pthread_mutex_lock(&c->lock);
+    c->generation++;
+    int i = findEntryLocked(c, sector);
+    if(i != NO_ENTRY) {
+        /* Move it to the victim end, marked unused, so the slot is reused first */
+        unlinkLocked(c, i);
+        unhashLocked(c, i);
+        c->entries[i].used = false;
+        c->entries[i].prev = c->lru;
+        c->entries[i].next = NO_ENTRY;
+        if(c->lru != NO_ENTRY) {
+            c->entries[c->lru].next = i;
+        }
+        else {
+            c->mru = i;
+        }
+        c->lru = i;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void cacheCounters(blockCache *c, uint64_t *hits, uint64_t *misses, int *used, int *capacity) {
+    pthread_mutex_lock(&c->lock);
+    *hits = c->hits;
+    *misses = c->misses;
+    *used = c->used;
+    *capacity = c->capacity;
+    pthread_mutex_unlock(&c->lock);
+}
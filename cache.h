@@ -0,0 +1,21 @@
+/* A fixed capacity LRU cache of image blocks.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+typedef struct blockCache blockCache;
+
+blockCache *createCache(int blocks, uint32_t blockSize);
+void destroyCache(blockCache *c);
+bool cacheGet(blockCache *c, uint64_t sector, void *dst);
+uint64_t cacheGeneration(blockCache *c);
+void cachePut(blockCache *c, uint64_t sector, const void *src, uint64_t generation);
+void cacheInvalidate(blockCache *c, uint64_t sector);
+void cacheCounters(blockCache *c, uint64_t *hits, uint64_t *misses, int *used, int *capacity);
+
+#endif
@@ -0,0 +1,141 @@
+/* checksum.c computes CRC32C, the checksum iSCSI, ext4 and btrfs use,
+* so a GET can be checked against the same sum made anywhere else.
+* On x86 with SSE4.2 the crc32 instruction does 8 bytes at a time. One
+* instruction has to wait for the last, so long buffers are cut into
+* three lanes run side by side and joined with a table that moves a
+* lane's CRC past the bytes that follow it. Other CPUs use
+* slicing-by-8 tables. Both are set up once, on first use.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#include "checksum.h"
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78 // Reflected
+#define LANE_BYTES 8192 // Bytes each of the three lanes takes per round
+
+static uint32_t slice[8][256]; // slice[k][b]: b followed by k zero bytes
+static uint32_t laneShift[4][256]; // Moves a CRC past LANE_BYTES bytes, one table per byte of it
+static bool accelerated;
+static pthread_once_t setupOnce = PTHREAD_ONCE_INIT;
+
+/* The raw (not inverted) CRC of LANE_BYTES zero bytes after crc */
+static uint32_t shiftSlow(uint32_t crc) {
+    for(int i = 0; i < LANE_BYTES; i++) {
+        crc = slice[0][crc & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static void setup(void) {
+    for(int b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        }
+        slice[0][b] = crc;
+    }
+    for(int k = 1; k < 8; k++) {
+        for(int b = 0; b < 256; b++) {
+            slice[k][b] = slice[0][slice[k-1][b] & 0xff] ^ (slice[k-1][b] >> 8);
+        }
+    }
+    /* Shifting is linear, so it is enough to shift each bit once */
+    uint32_t bits[32];
+    for(int i = 0; i < 32; i++) {
+        bits[i] = shiftSlow(1u << i);
+    }
+    for(int k = 0; k < 4; k++) {
+        for(int b = 0; b < 256; b++) {
+            uint32_t shifted = 0;
+            for(int i = 0; i < 8; i++) {
+                if(b & (1 << i)) {
+                    shifted ^= bits[8*k + i];
+                }
+            }
+            laneShift[k][b] = shifted;
+        }
+    }
+#if defined(__x86_64__)
+    accelerated = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t shiftLane(uint32_t crc) {
+    return laneShift[0][crc & 0xff] ^ laneShift[1][(crc >> 8) & 0xff]
+        ^ laneShift[2][(crc >> 16) & 0xff] ^ laneShift[3][crc >> 24];
+}
+
+static uint32_t crcSoftware(uint32_t crc, const unsigned char *p, size_t len) {
+    while(len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = slice[7][word & 0xff] ^ slice[6][(word >> 8) & 0xff]
+            ^ slice[5][(word >> 16) & 0xff] ^ slice[4][(word >> 24) & 0xff]
+            ^ slice[3][(word >> 32) & 0xff] ^ slice[2][(word >> 40) & 0xff]
+            ^ slice[1][(word >> 48) & 0xff] ^ slice[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while(len-- > 0) {
+        crc = slice[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crcHardware(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c0 = crc;
+    while(len >= 3*LANE_BYTES) {
+        uint64_t c1 = 0;
+        uint64_t c2 = 0;
+        for(int i = 0; i < LANE_BYTES; i += 8) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + LANE_BYTES + i, 8);
+            memcpy(&w2, p + 2*LANE_BYTES + i, 8);
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        c0 = shiftLane(shiftLane((uint32_t)c0) ^ (uint32_t)c1) ^ (uint32_t)c2;
+        p += 3*LANE_BYTES;
+        len -= 3*LANE_BYTES;
+    }
+    while(len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        c0 = _mm_crc32_u64(c0, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c0;
+    while(len-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32cUpdate(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&setupOnce, setup);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if(accelerated) {
+        return ~crcHardware(crc, buf, len);
+    }
+#endif
+    return ~crcSoftware(crc, buf, len);
+}
+
+/* Whether the crc32 instruction is being used */
+bool crc32cAccelerated(void) {
+    pthread_once(&setupOnce, setup);
+    return accelerated;
+}
@@ -0,0 +1,16 @@
+/* CRC32C (Castagnoli) of file data, computed as it streams.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Start with crc 0 and feed the data in any number of pieces */
+uint32_t crc32cUpdate(uint32_t crc, const void *buf, size_t len);
+bool crc32cAccelerated(void);
+
+#endif
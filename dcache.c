@@ -0,0 +1,210 @@
+/* dcache.c remembers directory entries found by name, so walking the
+* same path again is a hash lookup instead of a scan of every directory
+* on the way. Entries are keyed by (first cluster of the directory,
+* "NAME.EXT") and hold the 32 byte entry as it is on disk. Like the
+* block cache, all entries come out of one array allocated up front,
+* the least recently used one is reused when full, and one lock makes
+* the cache safe to share between threads.
+* Only entries that exist are cached. New entries can't make a cached
+* one wrong, so PUT needs no invalidation; anything that moves or
+* removes entries must call dentryClear.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#include "dcache.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define NO_ENTRY -1
+
+struct dentry {
+    uint32_t dirClus;
+    char name[DIR_PRINT_NAME_LENGTH];
+    fat32Dir dir;
+    int prev; // Towards the most recently used end
+    int next; // Towards the least recently used end
+    int hashNext; // Next entry in the same bucket
+    bool used;
+};
+
+struct dentryCache {
+    struct dentry *entries;
+    int *buckets;
+    int bucketCount; // Power of two
+    int capacity;
+    int used;
+    int mru; // Most recently used entry
+    int lru; // Least recently used entry, the next victim
+    uint64_t hits;
+    uint64_t misses;
+    pthread_mutex_t lock;
+};
+
+static int bucketOf(dentryCache *d, uint32_t dirClus, const char *name) {
+    /* FNV-1a over the name, seeded with the directory */
+    uint64_t hash = 14695981039346656037ull ^ dirClus;
+    for(const unsigned char *p = (const unsigned char*)name; *p != '\0'; p++) {
+        hash = (hash ^ *p)*1099511628211ull;
+    }
+    return (int)(hash ^ (hash >> 32)) & (d->bucketCount - 1);
+}
+
+static void *allocOrDie(size_t bytes) {
+    void *p = malloc(bytes);
+    if(p == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", bytes);
+        abort();
+    }
+    return p;
+}
+
+dentryCache *createDentryCache(int entries) {
+    if(entries < 1) {
+        return NULL;
+    }
+    dentryCache *d = allocOrDie(sizeof(dentryCache));
+    d->entries = allocOrDie(entries*sizeof(struct dentry));
+    d->bucketCount = 1;
+    while(d->bucketCount < 2*entries) {
+        d->bucketCount *= 2;
+    }
+    d->buckets = allocOrDie(d->bucketCount*sizeof(int));
+    d->capacity = entries;
+    d->hits = 0;
+    d->misses = 0;
+    pthread_mutex_init(&d->lock, NULL);
+    dentryClear(d);
+    return d;
+}
+
+void destroyDentryCache(dentryCache *d) {
+    if(d == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&d->lock);
+    free(d->buckets);
+    free(d->entries);
+    free(d);
+}
+
+static int findEntryLocked(dentryCache *d, uint32_t dirClus, const char *name) {
+    for(int i = d->buckets[bucketOf(d, dirClus, name)]; i != NO_ENTRY; i = d->entries[i].hashNext) {
+        if(d->entries[i].dirClus == dirClus && strcmp(d->entries[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return NO_ENTRY;
+}
+
+static void unlinkLocked(dentryCache *d, int i) {
+    struct dentry *e = &d->entries[i];
+    if(e->prev != NO_ENTRY) {
+        d->entries[e->prev].next = e->next;
+    }
+    else {
+        d->mru = e->next;
+    }
+    if(e->next != NO_ENTRY) {
+        d->entries[e->next].prev = e->prev;
+    }
+    else {
+        d->lru = e->prev;
+    }
+}
+
+static void pushFrontLocked(dentryCache *d, int i) {
+    struct dentry *e = &d->entries[i];
+    e->prev = NO_ENTRY;
+    e->next = d->mru;
+    if(d->mru != NO_ENTRY) {
+        d->entries[d->mru].prev = i;
+    }
+    d->mru = i;
+    if(d->lru == NO_ENTRY) {
+        d->lru = i;
+    }
+}
+
+static void unhashLocked(dentryCache *d, int i) {
+    int *link = &d->buckets[bucketOf(d, d->entries[i].dirClus, d->entries[i].name)];
+    while(*link != i) {
+        link = &d->entries[*link].hashNext;
+    }
+    *link = d->entries[i].hashNext;
+}
+
+/* Copy the entry called name in the directory starting at dirClus into
+    dir. Returns false on a miss. */
+bool dentryGet(dentryCache *d, uint32_t dirClus, const char *name, fat32Dir *dir) {
+    pthread_mutex_lock(&d->lock);
+    int i = findEntryLocked(d, dirClus, name);
+    if(i == NO_ENTRY) {
+        d->misses++;
+        pthread_mutex_unlock(&d->lock);
+        return false;
+    }
+    d->hits++;
+    unlinkLocked(d, i);
+    pushFrontLocked(d, i);
+    memcpy(dir, &d->entries[i].dir, sizeof(fat32Dir));
+    pthread_mutex_unlock(&d->lock);
+    return true;
+}
+
+/* Remember an entry, evicting the LRU one if full */
+void dentryPut(dentryCache *d, uint32_t dirClus, const char *name, const fat32Dir *dir) {
+    if(strlen(name) >= DIR_PRINT_NAME_LENGTH) {
+        return;
+    }
+    pthread_mutex_lock(&d->lock);
+    int i = findEntryLocked(d, dirClus, name);
+    if(i != NO_ENTRY) {
+        unlinkLocked(d, i);
+    }
+    else if(d->used < d->capacity) {
+        i = d->used++;
+    }
+    else {
+        i = d->lru;
+        unlinkLocked(d, i);
+        unhashLocked(d, i);
+        d->entries[i].used = false;
+    }
+    if(!d->entries[i].used) {
+        int b = bucketOf(d, dirClus, name);
+        d->entries[i].dirClus = dirClus;
+        strcpy(d->entries[i].name, name);
+        d->entries[i].hashNext = d->buckets[b];
+        d->buckets[b] = i;
+        d->entries[i].used = true;
+    }
+    pushFrontLocked(d, i);
+    memcpy(&d->entries[i].dir, dir, sizeof(fat32Dir));
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* Forget every entry, after entries were moved or removed on disk */
+void dentryClear(dentryCache *d) {
+    pthread_mutex_lock(&d->lock);
+    for(int i = 0; i < d->bucketCount; i++) {
+        d->buckets[i] = NO_ENTRY;
+    }
+    for(int i = 0; i < d->capacity; i++) {
+        d->entries[i].used = false;
+    }
+    d->used = 0;
+    d->mru = NO_ENTRY;
+    d->lru = NO_ENTRY;
+    pthread_mutex_unlock(&d->lock);
+}
+
+void dentryCounters(dentryCache *d, uint64_t *hits, uint64_t *misses, int *used, int *capacity) {
+    pthread_mutex_lock(&d->lock);
+    *hits = d->hits;
+    *misses = d->misses;
+    *used = d->used;
+    *capacity = d->capacity;
+    pthread_mutex_unlock(&d->lock);
+}
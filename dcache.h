@@ -0,0 +1,24 @@
+/* A fixed capacity LRU cache of directory entries, keyed by the
+* directory they are in and their name.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "fat32.h"
+
+#define DCACHE_DEFAULT_ENTRIES 4096
+
+typedef struct dentryCache dentryCache;
+
+dentryCache *createDentryCache(int entries);
+void destroyDentryCache(dentryCache *d);
+bool dentryGet(dentryCache *d, uint32_t dirClus, const char *name, fat32Dir *dir);
+void dentryPut(dentryCache *d, uint32_t dirClus, const char *name, const fat32Dir *dir);
+void dentryClear(dentryCache *d);
+void dentryCounters(dentryCache *d, uint64_t *hits, uint64_t *misses, int *used, int *capacity);
+
+#endif
@@ -0,0 +1,243 @@
+/* defrag.c rewrites every fragmented file into one free run, so a GET
+* of it becomes a single sequential read. Files are found by walking
+* the tree from the root; each one in more than one extent gets a new
+* chain from the allocator, searched first-fit from cluster 2 so files
+* pack towards the start of the volume. Only a single run will do: if
+* the allocator can't find one, the new clusters go straight back.
+* A file is moved so that a crash at any point leaves it readable:
+* 1. its data is copied into the new run,
+* 2. the FAT is flushed, so the new chain is on disk in every copy,
+* 3. the directory entry is pointed at the new chain,
+* 4. the old chain is freed (on disk with the next file's flush).
+* A crash between 3 and 4 at worst leaves the old chain lost, which
+* FSCK finds. Directories are left where they are: moving one means
+* rewriting the ".." of every folder inside it too.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include "defrag.h"
+#include "alloc.h"
+#include "transfer.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#define FAT_EOC_MIN 0x0FFFFFF8
+
+/* A file found by the walk */
+struct defragFile {
+    char path[PATH_MAX];
+    off_t entryOffset; // Of its 32 byte directory entry in the image
+    uint32_t firstClus;
+    uint32_t size;
+};
+
+struct defragList {
+    struct defragFile *files;
+    int count;
+    int capacity;
+};
+
+/* A directory still to be walked */
+struct defragDir {
+    uint32_t clus;
+    char path[PATH_MAX];
+};
+
+static void *growOrDie(void *p, size_t bytes) {
+    p = realloc(p, bytes);
+    if(p == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", bytes);
+        abort();
+    }
+    return p;
+}
+
+/* Every file with data, breadth first from the root. Directories are
+    only walked once, in case the tree loops. */
+static void collectFiles(int fd, fat32Head* h, struct defragList *list) {
+    uint64_t *seen = calloc(h->fatEntries/64 + 1, sizeof(uint64_t));
+    int capacity = 16;
+    int head = 0;
+    int tail = 0;
+    struct defragDir *queue = growOrDie(NULL, capacity*sizeof(struct defragDir));
+    if(seen == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", (h->fatEntries/64 + 1)*sizeof(uint64_t));
+        abort();
+    }
+    queue[tail].clus = h->bs->BPB_RootClus;
+    strcpy(queue[tail++].path, "");
+    seen[h->bs->BPB_RootClus/64] |= 1ULL << (h->bs->BPB_RootClus % 64);
+
+    while(head < tail) {
+        struct defragDir dir = queue[head++];
+        fat32DirIter it;
+        fat32Dir *entry;
+        openDirIter(&it, fd, h, dir.clus);
+        while((entry = nextDirEntry(&it)) != NULL) {
+            if(entry->DIR_Attr & ATTR_VOLUME_ID || entry->DIR_Name[0] == '.') {
+                continue;
+            }
+            char name[DIR_PRINT_NAME_LENGTH];
+            char path[PATH_MAX];
+            formatDirName(entry, name);
+            if(snprintf(path, PATH_MAX, "%s/%s", dir.path, name) >= PATH_MAX) {
+                continue;
+            }
+            uint32_t clus = ((uint32_t)entry->DIR_FstClusHI<<16) + entry->DIR_FstClusLO;
+            if(clus < 2 || clus >= h->fatEntries) {
+                continue;
+            }
+            if(entry->DIR_Attr & ATTR_DIRECTORY) {
+                if(seen[clus/64] & (1ULL << (clus % 64))) {
+                    continue;
+                }
+                seen[clus/64] |= 1ULL << (clus % 64);
+                if(tail == capacity) {
+                    /* Walked directories are dropped from the front first */
+                    memmove(queue, queue + head, (tail - head)*sizeof(struct defragDir));
+                    tail -= head;
+                    head = 0;
+                    if(tail == capacity) {
+                        capacity *= 2;
+                        queue = growOrDie(queue, capacity*sizeof(struct defragDir));
+                    }
+                }
+                queue[tail].clus = clus;
+                strcpy(queue[tail++].path, path);
+                continue;
+            }
+            if(list->count == list->capacity) {
+                list->capacity *= 2;
+                list->files = growOrDie(list->files, list->capacity*sizeof(struct defragFile));
+            }
+            struct defragFile *file = &list->files[list->count++];
+            strcpy(file->path, path);
+            file->entryOffset = clusterOffset(h, it.clus) + (off_t)(it.index - 1)*sizeof(fat32Dir);
+            file->firstClus = clus;
+            file->size = entry->DIR_FileSize;
+        }
+        closeDirIter(&it);
+    }
+    free(queue);
+    free(seen);
+}
+
+/* Copy the data of the old extents into the run starting at to */
+static bool copyToRun(int fd, fat32Head* h, const fat32Extent *extents, int extentCount, uint32_t to, char *buf) {
+    off_t dst = clusterOffset(h, to);
+    for(int e = 0; e < extentCount; e++) {
+        off_t src = clusterOffset(h, extents[e].clus);
+        uint64_t len = (uint64_t)extents[e].count*clusterBytes(h);
+        while(len > 0) {
+            size_t chunk = len > TRANSFER_CHUNK_SIZE ? TRANSFER_CHUNK_SIZE : len;
+            const void *data = imagePtr(h, src, chunk);
+            if(data == NULL) {
+                if(readImage(fd, h, src, buf, chunk) != (ssize_t)chunk) {
+                    return false;
+                }
+                data = buf;
+            }
+            if(writeImage(fd, h, dst, data, chunk) != (ssize_t)chunk) {
+                return false;
+            }
+            src += chunk;
+            dst += chunk;
+            len -= chunk;
+        }
+    }
+    return true;
+}
+
+/* Point the directory entry at offset to firstClus, if it still holds
+    the chain the walk found */
+static bool repointEntry(int fd, fat32Head* h, off_t offset, uint32_t oldClus, uint32_t firstClus) {
+    fat32Dir entry;
+    if(readImage(fd, h, offset, &entry, sizeof(fat32Dir)) != sizeof(fat32Dir)
+        || ((uint32_t)entry.DIR_FstClusHI<<16) + entry.DIR_FstClusLO != oldClus) {
+        return false;
+    }
+    entry.DIR_FstClusHI = firstClus >> 16;
+    entry.DIR_FstClusLO = firstClus & 0xFFFF;
+    return writeImage(fd, h, offset, &entry, sizeof(fat32Dir)) == sizeof(fat32Dir);
+}
+
+/* Make every fragmented file contiguous where a free run allows. The
+    caller holds off other writers and checked there are no cross-links,
+    since freeing a shared chain would take it from the other file. fn,
+    when not NULL, is told about every file moved. */
+void defragVolume(int fd, fat32Head* h, fat32DefragReport *report, fat32DefragFn fn, void *arg) {
+    memset(report, 0, sizeof(fat32DefragReport));
+    struct defragList list;
+    list.count = 0;
+    list.capacity = 64;
+    list.files = growOrDie(NULL, list.capacity*sizeof(struct defragFile));
+    collectFiles(fd, h, &list);
+    char *buf = growOrDie(NULL, TRANSFER_CHUNK_SIZE);
+
+    for(int f = 0; f < list.count; f++) {
+        struct defragFile *file = &list.files[f];
+        fat32Extent *extents;
+        int extentCount = buildExtents(fd, h, file->firstClus, &extents);
+        report->files++;
+        report->extentsBefore += extentCount;
+        report->extentsAfter += extentCount;
+        if(extentCount <= 1) {
+            free(extents);
+            continue;
+        }
+        report->fragmented++;
+
+        /* Only whole, properly ended chains are moved */
+        uint64_t clusters = 0;
+        for(int e = 0; e < extentCount; e++) {
+            clusters += extents[e].count;
+        }
+        fat32Extent *last = &extents[extentCount-1];
+        uint32_t end = getFATEntryForClusterN(fd, last->clus + last->count - 1, h);
+        if(end < FAT_EOC_MIN || clusters != ((uint64_t)file->size + clusterBytes(h) - 1)/clusterBytes(h)) {
+            report->damaged++;
+            free(extents);
+            continue;
+        }
+
+        fat32Extent *run;
+        int runs = allocateExtents(h, clusters, 2, &run);
+        if(runs != 1) {
+            if(runs > 1) {
+                freeChain(h, run[0].clus);
+                free(run);
+            }
+            report->noRoom++;
+            free(extents);
+            continue;
+        }
+        uint32_t to = run[0].clus;
+        free(run);
+
+        if(!copyToRun(fd, h, extents, extentCount, to, buf) || flushFAT(fd, h) == -1
+            || !repointEntry(fd, h, file->entryOffset, file->firstClus, to)) {
+            /* The entry still points at the old chain, which is intact */
+            freeChain(h, to);
+            report->failed++;
+            free(extents);
+            continue;
+        }
+        freeChain(h, file->firstClus);
+        report->moved++;
+        report->clustersMoved += clusters;
+        report->extentsAfter -= extentCount - 1;
+        if(fn != NULL) {
+            fn(file->path, extentCount, 1, arg);
+        }
+        free(extents);
+    }
+    if(flushFAT(fd, h) == -1) {
+        report->failed++;
+    }
+    free(buf);
+    free(list.files);
+}
@@ -0,0 +1,13 @@
+/* Making fragmented files contiguous.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include <inttypes.h>
+#include "fat32.h"
+
+void defragVolume(int fd, fat32Head* h, fat32DefragReport *report, fat32DefragFn fn, void *arg);
+
+#endif
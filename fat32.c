@@ -8,45 +8,117 @@
 #define _FILE_OFFSET_BITS 64
 
 #include "fat32.h"
+#include "cache.h"
+#include "stats.h"
+#include "sidecar.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define BYTE_PER_FAT_ENTRY 4
 #define FAT_FIRST_ENTRY 0x0FFFFFF8 
 #define FAT_SECOND_ENTRY 0xFFFFFFFF
+#define FAT_ENTRY_MASK 0x0FFFFFFF
+#define FAT_EOC 0x0FFFFFFF
+#define FAT_EOC_MIN 0x0FFFFFF8
 
-unsigned char *buffer;
+/* Map the whole image into memory. On failure the head simply stays
+    on the read() path. */
+static void mapImage(int fd, fat32Head* h, int opts) {
+    struct stat st;
+    if(fstat(fd, &st) == -1) {
+        perror("Stat failed");
+        return;
+    }
+    if(st.st_size <= 0) {
+        fprintf(stderr, "Image is empty, not mapping it.\n");
+        return;
+    }
+    int prot = PROT_READ;
+    if(opts & FAT32_OPT_WRITE) {
+        prot |= PROT_WRITE;
+    }
+    void *map = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        perror("Mmap failed, falling back to read()");
+        return;
+    }
+    h->map = map;
+    h->mapSize = st.st_size;
+}
 
 /* Initialize FAT32's head struct, load in BPB */
-fat32Head* createHead(int fd) {
-    buffer = malloc(BUFFER_SIZE);
-    if(buffer == NULL) {
-        fprintf(stderr, "Fatal: failed to allocate %d bytes.\n", BUFFER_SIZE);
-        abort();
-    }
+fat32Head* createHead(int fd, const fat32Options *options) {
+    int opts = options->flags;
     fat32Head* h = (fat32Head*)(malloc(sizeof(fat32Head)));
     if(h == NULL) {
         fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(fat32Head));
         abort();
     }
-    fat32BS *bs = (fat32BS*)(malloc(sizeof(fat32BS)));
-    if(bs == NULL) {
-        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(fat32BS));
-        abort();
+    h->bs = NULL;
+    h->fsi = NULL;
+    h->dir = NULL;
+    h->fat = NULL;
+    h->fatEntries = 0;
+    h->map = NULL;
+    h->mapSize = 0;
+    h->writable = (opts & FAT32_OPT_WRITE) != 0;
+    h->prefetch = options->prefetchClusters > 0 ? options->prefetchClusters : 0;
+    h->opts = opts;
+    h->cache = NULL;
+    h->clusterCount = 0;
+    h->freeMap = NULL;
+    h->freeMapWords = 0;
+    h->freeCount = 0;
+    h->fatDirty = NULL;
+    h->fatSectors = 0;
+    h->fatDirtyCount = 0;
+    h->fsiDirty = false;
+    h->stats = NULL;
+    h->index = NULL;
+    pthread_mutex_init(&h->lock, NULL);
+
+    if(opts & FAT32_OPT_MMAP) {
+        mapImage(fd, h, opts);
     }
-    
-    // Read first 512 bytes -> boot sector
-    int bs_count = read(fd, buffer, sizeof(fat32BS));
-    if (!bs_count) {
-        printf("Error (%d) - Boot Sector \n", bs_count);
-        return NULL;
+
+    /* With a mapped image the boot sector is used in place */
+    fat32BS *bs = (fat32BS*)imagePtr(h, 0, sizeof(fat32BS));
+    if(bs == NULL) {
+        bs = (fat32BS*)(malloc(sizeof(fat32BS)));
+        if(bs == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(fat32BS));
+            abort();
+        }
+        // Read first 512 bytes -> boot sector
+        int bs_count = readImage(fd, h, 0, bs, sizeof(fat32BS));
+        if (bs_count != sizeof(fat32BS)) {
+            printf("Error (%d) - Boot Sector \n", bs_count);
+            free(bs);
+            if(h->map != NULL) {
+                munmap(h->map, h->mapSize);
+            }
+            pthread_mutex_destroy(&h->lock);
+            free(h);
+            return NULL;
+        }
     }
-    memcpy(bs, buffer, sizeof(fat32BS));
     h->bs = bs;
 
+    /* A mapped image is already in memory, only the read() path gets a cache */
+    if(h->map == NULL && bs->BPB_BytesPerSec != 0 && bs->BPB_SecPerClus != 0) {
+        h->cache = createCache(options->cacheBlocks, clusterBytes(h));
+    }
+    if((opts & FAT32_OPT_STATS) || options->statsJson != NULL || options->statsTrace != NULL) {
+        h->stats = createStats(options->statsJson, options->statsTrace);
+    }
+
     return h;
 }
 
@@ -56,68 +128,71 @@ int checkIfFAT32(fat32Head* h) {
     return TotalDataSec/h->bs->BPB_SecPerClus; // CountofClusters
 } 
 
-/* Check the first two entries of FAT, which stores signatures */
+/* Check the first two entries of FAT, which stores signatures.
+    loadFAT must have been called first. */
 bool checkFATSig(int fd, fat32Head *h) {
-    /* Get to FAT position */
-    int seek = lseek(fd, h->bs->BPB_RsvdSecCnt*h->bs->BPB_BytesPerSec, SEEK_SET);
-    if(seek == -1) {
-        perror("Seek failed.\n");
-    }
-    uint32_t *FAT1 = malloc(BYTE_PER_FAT_ENTRY);
-    if(FAT1 == NULL) {
-        fprintf(stderr, "Fatal: failed to allocate %d bytes.\n", BYTE_PER_FAT_ENTRY);
-        abort();
-    }
-    
-    /* Read the signature in first FAT entry */
-    int readd = read(fd, FAT1, BYTE_PER_FAT_ENTRY);
-    if(readd == -1) {
-        perror("Read failed.\n");
-    }
-    uint32_t *FAT2 = malloc(BYTE_PER_FAT_ENTRY);
-    if(FAT2 == NULL) {
-        fprintf(stderr, "Fatal: failed to allocate %d bytes.\n", BYTE_PER_FAT_ENTRY);
-        abort();
-    }
-    seek = lseek(fd, h->bs->BPB_RsvdSecCnt*h->bs->BPB_BytesPerSec+BYTE_PER_FAT_ENTRY, SEEK_SET);
-    if(seek == -1) {
-        perror("Seek failed.\n");
+    if(h->fat == NULL || h->fatEntries < 2) {
+        return 0;
     }
-    /* Read the signature in second FAT entry */
-    readd = read(fd, FAT2, BYTE_PER_FAT_ENTRY);
-    if(readd == -1) {
-        perror("Read failed.\n");
+    return h->fat[0] == FAT_FIRST_ENTRY && h->fat[1] == FAT_SECOND_ENTRY;
+}
+
+/* Read the whole first FAT into memory in one pass, so that following
+    a cluster chain never has to touch the disk again. A read-only
+    mapped image uses the FAT straight out of the map. */
+void loadFAT(int fd, fat32Head* h) {
+    off_t fatOffset = (off_t)h->bs->BPB_RsvdSecCnt*h->bs->BPB_BytesPerSec;
+    size_t fatBytes = (size_t)h->bs->BPB_FATSz32*h->bs->BPB_BytesPerSec;
+    uint32_t *fat = NULL;
+    if(!h->writable) {
+        fat = (uint32_t*)imagePtr(h, fatOffset, fatBytes);
     }
-    if(FAT1[0] == FAT_FIRST_ENTRY && FAT2[0] == FAT_SECOND_ENTRY) {
-        free(FAT1);
-        free(FAT2);
-        return 1;
+    if(fat == NULL) {
+        fat = malloc(fatBytes);
+        if(fat == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", fatBytes);
+            abort();
+        }
+        ssize_t readd = readImage(fd, h, fatOffset, fat, fatBytes);
+        if(readd < 0) {
+            readd = 0;
+        }
+        fatBytes = readd;
     }
-    else {
-        free(FAT1);
-        free(FAT2);
-        return 0;
+    h->fat = fat;
+    h->fatEntries = fatBytes/BYTE_PER_FAT_ENTRY;
+    h->clusterCount = checkIfFAT32(h);
+
+    /* A writable FAT is a private copy, changes are tracked per sector */
+    if(h->writable) {
+        h->fatSectors = fatBytes/h->bs->BPB_BytesPerSec;
+        h->fatDirty = calloc((h->fatSectors + 63)/64 + 1, sizeof(uint64_t));
+        if(h->fatDirty == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate the FAT dirty map.\n");
+            abort();
+        }
     }
 }
 
 /* Given a file descriptor and a FAT32 header, load up FSInfo Secctor 
-    aka. Sector 1 in Reserved Area */
+    aka. Sector 1 in Reserved Area. A writable FSInfo is a private copy,
+    like the FAT, so it only reaches the image through flushFAT. */
 void loadFSI(int fd, fat32Head* h) {
-    FSI *fsi = (FSI*)(malloc(sizeof(FSI)));
-    if(fsi == NULL) {
-        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(FSI));
-        abort();
+    off_t offset = (off_t)h->bs->BPB_FSInfo*h->bs->BPB_BytesPerSec;
+    FSI *fsi = NULL;
+    if(!h->writable) {
+        fsi = (FSI*)imagePtr(h, offset, sizeof(FSI));
     }
-    /* Skipping 512 Byte (Sector 0 aka BPB) */
-    int seek = lseek(fd, h->bs->BPB_FSInfo*h->bs->BPB_BytesPerSec, SEEK_SET);
-    if(seek == -1) {
-        perror("Seek failed.\n");
-    }
-    int readd = read(fd, buffer, h->bs->BPB_BytesPerSec*1);
-    if(readd == -1) {
-        perror("Read failed.\n");
+    if(fsi == NULL) {
+        fsi = (FSI*)(malloc(sizeof(FSI)));
+        if(fsi == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(FSI));
+            abort();
+        }
+        /* Skipping 512 Byte (Sector 0 aka BPB) */
+        memset(fsi, 0, sizeof(FSI));
+        readImage(fd, h, offset, fsi, sizeof(FSI));
     }
-    memcpy(fsi, buffer, sizeof(FSI));
     h->fsi = fsi;
 }
 
@@ -125,23 +200,42 @@ void loadFSI(int fd, fat32Head* h) {
     from the first sector of Cluster 2 */
 void loadRootDir(int fd, fat32Head* h, int FirstDataSector) {
     // First, skip reserved area + 2*FAT in bytes
-    int seek = lseek(fd, FirstDataSector*h->bs->BPB_BytesPerSec, SEEK_SET);
-    if(seek == -1) {
-        perror("Seek failed.\n");
-    }
-    fat32Dir *dir = (fat32Dir*)(malloc(sizeof(fat32Dir)));
+    off_t offset = (off_t)FirstDataSector*h->bs->BPB_BytesPerSec;
+    fat32Dir *dir = (fat32Dir*)imagePtr(h, offset, sizeof(fat32Dir));
     if(dir == NULL) {
-        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(fat32Dir));
-        abort();
-    }
-    int readd = read(fd, buffer, sizeof(fat32Dir));
-    if(readd == -1) {
-        perror("Read failed.\n");
+        dir = (fat32Dir*)(malloc(sizeof(fat32Dir)));
+        if(dir == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(fat32Dir));
+            abort();
+        }
+        memset(dir, 0, sizeof(fat32Dir));
+        readImage(fd, h, offset, dir, sizeof(fat32Dir));
     }
-    memcpy(dir, buffer,  sizeof(fat32Dir));
     h->dir = dir;
 }
 
+/* Release everything createHead and the load functions handed out */
+void destroyHead(fat32Head* h) {
+    releaseImageBlock(h, h->fat);
+    releaseImageBlock(h, h->fsi);
+    releaseImageBlock(h, h->dir);
+    releaseImageBlock(h, h->bs);
+    if(h->map != NULL) {
+        munmap(h->map, h->mapSize);
+    }
+    uint64_t hits = 0, misses = 0;
+    int used, capacity;
+    if(h->cache != NULL) {
+        cacheCounters(h->cache, &hits, &misses, &used, &capacity);
+    }
+    destroyStats(h->stats, hits, misses);
+    destroyCache(h->cache);
+    closeSidecar(h->index);
+    free(h->freeMap);
+    free(h->fatDirty);
+    pthread_mutex_destroy(&h->lock);
+    free(h);
+}
 
 
 /*****************************HELPER FUNCTIONS**********************************/
@@ -153,25 +247,341 @@ int findFirstDataSectorOfClusterN(fat32Head* h, int N, int FirstDataSector) {
 }
 
 /*  A helper function that given a valid cluster number, 
-    where in the FAT32(s) is the entry for that cluster number? */
+    returns its entry in the in-memory FAT. Out of range clusters
+    are treated as the end of a chain. */
 uint32_t getFATEntryForClusterN(int fd, int N, fat32Head* h) {
-    int FATPosition = h->bs->BPB_RsvdSecCnt;
-    int FATOffset = N*BYTE_PER_FAT_ENTRY;
-    uint32_t *FAT = malloc(BYTE_PER_FAT_ENTRY);
-    if(FAT == NULL) {
-        fprintf(stderr, "Fatal: failed to allocate %d bytes.\n", BYTE_PER_FAT_ENTRY);
-        abort();
+    if(N < 0 || (uint32_t)N >= h->fatEntries) {
+        return FAT_EOC;
+    }
+    STAT_ADD(h->stats, fatLookups, 1);
+    return h->fat[N] & FAT_ENTRY_MASK;
+}
+
+/* Return a pointer to len bytes at offset in the mapped image,
+    or NULL when the image isn't mapped (or the range is outside it) */
+const void *imagePtr(fat32Head* h, off_t offset, size_t len) {
+    if(h->map == NULL || offset < 0 || (uint64_t)offset + len > h->mapSize) {
+        return NULL;
+    }
+    return h->map + offset;
+}
+
+/* Copy len bytes at offset in the image into dst, from the map when
+    there is one and with pread otherwise. pread leaves the shared file
+    offset alone, so any number of threads may call this at once.
+    Returns bytes copied or -1. */
+ssize_t readImage(int fd, fat32Head* h, off_t offset, void *dst, size_t len) {
+    if(h->map != NULL) {
+        if(offset < 0 || (uint64_t)offset >= h->mapSize) {
+            return 0;
+        }
+        if((uint64_t)offset + len > h->mapSize) {
+            len = h->mapSize - offset;
+        }
+        memcpy(dst, h->map + offset, len);
+        STAT_ADD(h->stats, mapReads, 1);
+        STAT_ADD(h->stats, bytesRead, len);
+        return len;
+    }
+    /* A single pread() may come back short on large requests, keep going */
+    size_t done = 0;
+    while(done < len) {
+        ssize_t readd = pread(fd, (char*)dst + done, len - done, offset + done);
+        STAT_ADD(h->stats, preads, 1);
+        if(readd <= 0) {
+            if(readd == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                perror("Read failed.\n");
+                return done > 0 ? (ssize_t)done : -1;
+            }
+            break;
+        }
+        done += readd;
+    }
+    STAT_ADD(h->stats, bytesRead, done);
+    return done;
+}
+
+/* Tell the kernel len bytes at offset will be read soon: madvise on the
+    map, posix_fadvise (which starts the same readahead as readahead())
+    otherwise. Only a hint, so failures are ignored. */
+void prefetchImage(int fd, fat32Head* h, off_t offset, uint64_t len) {
+    if(h->prefetch == 0 || len == 0 || offset < 0) {
+        return;
+    }
+    if(h->map != NULL) {
+        if((uint64_t)offset >= h->mapSize) {
+            return;
+        }
+        if((uint64_t)offset + len > h->mapSize) {
+            len = h->mapSize - offset;
+        }
+        /* madvise wants a page aligned start */
+        off_t start = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+        madvise(h->map + start, len + (offset - start), MADV_WILLNEED);
     }
-    int seek = lseek(fd, FATPosition*h->bs->BPB_BytesPerSec+FATOffset, SEEK_SET);
-    if(seek == -1) {
-        perror("Seek failed.\n");
+    else {
+        posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+    }
+    STAT_ADD(h->stats, prefetches, 1);
+}
+
+/* Hint up to count clusters of the chain starting at *N, one call per
+    run of consecutive clusters. *N is left at the first cluster not
+    hinted (or the end of chain value). Returns the clusters hinted. */
+uint32_t prefetchChain(int fd, fat32Head* h, uint32_t *N, uint32_t count) {
+    uint32_t hinted = 0;
+    uint32_t clus = *N;
+    while(hinted < count && clus >= 2 && clus < h->fatEntries) {
+        uint32_t runStart = clus;
+        uint32_t run = 0;
+        do {
+            run++;
+            clus = h->fat[clus] & FAT_ENTRY_MASK;
+        } while(hinted + run < count && clus == runStart + run && clus < h->fatEntries);
+        prefetchImage(fd, h, clusterOffset(h, runStart), (uint64_t)run*clusterBytes(h));
+        hinted += run;
+    }
+    *N = clus;
+    return hinted;
+}
+
+/* Write len bytes from src at offset in the image, into the map when there
+    is one and with pwrite otherwise. Cached copies of any data clusters
+    touched are dropped. Returns bytes written or -1. */
+ssize_t writeImage(int fd, fat32Head* h, off_t offset, const void *src, size_t len) {
+    if(!h->writable) {
+        fprintf(stderr, "Write refused, image is read-only (use -w).\n");
+        return -1;
+    }
+    if(h->index != NULL) {
+        sidecarMarkStale(h->index);
+    }
+    size_t done = 0;
+    if(h->map != NULL) {
+        if(offset < 0 || (uint64_t)offset + len > h->mapSize) {
+            return -1;
+        }
+        if(h->map + offset != src) {
+            memmove(h->map + offset, src, len);
+        }
+        done = len;
+        STAT_ADD(h->stats, imageWrites, 1);
+    }
+    else {
+        while(done < len) {
+            ssize_t written = pwrite(fd, (const char*)src + done, len - done, offset + done);
+            STAT_ADD(h->stats, imageWrites, 1);
+            if(written <= 0) {
+                if(written == -1 && errno == EINTR) {
+                    continue;
+                }
+                perror("Write failed.\n");
+                return done > 0 ? (ssize_t)done : -1;
+            }
+            done += written;
+        }
+    }
+
+    STAT_ADD(h->stats, bytesWritten, done);
+    off_t dataStart = clusterOffset(h, 2);
+    if(h->cache != NULL && offset + (off_t)len > dataStart) {
+        off_t from = offset > dataStart ? offset : dataStart;
+        uint32_t firstClus = 2 + (from - dataStart)/clusterBytes(h);
+        uint32_t lastClus = 2 + (offset + len - 1 - dataStart)/clusterBytes(h);
+        for(uint32_t N = firstClus; N <= lastClus; N++) {
+            cacheInvalidate(h->cache, clusterOffset(h, N)/h->bs->BPB_BytesPerSec);
+        }
+    }
+    return done;
+}
+
+/* Push everything written so far to stable storage */
+int syncImage(int fd, fat32Head* h) {
+    if(h->map != NULL) {
+        return msync(h->map, h->mapSize, MS_SYNC);
+    }
+    return fsync(fd);
+}
+
+/* Free a block handed out by the load functions, unless it lives in the map */
+void releaseImageBlock(fat32Head* h, void *p) {
+    if(p == NULL) {
+        return;
+    }
+    if(h->map != NULL && (unsigned char*)p >= h->map && (unsigned char*)p < h->map + h->mapSize) {
+        return;
+    }
+    free(p);
+}
+
+
+/* Bytes in one cluster */
+uint32_t clusterBytes(fat32Head* h) {
+    return (uint32_t)h->bs->BPB_BytesPerSec*h->bs->BPB_SecPerClus;
+}
+
+/* Byte offset of cluster N in the image */
+off_t clusterOffset(fat32Head* h, uint32_t N) {
+    int FirstDataSector = h->bs->BPB_RsvdSecCnt + h->bs->BPB_NumFATs*h->bs->BPB_FATSz32;
+    return ((off_t)FirstDataSector + (off_t)(N-2)*h->bs->BPB_SecPerClus)*h->bs->BPB_BytesPerSec;
+}
+
+/* Bring cluster it->clus into it->buf, by pointer when mapped */
+static bool loadDirCluster(fat32DirIter *it) {
+    fat32Head *h = it->h;
+    if(it->clus < 2 || it->clus >= h->fatEntries || it->steps++ >= h->fatEntries) {
+        return false;
+    }
+    /* Keep a window of the chain ahead of this cluster hinted, topping
+        it up once half of it has been walked */
+    if(it->prefetched > 0) {
+        it->prefetched--;
     }
-    int readd = read(fd, FAT, BYTE_PER_FAT_ENTRY);
-    if(readd == -1) {
-        perror("Read failed.\n");
+    if(h->prefetch != 0 && it->prefetched <= h->prefetch/2) {
+        it->prefetched += prefetchChain(it->fd, h, &it->prefetchNext, h->prefetch - it->prefetched);
     }
-    //int ThisFATSecNum = h->bs->BPB_RsvdSecCnt + (FATOffset/h->bs->BPB_BytesPerSec);
-    // TODO
-    return FAT[0];
+    off_t offset = clusterOffset(h, it->clus);
+    it->buf = (unsigned char*)imagePtr(h, offset, clusterBytes(h));
+    if(it->buf == NULL) {
+        if(it->owned == NULL) {
+            it->owned = malloc(clusterBytes(h));
+            if(it->owned == NULL) {
+                fprintf(stderr, "Fatal: failed to allocate %u bytes.\n", clusterBytes(h));
+                abort();
+            }
+        }
+        if(readCluster(it->fd, h, it->clus, it->owned) != clusterBytes(h)) {
+            return false;
+        }
+        it->buf = it->owned;
+    }
+    it->index = 0;
+    return true;
 }
 
+/* Read cluster N into dst (clusterBytes long) through the block cache */
+ssize_t readCluster(int fd, fat32Head* h, uint32_t N, void *dst) {
+    uint64_t sector = clusterOffset(h, N)/h->bs->BPB_BytesPerSec;
+    if(h->cache != NULL && cacheGet(h->cache, sector, dst)) {
+        return clusterBytes(h);
+    }
+    /* A write landing during the read makes cachePut drop the copy */
+    uint64_t generation = h->cache != NULL ? cacheGeneration(h->cache) : 0;
+    ssize_t readd = readImage(fd, h, clusterOffset(h, N), dst, clusterBytes(h));
+    if(h->cache != NULL && readd == clusterBytes(h)) {
+        cachePut(h->cache, sector, dst, generation);
+    }
+    return readd;
+}
+
+/* Start walking the directory whose first cluster is clus.
+    Cluster 0 (as found in ".." entries) means the root directory. */
+void openDirIter(fat32DirIter *it, int fd, fat32Head* h, uint32_t clus) {
+    it->h = h;
+    it->fd = fd;
+    it->clus = clus == 0 ? h->bs->BPB_RootClus : clus;
+    it->buf = NULL;
+    it->owned = NULL;
+    it->index = 0;
+    it->entriesPerClus = clusterBytes(h)/sizeof(fat32Dir);
+    it->steps = 0;
+    /* Single cluster directories, the common case, cost no hint */
+    it->prefetchNext = it->clus < h->fatEntries ? h->fat[it->clus] & FAT_ENTRY_MASK : FAT_EOC;
+    it->prefetched = 0;
+    it->done = !loadDirCluster(it);
+}
+
+/* Return the next in-use short entry, or NULL at the end of the directory.
+    The entry points into the iterator's buffer and is only valid until
+    the next call. Deleted and long name entries are skipped. */
+fat32Dir *nextDirEntry(fat32DirIter *it) {
+    while(!it->done) {
+        if(it->index == it->entriesPerClus) {
+            it->clus = getFATEntryForClusterN(it->fd, it->clus, it->h);
+            if(it->clus >= FAT_EOC_MIN || !loadDirCluster(it)) {
+                it->done = true;
+                break;
+            }
+        }
+        fat32Dir *dir = (fat32Dir*)(it->buf + it->index*sizeof(fat32Dir));
+        it->index++;
+        if((unsigned char)dir->DIR_Name[0] == DIR_ENTRY_END) {
+            it->done = true;
+            break;
+        }
+        if((unsigned char)dir->DIR_Name[0] == DIR_ENTRY_FREE || (dir->DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME) {
+            continue;
+        }
+        return dir;
+    }
+    return NULL;
+}
+
+void closeDirIter(fat32DirIter *it) {
+    free(it->owned);
+    it->owned = NULL;
+    it->buf = NULL;
+    it->done = true;
+}
+
+/* Turn the space padded 8.3 name of dir into "NAME.EXT" (or "NAME"
+    when there's no extension). out needs DIR_PRINT_NAME_LENGTH bytes. */
+void formatDirName(const fat32Dir *dir, char *out) {
+    int j = 0;
+    for(int i = 0; i < 8 && dir->DIR_Name[i] != ' '; i++) {
+        out[j++] = dir->DIR_Name[i];
+    }
+    if(dir->DIR_Name[8] != ' ') {
+        out[j++] = '.';
+        for(int i = 8; i < 11 && dir->DIR_Name[i] != ' '; i++) {
+            out[j++] = dir->DIR_Name[i];
+        }
+    }
+    out[j] = '\0';
+}
+
+/* Walk the chain starting at firstClus and collapse it into runs of
+    consecutive clusters. *extents is malloc'd and must be freed by
+    the caller. Returns the number of extents. */
+int buildExtents(int fd, fat32Head* h, uint32_t firstClus, fat32Extent **extents) {
+    int indexed = sidecarExtents(h->index, firstClus, extents);
+    if(indexed >= 0) {
+        return indexed;
+    }
+    int capacity = 8;
+    int count = 0;
+    fat32Extent *list = malloc(capacity*sizeof(fat32Extent));
+    if(list == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", capacity*sizeof(fat32Extent));
+        abort();
+    }
+    uint32_t clus = firstClus;
+    uint32_t steps = 0;
+    while(clus >= 2 && clus < h->fatEntries && steps++ < h->fatEntries) {
+        if(count > 0 && list[count-1].clus + list[count-1].count == clus) {
+            list[count-1].count++;
+        }
+        else {
+            if(count == capacity) {
+                capacity *= 2;
+                list = realloc(list, capacity*sizeof(fat32Extent));
+                if(list == NULL) {
+                    fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", capacity*sizeof(fat32Extent));
+                    abort();
+                }
+            }
+            list[count].clus = clus;
+            list[count].count = 1;
+            count++;
+        }
+        clus = getFATEntryForClusterN(fd, clus, h);
+        if(clus >= FAT_EOC_MIN) {
+            break;
+        }
+    }
+    *extents = list;
+    return count;
+}
@@ -1,7 +1,7 @@
-/* This header file stores all types of the FAT32 structs
-* Including: Bios parameter block (BPB) Structure, FSInfo Sector Structure, and
-* Directory Entry Structure.
-* And also a header including them.
+/* This header file stores the engine's view of a FAT32 volume: the
+* header holding the loaded Bios parameter block (BPB), FSInfo Sector and
+* FAT, and the calls that read and write the image through it. The
+* on-disk structures themselves are in fat32types.h.
 * Author: Micah Hanmin Wang #3631308
 */
 
@@ -10,107 +10,91 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include "fat32types.h"
 
-/* boot sector constants */
-#define BS_OEMName_LENGTH 8
-#define BS_VolLab_LENGTH 11
-#define BS_FilSysType_LENGTH 8 
+/* directory entry constants */
+#define DIR_ENTRY_FREE 0xE5 // First name byte of a deleted entry
+#define DIR_ENTRY_END 0x00 // First name byte past the last entry
 
-#define BUFFER_SIZE 512
+/* cluster counts below which a volume is FAT12/FAT16 */
+#define FAT12_TOTAL_CLUSTERS 4085
+#define FAT16_TOTAL_CLUSTERS 65525
 
-#pragma pack(push)
-#pragma pack(1)
-struct fat32BS_struct {
-	char BS_jmpBoot[3];
-	char BS_OEMName[BS_OEMName_LENGTH];
-	uint16_t BPB_BytesPerSec;
-	uint8_t BPB_SecPerClus;
-	uint16_t BPB_RsvdSecCnt;
-	uint8_t BPB_NumFATs;
-	uint16_t BPB_RootEntCnt;
-	uint16_t BPB_TotSec16;
-	uint8_t BPB_Media;
-	uint16_t BPB_FATSz16;
-	uint16_t BPB_SecPerTrk;
-	uint16_t BPB_NumHeads;
-	uint32_t BPB_HiddSec;
-	uint32_t BPB_TotSec32;
-
-	uint32_t BPB_FATSz32;
-	uint16_t BPB_ExtFlags;
-	uint8_t BPB_FSVerLow;
-	uint8_t BPB_FSVerHigh;
-	uint32_t BPB_RootClus;
-	uint16_t BPB_FSInfo;
-	uint16_t BPB_BkBootSec;
-	char BPB_reserved[12];
-	uint8_t BS_DrvNum;
-	uint8_t BS_Reserved1;
-	uint8_t BS_BootSig;
-	uint32_t BS_VolID;
-	char BS_VolLab[BS_VolLab_LENGTH];
-	char BS_FilSysType[BS_FilSysType_LENGTH];
-	
-	char BS_CodeReserved[420];
-	uint8_t BS_SigA;
-	uint8_t BS_SigB;
-};
-#pragma pack(pop)
-typedef struct fat32BS_struct fat32BS;
-
-#pragma pack(push)
-#pragma pack(1)
-struct fsi_struct {
-	uint32_t FSI_LeadSig;
-	char FSI_Reserved1[480];
-	uint32_t FSI_StrucSig;
-	uint32_t FSI_Free_Count;
-	uint32_t FSI_Nxt_Free;
-	char FSI_Reserved2[12];
-	uint32_t FSI_TrailSig;
-};
-#pragma pack(pop)
-typedef struct fsi_struct FSI;
-
-#pragma pack(push)
-#pragma pack(1)
-struct dir_struct {
-	char DIR_Name[11];
-	uint8_t DIR_Attr;
-	uint8_t DIR_NTRes;
-	uint8_t DIR_CrtTimeTenth;
-	uint16_t DIR_CrtTime;
-	uint16_t DIR_CrtDate;
-	uint16_t DIR_LstAccDate;
-	uint16_t DIR_FstClusHI;
-	uint16_t DIR_WrtTime;
-	uint16_t DIR_WrtDate;
-	uint16_t DIR_FstClusLO;
-    uint32_t DIR_FileSize;
-};
-#pragma pack(pop)
-typedef struct dir_struct fat32Dir;
-
-
-
-
-#pragma pack(push)
-#pragma pack(1)
 struct fat32Head {
 	fat32BS *bs;
 	FSI *fsi;
 	fat32Dir *dir; // The ROOT DIR entry, specifically
+	uint32_t *fat; // The whole first FAT, loaded once by loadFAT
+	uint32_t fatEntries; // Number of entries held in fat
+	unsigned char *map; // Whole image when mapped, otherwise NULL
+	size_t mapSize;
+	bool writable;
+	int opts; // FAT32_OPT_* flags given to createHead
+	struct blockCache *cache; // Recently read clusters, NULL when mapped
+	uint32_t clusterCount; // Data clusters in the volume
+	uint64_t *freeMap; // Bit N set when cluster N is free, built on demand
+	uint32_t freeMapWords;
+	uint32_t freeCount; // Set bits in freeMap
+	pthread_mutex_t lock; // Guards building and changing freeMap
+	uint64_t *fatDirty; // Bit S set when FAT sector S awaits write-back, NULL when read-only
+	uint32_t fatSectors;
+	uint32_t fatDirtyCount; // Set bits in fatDirty
+	bool fsiDirty; // In-memory FSInfo differs from the image
+	struct fat32Stats *stats; // Counters and timings, NULL unless asked for
+	uint32_t prefetch; // Clusters hinted ahead of reads, 0 when off
+	struct sidecarIndex *index; // Mapped sidecar index, NULL when there is none
 };
-#pragma pack(pop)
 typedef struct fat32Head fat32Head;
 
+/* Walks the entries of a directory one whole cluster at a time,
+	following its FAT chain */
+struct fat32DirIter {
+	fat32Head *h;
+	int fd;
+	uint32_t clus; // Cluster currently held in buf
+	unsigned char *buf; // That cluster, in the map or in owned
+	unsigned char *owned; // Reusable cluster buffer when not mapped
+	int index; // Next entry to hand out
+	int entriesPerClus;
+	uint32_t steps; // Clusters visited, guards against FAT loops
+	uint32_t prefetchNext; // First cluster of the chain not hinted yet
+	uint32_t prefetched; // Clusters hinted but not visited yet
+	bool done;
+};
+typedef struct fat32DirIter fat32DirIter;
+
+/* A run of consecutive clusters in a file's chain */
+struct fat32Extent {
+	uint32_t clus; // First cluster of the run
+	uint32_t count; // Number of clusters in the run
+};
+typedef struct fat32Extent fat32Extent;
 
-fat32Head *createHead(int fd);
+fat32Head *createHead(int fd, const fat32Options *options);
+void destroyHead(fat32Head* h);
 int checkIfFAT32(fat32Head* h);
 void loadFSI(int fd, fat32Head* h);
 void loadRootDir(int fd, fat32Head* h, int FirstDataSector);
 int findFirstDataSectorOfClusterN(fat32Head* h, int N, int FirstDataSector);
 uint32_t getFATEntryForClusterN(int fd, int N, fat32Head* h);
 bool checkFATSig(int fd, fat32Head *h);
+void loadFAT(int fd, fat32Head* h);
+const void *imagePtr(fat32Head* h, off_t offset, size_t len);
+ssize_t readImage(int fd, fat32Head* h, off_t offset, void *dst, size_t len);
+ssize_t writeImage(int fd, fat32Head* h, off_t offset, const void *src, size_t len);
+int syncImage(int fd, fat32Head* h);
+void releaseImageBlock(fat32Head* h, void *p);
+void prefetchImage(int fd, fat32Head* h, off_t offset, uint64_t len);
+uint32_t prefetchChain(int fd, fat32Head* h, uint32_t *N, uint32_t count);
+uint32_t clusterBytes(fat32Head* h);
+off_t clusterOffset(fat32Head* h, uint32_t N);
+ssize_t readCluster(int fd, fat32Head* h, uint32_t N, void *dst);
+void openDirIter(fat32DirIter *it, int fd, fat32Head* h, uint32_t clus);
+fat32Dir *nextDirEntry(fat32DirIter *it);
+void closeDirIter(fat32DirIter *it);
+void formatDirName(const fat32Dir *dir, char *out);
+int buildExtents(int fd, fat32Head* h, uint32_t firstClus, fat32Extent **extents);
 
 #endif
@@ -0,0 +1,193 @@
+/* The types and constants the libfat32 API hands out: the on-disk boot
+* sector, FSInfo and directory entry, the open options, and what the
+* stats, FSCK and DEFRAG calls report. The engine headers take their
+* definitions from here, so libfat32.h needs nothing else of the engine.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef FAT32TYPES_H
+#define FAT32TYPES_H
+
+#include <inttypes.h>
+
+/* boot sector constants */
+#define BS_OEMName_LENGTH 8
+#define BS_VolLab_LENGTH 11
+#define BS_FilSysType_LENGTH 8 
+
+/* directory entry attributes */
+#define ATTR_LONG_NAME 0x0F
+#define ATTR_VOLUME_ID 0x08
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+#define DIR_PRINT_NAME_LENGTH 13 // "NAME.EXT" plus terminator
+
+/* createHead options */
+#define FAT32_OPT_MMAP 0x1 // Map the image instead of read()ing it
+#define FAT32_OPT_WRITE 0x2 // Image was opened read-write
+#define FAT32_OPT_PIPELINE 0x4 // Overlap image reads and host writes in GET
+#define FAT32_OPT_STATS 0x8 // Keep I/O counters and command latencies
+#define FAT32_OPT_CHECKSUM 0x10 // GET reports the CRC32C of what it copied
+#define FAT32_DEFAULT_CACHE_BLOCKS 1024 // Clusters the block cache holds
+#define FAT32_DEFAULT_PREFETCH 256 // Clusters hinted ahead of directory and file reads
+
+/* Everything createHead can be told about how to open a volume */
+struct fat32Options {
+	int flags; // FAT32_OPT_* bits
+	int cacheBlocks; // Clusters the block cache holds, 0 disables it
+	int prefetchClusters; // Clusters the kernel is told to read ahead, 0 disables hints
+	const char *statsJson; // Stats summary written here on close, implies FAT32_OPT_STATS
+	const char *statsTrace; // Chrome trace written here on close, implies FAT32_OPT_STATS
+	const char *indexPath; // Sidecar index to use, built when missing or out of date
+};
+typedef struct fat32Options fat32Options;
+
+#pragma pack(push)
+#pragma pack(1)
+struct fat32BS_struct {
+	char BS_jmpBoot[3];
+	char BS_OEMName[BS_OEMName_LENGTH];
+	uint16_t BPB_BytesPerSec;
+	uint8_t BPB_SecPerClus;
+	uint16_t BPB_RsvdSecCnt;
+	uint8_t BPB_NumFATs;
+	uint16_t BPB_RootEntCnt;
+	uint16_t BPB_TotSec16;
+	uint8_t BPB_Media;
+	uint16_t BPB_FATSz16;
+	uint16_t BPB_SecPerTrk;
+	uint16_t BPB_NumHeads;
+	uint32_t BPB_HiddSec;
+	uint32_t BPB_TotSec32;
+
+	uint32_t BPB_FATSz32;
+	uint16_t BPB_ExtFlags;
+	uint8_t BPB_FSVerLow;
+	uint8_t BPB_FSVerHigh;
+	uint32_t BPB_RootClus;
+	uint16_t BPB_FSInfo;
+	uint16_t BPB_BkBootSec;
+	char BPB_reserved[12];
+	uint8_t BS_DrvNum;
+	uint8_t BS_Reserved1;
+	uint8_t BS_BootSig;
+	uint32_t BS_VolID;
+	char BS_VolLab[BS_VolLab_LENGTH];
+	char BS_FilSysType[BS_FilSysType_LENGTH];
+	
+	char BS_CodeReserved[420];
+	uint8_t BS_SigA;
+	uint8_t BS_SigB;
+};
+#pragma pack(pop)
+typedef struct fat32BS_struct fat32BS;
+
+#pragma pack(push)
+#pragma pack(1)
+struct fsi_struct {
+	uint32_t FSI_LeadSig;
+	char FSI_Reserved1[480];
+	uint32_t FSI_StrucSig;
+	uint32_t FSI_Free_Count;
+	uint32_t FSI_Nxt_Free;
+	char FSI_Reserved2[12];
+	uint32_t FSI_TrailSig;
+};
+#pragma pack(pop)
+typedef struct fsi_struct FSI;
+
+#pragma pack(push)
+#pragma pack(1)
+struct dir_struct {
+	char DIR_Name[11];
+	uint8_t DIR_Attr;
+	uint8_t DIR_NTRes;
+	uint8_t DIR_CrtTimeTenth;
+	uint16_t DIR_CrtTime;
+	uint16_t DIR_CrtDate;
+	uint16_t DIR_LstAccDate;
+	uint16_t DIR_FstClusHI;
+	uint16_t DIR_WrtTime;
+	uint16_t DIR_WrtDate;
+	uint16_t DIR_FstClusLO;
+    uint32_t DIR_FileSize;
+};
+#pragma pack(pop)
+typedef struct dir_struct fat32Dir;
+
+#define STATS_BUCKETS 32 // Bucket b holds latencies below 2^b us
+#define STATS_MAX_COMMANDS 32
+#define STATS_NAME_LENGTH 16
+
+/* Running totals, bumped with relaxed atomics from any thread */
+struct fat32Counters {
+	uint64_t preads; // pread() calls on the image
+	uint64_t mapReads; // Copies out of the mapped image
+	uint64_t bytesRead;
+	uint64_t kernelCopies; // copy_file_range() and sendfile() calls
+	uint64_t bytesCopied;
+	uint64_t hostWrites; // write() calls on host files
+	uint64_t imageWrites; // pwrite() calls or copies into the map
+	uint64_t bytesWritten;
+	uint64_t fatLookups; // FAT entries followed
+	uint64_t allocations; // allocateExtents() calls
+	uint64_t clustersAllocated;
+	uint64_t fatFlushWrites; // Coalesced FAT and FSInfo writes
+	uint64_t prefetches; // posix_fadvise() or madvise() read ahead hints
+};
+typedef struct fat32Counters fat32Counters;
+
+/* Latencies of one shell command */
+struct fat32CommandStats {
+	char name[STATS_NAME_LENGTH];
+	uint64_t count;
+	uint64_t totalNs;
+	uint64_t maxNs;
+	uint64_t buckets[STATS_BUCKETS];
+};
+typedef struct fat32CommandStats fat32CommandStats;
+
+/* Kinds of problem checkVolume reports */
+#define FSCK_CROSS_LINK 0 // Cluster reached from two places
+#define FSCK_LOST_CHAIN 1 // In-use chain no entry points at
+#define FSCK_SIZE_MISMATCH 2 // File size doesn't match its chain length
+#define FSCK_BAD_CHAIN 3 // Chain runs into a free, bad or out of range entry, or loops
+#define FSCK_BAD_DOT 4 // "." or ".." points at the wrong directory
+#define FSCK_MIRROR 5 // FAT copies differ
+#define FSCK_FSINFO 6 // FSInfo free count disagrees with the FAT
+#define FSCK_PROBLEM_KINDS 7
+
+/* What a check found */
+struct fat32FsckReport {
+	uint32_t dirs;
+	uint32_t files;
+	uint64_t clustersInUse; // Reached from the directory tree
+	uint64_t lostClusters;
+	uint64_t mirrorEntries; // FAT entries that differ between copies
+	uint32_t problems[FSCK_PROBLEM_KINDS];
+};
+typedef struct fat32FsckReport fat32FsckReport;
+
+/* Called once per problem found, never from two threads at once. path
+	is the entry's path for tree problems and NULL for FAT problems;
+	clus is the cluster (or FAT entry) involved. */
+typedef void (*fat32FsckFn)(int problem, const char *path, uint32_t clus, void *arg);
+
+/* What a defragmentation did */
+struct fat32DefragReport {
+	uint32_t files; // Files with data
+	uint32_t fragmented; // Of those, the ones in more than one extent
+	uint32_t moved; // Made contiguous
+	uint32_t noRoom; // Left alone, no free run was long enough
+	uint32_t damaged; // Left alone, the chain doesn't fit the size
+	uint32_t failed; // A read or write failed part way, see below
+	uint64_t extentsBefore;
+	uint64_t extentsAfter;
+	uint64_t clustersMoved;
+};
+typedef struct fat32DefragReport fat32DefragReport;
+
+/* Called for every file moved, with its extent count before and after */
+typedef void (*fat32DefragFn)(const char *path, uint32_t before, uint32_t after, void *arg);
+
+#endif
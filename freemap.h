@@ -0,0 +1,17 @@
+/* The free cluster bitmap.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef FREEMAP_H
+#define FREEMAP_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "fat32.h"
+
+void buildFreeMap(fat32Head* h);
+uint32_t countFreeClusters(fat32Head* h);
+bool isClusterFree(fat32Head* h, uint32_t N);
+void markCluster(fat32Head* h, uint32_t N, bool free);
+
+#endif
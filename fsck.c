@@ -0,0 +1,420 @@
+/* fsck.c checks a whole volume on a pool of workers in three parts:
+* 1. The tree: every directory is a pool task (subdirectories are
+*    queued on the worker's own deque and stolen by idle ones, as in
+*    EXPORT). Each task claims the clusters of its own chain and of its
+*    files' chains in a shared bitmap with an atomic OR, so a cluster
+*    claimed twice is a cross-link no matter which thread gets there
+*    second. File sizes are checked against chain lengths on the way.
+* 2. Lost chains: the FAT is split into ranges, and each range looks
+*    for in-use clusters nothing claimed. A lost cluster no other lost
+*    cluster points at starts a lost chain, which is then claimed too.
+*    Whatever is still unclaimed after that is a chain looped back on
+*    itself with no head; one pass over the FAT reports each loop once.
+* 3. FAT mirrors: the FAT is split into ranges again, and each range of
+*    every other copy is read and compared with the first.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include "fsck.h"
+#include "freemap.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <limits.h>
+
+#define FAT_ENTRY_MASK 0x0FFFFFFF
+#define FAT_BAD_CLUSTER 0x0FFFFFF7
+#define FAT_EOC_MIN 0x0FFFFFF8
+#define FSI_UNKNOWN 0xFFFFFFFF
+#define EXTFLAGS_NO_MIRROR 0x80
+#define FSCK_RANGES_PER_THREAD 4 // FAT ranges per worker, to even out the load
+#define FSCK_MIRROR_CHUNK (1024*1024)
+
+/* Shared by every task of one check */
+struct fsckContext {
+    int fd;
+    fat32Head *h;
+    threadPool *pool;
+    uint32_t last; // Highest cluster number of the volume
+    uint64_t *claimed; // Bit N set once cluster N is reached from the tree, or in part 2 from a lost head
+    uint64_t *pointedAt; // Bit N set when a lost cluster links to N
+    fat32FsckReport *report;
+    fat32FsckFn fn;
+    void *arg;
+    pthread_mutex_t lock; // Guards report and calls to fn
+};
+
+/* One directory still to be checked */
+struct fsckDirJob {
+    struct fsckContext *ctx;
+    uint32_t clus;
+    uint32_t parent; // 0 for the root and its children
+    char path[PATH_MAX];
+};
+
+/* A slice of the FAT for parts 2 and 3 */
+struct fsckRange {
+    struct fsckContext *ctx;
+    uint32_t from;
+    uint32_t to; // One past the last entry
+    int copy; // FAT copy compared by part 3
+};
+
+static void problem(struct fsckContext *ctx, int kind, const char *path, uint32_t clus) {
+    pthread_mutex_lock(&ctx->lock);
+    ctx->report->problems[kind]++;
+    if(ctx->fn != NULL) {
+        ctx->fn(kind, path, clus, ctx->arg);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static void *allocBitmap(uint32_t bits) {
+    uint64_t *map = calloc(bits/64 + 1, sizeof(uint64_t));
+    if(map == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", (bits/64 + 1)*sizeof(uint64_t));
+        abort();
+    }
+    return map;
+}
+
+/* Set bit N, returns whether it was already set */
+static bool testAndSet(uint64_t *map, uint32_t N) {
+    uint64_t bit = 1ULL << (N % 64);
+    return (__atomic_fetch_or(&map[N/64], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+static bool testBit(const uint64_t *map, uint32_t N) {
+    return (__atomic_load_n(&map[N/64], __ATOMIC_RELAXED) >> (N % 64)) & 1;
+}
+
+static bool inUse(uint32_t entry) {
+    return entry != 0 && entry != FAT_BAD_CLUSTER;
+}
+
+/* Whether N is one of the first length clusters of the chain starting
+    at first, i.e. the chain has looped back on itself */
+static bool onChain(fat32Head *h, uint32_t first, uint32_t length, uint32_t N) {
+    uint32_t clus = first;
+    for(uint32_t i = 0; i < length; i++) {
+        if(clus == N) {
+            return true;
+        }
+        clus = h->fat[clus] & FAT_ENTRY_MASK;
+    }
+    return false;
+}
+
+/* Claim every cluster of the chain starting at first for path. Stops at
+    the first cluster somebody else already has. Returns the number of
+    clusters claimed; *whole is false when the chain was cut short. */
+static uint32_t claimChain(struct fsckContext *ctx, const char *path, uint32_t first, bool *whole) {
+    fat32Head *h = ctx->h;
+    uint32_t N = first;
+    uint32_t length = 0;
+    *whole = false;
+    if(N < 2 || N > ctx->last) {
+        problem(ctx, FSCK_BAD_CHAIN, path, N);
+        return 0;
+    }
+    while(true) {
+        if(testAndSet(ctx->claimed, N)) {
+            problem(ctx, onChain(ctx->h, first, length, N) ? FSCK_BAD_CHAIN : FSCK_CROSS_LINK, path, N);
+            return length;
+        }
+        length++;
+        uint32_t next = h->fat[N] & FAT_ENTRY_MASK;
+        if(next >= FAT_EOC_MIN) {
+            *whole = true;
+            return length;
+        }
+        if(next < 2 || next > ctx->last || next == FAT_BAD_CLUSTER) {
+            problem(ctx, FSCK_BAD_CHAIN, path, N);
+            return length;
+        }
+        N = next;
+    }
+}
+
+static void checkDirTask(void *arg);
+
+/* Check one entry of a directory, queueing subdirectories */
+static void checkEntry(struct fsckDirJob *job, const fat32Dir *dir) {
+    struct fsckContext *ctx = job->ctx;
+    fat32Head *h = ctx->h;
+    char name[DIR_PRINT_NAME_LENGTH];
+    char path[PATH_MAX];
+    formatDirName(dir, name);
+    if(snprintf(path, PATH_MAX, "%s/%s", strcmp(job->path, "/") == 0 ? "" : job->path, name) >= PATH_MAX) {
+        /* Deeper than a host path can be, still checked but shown cut short */
+        path[PATH_MAX - 1] = '\0';
+    }
+    uint32_t first = ((uint32_t)dir->DIR_FstClusHI<<16) + dir->DIR_FstClusLO;
+
+    if(dir->DIR_Attr & ATTR_DIRECTORY) {
+        /* "." is this directory, ".." the parent (0 for the root) */
+        if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            uint32_t want = name[1] == '\0' ? job->clus : job->parent;
+            if(first != want) {
+                problem(ctx, FSCK_BAD_DOT, path, first);
+            }
+            return;
+        }
+        pthread_mutex_lock(&ctx->lock);
+        ctx->report->dirs++;
+        pthread_mutex_unlock(&ctx->lock);
+        struct fsckDirJob *child = malloc(sizeof(struct fsckDirJob));
+        if(child == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(struct fsckDirJob));
+            abort();
+        }
+        child->ctx = ctx;
+        child->clus = first;
+        child->parent = job->clus == h->bs->BPB_RootClus ? 0 : job->clus;
+        strcpy(child->path, path);
+        poolSubmit(ctx->pool, checkDirTask, child);
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->report->files++;
+    pthread_mutex_unlock(&ctx->lock);
+    uint64_t want = ((uint64_t)dir->DIR_FileSize + clusterBytes(h) - 1)/clusterBytes(h);
+    if(first == 0) {
+        if(want != 0) {
+            problem(ctx, FSCK_SIZE_MISMATCH, path, 0);
+        }
+        return;
+    }
+    bool whole;
+    uint32_t length = claimChain(ctx, path, first, &whole);
+    if(whole && length != want) {
+        problem(ctx, FSCK_SIZE_MISMATCH, path, first);
+    }
+}
+
+/* Claim a directory's own chain, then check everything in it */
+static void checkDirTask(void *arg) {
+    struct fsckDirJob *job = arg;
+    struct fsckContext *ctx = job->ctx;
+    bool whole;
+    /* A chain that loops or runs into someone else's isn't safe to walk */
+    claimChain(ctx, job->path, job->clus, &whole);
+    if(!whole) {
+        free(job);
+        return;
+    }
+
+    fat32DirIter it;
+    openDirIter(&it, ctx->fd, ctx->h, job->clus);
+    fat32Dir *dir;
+    while((dir = nextDirEntry(&it)) != NULL) {
+        if((dir->DIR_Attr & ATTR_VOLUME_ID) && !(dir->DIR_Attr & ATTR_DIRECTORY)) {
+            continue;
+        }
+        checkEntry(job, dir);
+    }
+    closeDirIter(&it);
+    free(job);
+}
+
+/* Part 2, first pass: count lost clusters and mark where they lead */
+static void lostPassTask(void *arg) {
+    struct fsckRange *range = arg;
+    struct fsckContext *ctx = range->ctx;
+    uint64_t lost = 0;
+    for(uint32_t N = range->from; N < range->to; N++) {
+        uint32_t entry = ctx->h->fat[N] & FAT_ENTRY_MASK;
+        if(inUse(entry) && !testBit(ctx->claimed, N)) {
+            lost++;
+            if(entry >= 2 && entry <= ctx->last) {
+                testAndSet(ctx->pointedAt, entry);
+            }
+        }
+    }
+    pthread_mutex_lock(&ctx->lock);
+    ctx->report->lostClusters += lost;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Claim the lost chain starting at N, up to its end or the first
+    cluster already claimed. Returns false when N itself was. */
+static bool claimLost(struct fsckContext *ctx, uint32_t N) {
+    if(testAndSet(ctx->claimed, N)) {
+        return false;
+    }
+    uint32_t next = ctx->h->fat[N] & FAT_ENTRY_MASK;
+    while(inUse(next) && next >= 2 && next <= ctx->last && !testAndSet(ctx->claimed, next)) {
+        next = ctx->h->fat[next] & FAT_ENTRY_MASK;
+    }
+    return true;
+}
+
+/* Part 2, second pass: a lost cluster nothing lost points at heads a chain */
+static void lostHeadTask(void *arg) {
+    struct fsckRange *range = arg;
+    struct fsckContext *ctx = range->ctx;
+    for(uint32_t N = range->from; N < range->to; N++) {
+        uint32_t entry = ctx->h->fat[N] & FAT_ENTRY_MASK;
+        if(inUse(entry) && !testBit(ctx->claimed, N) && !testBit(ctx->pointedAt, N)) {
+            problem(ctx, FSCK_LOST_CHAIN, NULL, N);
+            claimLost(ctx, N);
+        }
+    }
+}
+
+/* Part 2, last pass: every head has claimed its chain, so an in-use
+    cluster still unclaimed sits on a loop nothing leads into. Run as a
+    single range, so a loop is claimed whole before it could be found
+    again from another of its clusters. */
+static void lostLoopTask(void *arg) {
+    struct fsckRange *range = arg;
+    struct fsckContext *ctx = range->ctx;
+    for(uint32_t N = range->from; N < range->to; N++) {
+        uint32_t entry = ctx->h->fat[N] & FAT_ENTRY_MASK;
+        if(inUse(entry) && claimLost(ctx, N)) {
+            problem(ctx, FSCK_LOST_CHAIN, NULL, N);
+        }
+    }
+}
+
+/* Part 3: compare one range of another FAT copy with the loaded one */
+static void mirrorTask(void *arg) {
+    struct fsckRange *range = arg;
+    struct fsckContext *ctx = range->ctx;
+    fat32Head *h = ctx->h;
+    off_t copyStart = (off_t)h->bs->BPB_RsvdSecCnt*h->bs->BPB_BytesPerSec
+        + (off_t)range->copy*h->bs->BPB_FATSz32*h->bs->BPB_BytesPerSec;
+    uint32_t *buf = malloc(FSCK_MIRROR_CHUNK);
+    if(buf == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %d bytes.\n", FSCK_MIRROR_CHUNK);
+        abort();
+    }
+    uint64_t differ = 0;
+    uint32_t firstDiffer = 0;
+    uint32_t perChunk = FSCK_MIRROR_CHUNK/sizeof(uint32_t);
+    for(uint32_t N = range->from; N < range->to; N += perChunk) {
+        uint32_t count = range->to - N < perChunk ? range->to - N : perChunk;
+        ssize_t readd = readImage(ctx->fd, h, copyStart + (off_t)N*sizeof(uint32_t), buf, count*sizeof(uint32_t));
+        if(readd != (ssize_t)(count*sizeof(uint32_t))) {
+            differ += count;
+            firstDiffer = differ == count ? N : firstDiffer;
+            continue;
+        }
+        if(memcmp(buf, &h->fat[N], count*sizeof(uint32_t)) == 0) {
+            continue;
+        }
+        for(uint32_t i = 0; i < count; i++) {
+            if(buf[i] != h->fat[N + i]) {
+                if(differ++ == 0) {
+                    firstDiffer = N + i;
+                }
+            }
+        }
+    }
+    free(buf);
+    if(differ > 0) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->report->mirrorEntries += differ;
+        pthread_mutex_unlock(&ctx->lock);
+        problem(ctx, FSCK_MIRROR, NULL, firstDiffer);
+    }
+}
+
+/* Split [from, to) into ranges and run task over them on the pool */
+static void runRanges(struct fsckContext *ctx, poolTask task, uint32_t from, uint32_t to, int copy, int pieces) {
+    struct fsckRange *ranges = malloc(pieces*sizeof(struct fsckRange));
+    if(ranges == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", pieces*sizeof(struct fsckRange));
+        abort();
+    }
+    uint32_t span = to - from;
+    for(int i = 0; i < pieces; i++) {
+        ranges[i].ctx = ctx;
+        ranges[i].from = from + (uint64_t)span*i/pieces;
+        ranges[i].to = from + (uint64_t)span*(i + 1)/pieces;
+        ranges[i].copy = copy;
+        poolSubmit(ctx->pool, task, &ranges[i]);
+    }
+    poolWait(ctx->pool);
+    free(ranges);
+}
+
+/* Check the whole volume. fn, which may be NULL, hears about each
+    problem as it is found; report gets the totals. */
+void checkVolume(int fd, fat32Head* h, fat32FsckReport *report, fat32FsckFn fn, void *arg) {
+    memset(report, 0, sizeof(fat32FsckReport));
+    struct fsckContext ctx;
+    ctx.fd = fd;
+    ctx.h = h;
+    ctx.report = report;
+    ctx.fn = fn;
+    ctx.arg = arg;
+    ctx.last = h->clusterCount + 1;
+    if(ctx.last >= h->fatEntries) {
+        ctx.last = h->fatEntries - 1;
+    }
+    ctx.claimed = allocBitmap(ctx.last + 1);
+    ctx.pointedAt = allocBitmap(ctx.last + 1);
+    pthread_mutex_init(&ctx.lock, NULL);
+    int threads = defaultPoolSize();
+    int pieces = threads*FSCK_RANGES_PER_THREAD;
+    ctx.pool = createPool(threads);
+
+    /* 1. The tree, from the root */
+    struct fsckDirJob *root = malloc(sizeof(struct fsckDirJob));
+    if(root == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(struct fsckDirJob));
+        abort();
+    }
+    root->ctx = &ctx;
+    root->clus = h->bs->BPB_RootClus;
+    root->parent = 0;
+    strcpy(root->path, "/");
+    report->dirs = 1;
+    poolSubmit(ctx.pool, checkDirTask, root);
+    poolWait(ctx.pool);
+    for(uint32_t w = 0; w <= ctx.last/64; w++) {
+        report->clustersInUse += __builtin_popcountll(ctx.claimed[w]);
+    }
+
+    /* 2. Lost chains */
+    runRanges(&ctx, lostPassTask, 2, ctx.last + 1, 0, pieces);
+    runRanges(&ctx, lostHeadTask, 2, ctx.last + 1, 0, pieces);
+    runRanges(&ctx, lostLoopTask, 2, ctx.last + 1, 0, 1);
+
+    /* 3. FAT mirrors, unless only one FAT is in use */
+    if(!(h->bs->BPB_ExtFlags & EXTFLAGS_NO_MIRROR)) {
+        for(int copy = 1; copy < h->bs->BPB_NumFATs; copy++) {
+            runRanges(&ctx, mirrorTask, 0, h->fatEntries, copy, pieces);
+        }
+    }
+    destroyPool(ctx.pool);
+
+    /* FSInfo's free count is only a hint, but it should still be right */
+    uint32_t freeClusters = countFreeClusters(h);
+    if(h->fsi != NULL && h->fsi->FSI_Free_Count != FSI_UNKNOWN && h->fsi->FSI_Free_Count != freeClusters) {
+        problem(&ctx, FSCK_FSINFO, NULL, h->fsi->FSI_Free_Count);
+    }
+
+    pthread_mutex_destroy(&ctx.lock);
+    free(ctx.claimed);
+    free(ctx.pointedAt);
+}
+
+const char *fsckProblemName(int problem) {
+    switch(problem) {
+    case FSCK_CROSS_LINK: return "cross-linked cluster";
+    case FSCK_LOST_CHAIN: return "lost chain";
+    case FSCK_SIZE_MISMATCH: return "size doesn't match chain length";
+    case FSCK_BAD_CHAIN: return "broken chain";
+    case FSCK_BAD_DOT: return "bad . or .. entry";
+    case FSCK_MIRROR: return "FAT copies differ";
+    case FSCK_FSINFO: return "FSInfo free count is stale";
+    default: return "unknown problem";
+    }
+}
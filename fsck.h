@@ -0,0 +1,15 @@
+/* Whole-volume consistency check.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef FSCK_H
+#define FSCK_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "fat32.h"
+
+void checkVolume(int fd, fat32Head* h, fat32FsckReport *report, fat32FsckFn fn, void *arg);
+const char *fsckProblemName(int problem);
+
+#endif
@@ -0,0 +1,778 @@
+/* libfat32.c wraps the engine (fat32.c, cache.c, transfer.c) behind
+* an opaque volume handle. After fat32Open the only parts of the handle
+* readers write are the block, dentry and skip caches, which lock
+* themselves, and the chain length memo, whose entries are atomic
+* stores. Every read is a pread or a copy out of the map, so the handle
+* can be shared by any number of threads; writers take writeLock.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include "libfat32.h"
+#include "fat32.h"
+#include "cache.h"
+#include "transfer.h"
+#include "freemap.h"
+#include "upload.h"
+#include "alloc.h"
+#include "dcache.h"
+#include "skipidx.h"
+#include "sidecar.h"
+#include "stats.h"
+#include "fsck.h"
+#include "defrag.h"
+#include "pool.h"
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FSInfo_LeadSig 0x41615252
+#define FSInfo_StrucSig 0x61417272
+#define FSInfo_TrailSig 0xAA550000
+
+struct fat32Vol {
+    int fd;
+    fat32Head *h;
+    pthread_mutex_t writeLock; // One writer at a time
+    dentryCache *dcache; // Entries found by fat32Stat
+    skipCache *skip; // Skip indexes of chains fat32Read has been into
+    char *indexPath; // Sidecar index kept up to date, NULL when none
+    uint32_t *chainLens; // Clusters in the chain starting at N, 0 when not known yet
+    bool chainsStale; // A write may have changed chains since chainLens was filled
+    int chainUsers; // fat32ChainLength calls holding chainLens or a retired memo
+    uint32_t **retiredLens; // Memos swapped out while in use, freed once chainUsers is 0
+    int retiredCount;
+    pthread_mutex_t chainLock; // Guards everything above but the memo entries
+};
+
+/* Use the sidecar index at path, building it first when it is missing
+    or was built from a different image */
+static void openIndex(fat32Vol *v, const char *path) {
+    v->indexPath = strdup(path);
+    if(v->indexPath == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", strlen(path) + 1);
+        abort();
+    }
+    v->h->index = openSidecar(v->h, path);
+    if(v->h->index == NULL) {
+        if(!writeSidecar(v->fd, v->h, path)) {
+            fprintf(stderr, "Warning: can't write index %s.\n", path);
+            return;
+        }
+        v->h->index = openSidecar(v->h, path);
+    }
+    sidecarLoadFreeMap(v->h->index, v->h);
+}
+
+/* Mount the volume in fd: boot sector, FAT, FSInfo and root entry.
+    On failure returns NULL and sets *error to a FAT32_ERR_* value. */
+fat32Vol *fat32Open(int fd, const fat32Options *options, int *error) {
+    fat32Head *h = createHead(fd, options);
+    if(h == NULL) {
+        *error = FAT32_ERR_IO;
+        return NULL;
+    }
+
+    /* Check if the total count of clusters (start from Cluster 2)
+        falls in the range of FAT32 */
+    int CountofClusters = h->bs->BPB_SecPerClus == 0 ? 0 : checkIfFAT32(h);
+    if(CountofClusters < FAT12_TOTAL_CLUSTERS) {
+        *error = FAT32_ERR_FAT12;
+    }
+    else if(CountofClusters < FAT16_TOTAL_CLUSTERS) {
+        *error = FAT32_ERR_FAT16;
+    }
+    else {
+        /* Load the FAT into memory and check its signature */
+        loadFAT(fd, h);
+        loadFSI(fd, h);
+        if(!checkFATSig(fd, h)) {
+            *error = FAT32_ERR_FAT_SIG;
+        }
+        else if(h->fsi->FSI_LeadSig != FSInfo_LeadSig || h->fsi->FSI_StrucSig != FSInfo_StrucSig || h->fsi->FSI_TrailSig != FSInfo_TrailSig) {
+            *error = FAT32_ERR_FSI_SIG;
+        }
+        else {
+            *error = FAT32_OK;
+        }
+    }
+    if(*error != FAT32_OK) {
+        destroyHead(h);
+        return NULL;
+    }
+
+    /* Load the Root Dir struct located in Cluster 2, Sector 0. */
+    int FirstDataSector = h->bs->BPB_RsvdSecCnt + h->bs->BPB_NumFATs * h->bs->BPB_FATSz32;
+    loadRootDir(fd, h, FirstDataSector);
+
+    fat32Vol *v = malloc(sizeof(fat32Vol));
+    if(v == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(fat32Vol));
+        abort();
+    }
+    v->fd = fd;
+    v->h = h;
+    pthread_mutex_init(&v->writeLock, NULL);
+    v->dcache = createDentryCache(DCACHE_DEFAULT_ENTRIES);
+    v->skip = createSkipCache(SKIP_DEFAULT_FILES, SKIP_DEFAULT_INTERVAL);
+    v->indexPath = NULL;
+    v->chainLens = NULL;
+    v->chainsStale = false;
+    v->chainUsers = 0;
+    v->retiredLens = NULL;
+    v->retiredCount = 0;
+    pthread_mutex_init(&v->chainLock, NULL);
+    if(options->indexPath != NULL) {
+        openIndex(v, options->indexPath);
+    }
+    return v;
+}
+
+/* Release the volume, writing back any FAT changes still held in
+    memory. The caller still owns (and closes) fd. */
+void fat32Close(fat32Vol *v) {
+    if(flushFAT(v->fd, v->h) == -1) {
+        fprintf(stderr, "Warning: FAT changes could not be written back.\n");
+    }
+    /* Anything written since the index was opened made it stale */
+    if(v->h->index != NULL && v->h->index->stale && !writeSidecar(v->fd, v->h, v->indexPath)) {
+        fprintf(stderr, "Warning: can't write index %s.\n", v->indexPath);
+    }
+    free(v->indexPath);
+    free(v->chainLens);
+    for(int i = 0; i < v->retiredCount; i++) {
+        free(v->retiredLens[i]);
+    }
+    free(v->retiredLens);
+    pthread_mutex_destroy(&v->chainLock);
+    pthread_mutex_destroy(&v->writeLock);
+    destroyDentryCache(v->dcache);
+    destroySkipCache(v->skip);
+    destroyHead(v->h);
+    free(v);
+}
+
+const fat32BS *fat32BootSector(fat32Vol *v) {
+    return v->h->bs;
+}
+
+const FSI *fat32FSInfo(fat32Vol *v) {
+    return v->h->fsi;
+}
+
+/* The first entry of the root directory, normally the volume label */
+const fat32Dir *fat32VolumeEntry(fat32Vol *v) {
+    return v->h->dir;
+}
+
+uint32_t fat32RootCluster(fat32Vol *v) {
+    return v->h->bs->BPB_RootClus;
+}
+
+/* Data clusters in the volume */
+uint32_t fat32TotalClusters(fat32Vol *v) {
+    return v->h->clusterCount;
+}
+
+/* Free clusters counted from the FAT itself, not from FSInfo */
+uint32_t fat32FreeClusters(fat32Vol *v) {
+    return countFreeClusters(v->h);
+}
+
+/* Block cache statistics. Returns false when there is no cache. */
+bool fat32CacheCounters(fat32Vol *v, uint64_t *hits, uint64_t *misses, int *used, int *capacity) {
+    if(v->h->cache == NULL) {
+        return false;
+    }
+    cacheCounters(v->h->cache, hits, misses, used, capacity);
+    return true;
+}
+
+/* Name cache statistics */
+void fat32DentryCounters(fat32Vol *v, uint64_t *hits, uint64_t *misses, int *used, int *capacity) {
+    dentryCounters(v->dcache, hits, misses, used, capacity);
+}
+
+static uint32_t *newChainMemo(fat32Vol *v) {
+    uint32_t *memo = calloc(v->h->fatEntries, sizeof(uint32_t));
+    if(memo == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", v->h->fatEntries*sizeof(uint32_t));
+        abort();
+    }
+    return memo;
+}
+
+/* The memo of chain lengths, allocated on first use and emptied again
+    after a write. Other calls may be reading the stale memo, so it is
+    only cleared in place when nobody holds it; otherwise a fresh one
+    takes its place and the old one waits for releaseChainMemo. */
+static uint32_t *chainMemo(fat32Vol *v) {
+    pthread_mutex_lock(&v->chainLock);
+    /* Writers set chainsStale without chainLock, so it is read and
+        cleared in one step; a write landing after that is seen by the
+        next call. A new memo is empty, any earlier write is moot. */
+    if(v->chainLens == NULL) {
+        __atomic_store_n(&v->chainsStale, false, __ATOMIC_RELAXED);
+        v->chainLens = newChainMemo(v);
+    }
+    else if(__atomic_exchange_n(&v->chainsStale, false, __ATOMIC_RELAXED)) {
+        if(v->chainUsers == 0) {
+            memset(v->chainLens, 0, v->h->fatEntries*sizeof(uint32_t));
+        }
+        else {
+            v->retiredLens = realloc(v->retiredLens, (v->retiredCount + 1)*sizeof(uint32_t*));
+            if(v->retiredLens == NULL) {
+                fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", (v->retiredCount + 1)*sizeof(uint32_t*));
+                abort();
+            }
+            v->retiredLens[v->retiredCount++] = v->chainLens;
+            v->chainLens = newChainMemo(v);
+        }
+    }
+    v->chainUsers++;
+    uint32_t *memo = v->chainLens;
+    pthread_mutex_unlock(&v->chainLock);
+    return memo;
+}
+
+/* Done with the memo chainMemo handed out. The last user out frees the
+    memos swapped out while it was held. */
+static void releaseChainMemo(fat32Vol *v) {
+    pthread_mutex_lock(&v->chainLock);
+    if(--v->chainUsers == 0) {
+        for(int i = 0; i < v->retiredCount; i++) {
+            free(v->retiredLens[i]);
+        }
+        v->retiredCount = 0;
+    }
+    pthread_mutex_unlock(&v->chainLock);
+}
+
+/* Number of clusters in the chain starting at firstClus, 0 for an empty
+    file. Lengths are remembered by first cluster, and a chain that runs
+    into the start of one already measured (a cross-link) stops there.
+    Any number of threads may call this at once: a length is the same
+    whoever works it out, so racing stores are harmless. */
+uint32_t fat32ChainLength(fat32Vol *v, uint32_t firstClus) {
+    fat32Head *h = v->h;
+    if(firstClus < 2 || firstClus >= h->fatEntries) {
+        return 0;
+    }
+    uint32_t *memo = chainMemo(v);
+    uint32_t known = __atomic_load_n(&memo[firstClus], __ATOMIC_RELAXED);
+    if(known != 0) {
+        releaseChainMemo(v);
+        return known;
+    }
+    uint32_t length = 0;
+    uint32_t clus = firstClus;
+    while(length < h->fatEntries) {
+        length++;
+        clus = getFATEntryForClusterN(v->fd, clus, h);
+        if(clus < 2 || clus >= h->fatEntries) {
+            break;
+        }
+        known = __atomic_load_n(&memo[clus], __ATOMIC_RELAXED);
+        if(known != 0) {
+            length += known;
+            break;
+        }
+    }
+    __atomic_store_n(&memo[firstClus], length, __ATOMIC_RELAXED);
+    releaseChainMemo(v);
+    return length;
+}
+
+static void decodeEntry(fat32Vol *v, const fat32Dir *dir, fat32Entry *entry) {
+    formatDirName(dir, entry->name);
+    entry->attr = dir->DIR_Attr;
+    entry->isDir = (dir->DIR_Attr & ATTR_DIRECTORY) != 0;
+    entry->firstClus = ((uint32_t)dir->DIR_FstClusHI<<16) + dir->DIR_FstClusLO;
+    if(entry->isDir && entry->firstClus == 0) {
+        entry->firstClus = v->h->bs->BPB_RootClus;
+    }
+    entry->size = dir->DIR_FileSize;
+    memcpy(&entry->raw, dir, sizeof(fat32Dir));
+}
+
+/* Call fn for every file and folder in the directory starting at dirClus.
+    The volume label is left out. Returns the nonzero value fn stopped
+    with, or FAT32_OK. */
+int fat32Readdir(fat32Vol *v, uint32_t dirClus, fat32ReaddirFn fn, void *arg) {
+    fat32DirIter it;
+    fat32Dir *dir;
+    fat32Entry entry;
+    int result = FAT32_OK;
+
+    /* The index holds the same entries nextDirEntry would find */
+    const fat32Dir *indexed;
+    int count = sidecarDir(v->h->index, dirClus == 0 ? v->h->bs->BPB_RootClus : dirClus, &indexed);
+    for(int i = 0; i < count && result == FAT32_OK; i++) {
+        if(!(indexed[i].DIR_Attr & ATTR_VOLUME_ID)) {
+            decodeEntry(v, &indexed[i], &entry);
+            result = fn(&entry, arg);
+        }
+    }
+    if(count >= 0) {
+        return result;
+    }
+
+    openDirIter(&it, v->fd, v->h, dirClus);
+    while(result == FAT32_OK && (dir = nextDirEntry(&it)) != NULL) {
+        if(dir->DIR_Attr & ATTR_VOLUME_ID) {
+            continue;
+        }
+        decodeEntry(v, dir, &entry);
+        result = fn(&entry, arg);
+    }
+    closeDirIter(&it);
+    return result;
+}
+
+struct statSearch {
+    fat32Vol *v;
+    uint32_t dirClus;
+    const char *name;
+    fat32Entry *entry;
+};
+
+/* Every entry passed on the way is cached, so looking up its
+    neighbours later costs no scan */
+static int statMatch(const fat32Entry *entry, void *arg) {
+    struct statSearch *search = arg;
+    dentryPut(search->v->dcache, search->dirClus, entry->name, &entry->raw);
+    if(strcmp(entry->name, search->name) == 0) {
+        memcpy(search->entry, entry, sizeof(fat32Entry));
+        return 1;
+    }
+    return 0;
+}
+
+/* Look up name ("NAME.EXT") in the directory starting at dirClus,
+    from the name cache when it's there */
+int fat32Stat(fat32Vol *v, uint32_t dirClus, const char *name, fat32Entry *entry) {
+    if(dirClus == 0) {
+        dirClus = v->h->bs->BPB_RootClus;
+    }
+    fat32Dir raw;
+    if(dentryGet(v->dcache, dirClus, name, &raw)) {
+        decodeEntry(v, &raw, entry);
+        return FAT32_OK;
+    }
+    struct statSearch search = { v, dirClus, name, entry };
+    return fat32Readdir(v, dirClus, statMatch, &search) ? FAT32_OK : FAT32_ERR_NOT_FOUND;
+}
+
+/* Resolve path to its entry: absolute ("/A/B/F.TXT") or relative to the
+    directory starting at dirClus ("B/F.TXT", "../C"). Components are
+    looked up with fat32Stat, so "." and ".." come from the entries on
+    disk and ".." really leads to the parent. The root has neither and
+    is its own parent. A path naming a directory itself ("/", ".")
+    gives an entry with just isDir and firstClus set. */
+int fat32Lookup(fat32Vol *v, uint32_t dirClus, const char *path, fat32Entry *entry) {
+    uint32_t root = v->h->bs->BPB_RootClus;
+    uint32_t cur = (path[0] == '/' || dirClus == 0) ? root : dirClus;
+    memset(entry, 0, sizeof(fat32Entry));
+    strcpy(entry->name, cur == root ? "/" : ".");
+    entry->attr = ATTR_DIRECTORY;
+    entry->isDir = true;
+    entry->firstClus = cur;
+
+    const char *p = path;
+    while(*p != '\0') {
+        size_t length = strcspn(p, "/");
+        if(length == 0) {
+            p++;
+            continue;
+        }
+        if(!entry->isDir) {
+            return FAT32_ERR_NOT_DIR;
+        }
+        if(length >= DIR_PRINT_NAME_LENGTH) {
+            return FAT32_ERR_NOT_FOUND;
+        }
+        char name[DIR_PRINT_NAME_LENGTH];
+        memcpy(name, p, length);
+        name[length] = '\0';
+        p += length;
+
+        if(cur == root && (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)) {
+            continue;
+        }
+        int result = fat32Stat(v, cur, name, entry);
+        if(result != FAT32_OK) {
+            return result;
+        }
+        cur = entry->firstClus;
+    }
+    return FAT32_OK;
+}
+
+/* Read up to len bytes of the file at offset. Returns the bytes read,
+    fewer than asked for when the chain breaks or the image read comes
+    up short part way, 0 at or past the end of the file, or
+    FAT32_ERR_READ when nothing could be read. The cluster
+    holding offset comes from the file's skip index, so a read costs at
+    most SKIP_DEFAULT_INTERVAL FAT lookups to get there, however far in
+    it starts; from there runs of consecutive clusters are read at once. */
+ssize_t fat32Read(fat32Vol *v, const fat32Entry *entry, void *buf, size_t len, uint64_t offset) {
+    if(offset >= entry->size) {
+        return 0;
+    }
+    if(len > entry->size - offset) {
+        len = entry->size - offset;
+    }
+    fat32Head *h = v->h;
+    uint32_t clusBytes = clusterBytes(h);
+    uint32_t clus = skipSeek(v->skip, v->fd, h, entry->firstClus, offset/clusBytes);
+    uint64_t within = offset % clusBytes;
+    size_t done = 0;
+    while(done < len) {
+        if(clus == 0) {
+            return done > 0 ? (ssize_t)done : FAT32_ERR_READ;
+        }
+        /* Extend the run while the chain stays consecutive */
+        uint32_t first = clus;
+        uint32_t count = 1;
+        uint32_t next = 0;
+        while(done + (uint64_t)count*clusBytes - within < len) {
+            next = getFATEntryForClusterN(v->fd, first + count - 1, h);
+            if(next != first + count) {
+                break;
+            }
+            count++;
+        }
+        size_t chunk = (uint64_t)count*clusBytes - within;
+        if(chunk > len - done) {
+            chunk = len - done;
+        }
+        else {
+            /* The run ended before len, next is where the chain goes */
+            clus = next >= 2 && next < h->fatEntries ? next : 0;
+        }
+        ssize_t readd = readImage(v->fd, h, clusterOffset(h, first) + within, (char*)buf + done, chunk);
+        if(readd != (ssize_t)chunk) {
+            done += readd > 0 ? readd : 0;
+            return done > 0 ? (ssize_t)done : FAT32_ERR_READ;
+        }
+        done += chunk;
+        within = 0;
+    }
+    return done;
+}
+
+/* Copy the file into a new host file at hostPath */
+int fat32Extract(fat32Vol *v, const fat32Entry *entry, const char *hostPath) {
+    return fat32ExtractChecksum(v, entry, hostPath, NULL);
+}
+
+/* fat32Extract, also setting *crc to the CRC32C of the data when crc
+    isn't NULL. The sum is taken as the data streams past, so the host
+    file isn't read back. */
+int fat32ExtractChecksum(fat32Vol *v, const fat32Entry *entry, const char *hostPath, uint32_t *crc) {
+    uint64_t started = v->h->stats != NULL ? statsNow() : 0;
+    int result = extractFile(v->fd, v->h, &entry->raw, hostPath, crc);
+    statsSpan(v->h->stats, entry->name, started);
+    if(result == EXTRACT_OK) {
+        return FAT32_OK;
+    }
+    return result == EXTRACT_CREATE_FAILED ? FAT32_ERR_CREATE : FAT32_ERR_READ;
+}
+
+/* One file picked by fat32MultiExtract, and how extracting it went */
+struct multiJob {
+    fat32Vol *v;
+    fat32Entry file;
+    int result;
+};
+
+/* Files of the directory matching fat32MultiExtract's patterns */
+struct multiList {
+    fat32Vol *v;
+    char **patterns;
+    int patternCount;
+    struct multiJob *jobs;
+    int count;
+    int capacity;
+};
+
+static void multiTask(void *arg) {
+    struct multiJob *job = arg;
+    job->result = fat32Extract(job->v, &job->file, job->file.name);
+}
+
+static int collectMatch(const fat32Entry *entry, void *arg) {
+    struct multiList *list = arg;
+    if(entry->isDir) {
+        return 0;
+    }
+    bool matched = false;
+    for(int i = 0; i < list->patternCount && !matched; i++) {
+        matched = fnmatch(list->patterns[i], entry->name, 0) == 0;
+    }
+    if(!matched) {
+        return 0;
+    }
+    if(list->count == list->capacity) {
+        list->capacity *= 2;
+        list->jobs = realloc(list->jobs, list->capacity*sizeof(struct multiJob));
+        if(list->jobs == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", list->capacity*sizeof(struct multiJob));
+            abort();
+        }
+    }
+    list->jobs[list->count].v = list->v;
+    memcpy(&list->jobs[list->count].file, entry, sizeof(fat32Entry));
+    list->count++;
+    return 0;
+}
+
+/* Copy every file of the directory starting at dirClus whose name
+    matches one of the space separated wildcard patterns into the host's
+    current directory, several at once on a pool of workers. Once all
+    have finished, fn is called for each in directory order with its
+    FAT32_* result. Returns the number of files that matched. */
+int fat32MultiExtract(fat32Vol *v, uint32_t dirClus, const char *patterns, fat32ExtractFn fn, void *arg) {
+    char *copy = strdup(patterns);
+    char **split = malloc((strlen(patterns)/2 + 1)*sizeof(char*));
+    if(copy == NULL || split == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", strlen(patterns) + 1);
+        abort();
+    }
+    struct multiList list;
+    list.v = v;
+    list.patterns = split;
+    list.patternCount = 0;
+    char *save;
+    for(char *pattern = strtok_r(copy, " ", &save); pattern != NULL; pattern = strtok_r(NULL, " ", &save)) {
+        split[list.patternCount++] = pattern;
+    }
+    list.count = 0;
+    list.capacity = 64;
+    list.jobs = malloc(list.capacity*sizeof(struct multiJob));
+    if(list.jobs == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", list.capacity*sizeof(struct multiJob));
+        abort();
+    }
+    fat32Readdir(v, dirClus, collectMatch, &list);
+    free(split);
+    free(copy);
+
+    if(list.count > 0) {
+        threadPool *pool = createPool(defaultPoolSize());
+        for(int i = 0; i < list.count; i++) {
+            poolSubmit(pool, multiTask, &list.jobs[i]);
+        }
+        destroyPool(pool);
+    }
+    for(int i = 0; i < list.count; i++) {
+        fn(&list.jobs[i].file, list.jobs[i].result, arg);
+    }
+    int matched = list.count;
+    free(list.jobs);
+    return matched;
+}
+
+/* Copy the host file at hostPath into the directory starting at dirClus
+    as name ("NAME.EXT"). Clusters are allocated next-fit from FSInfo's
+    hint, contiguous when possible. */
+int fat32Put(fat32Vol *v, uint32_t dirClus, const char *hostPath, const char *name) {
+    char shortName[DIR_PRINT_NAME_LENGTH];
+    if(!v->h->writable) {
+        return FAT32_ERR_READONLY;
+    }
+    if(!makeShortName(name, shortName)) {
+        return FAT32_ERR_BAD_NAME;
+    }
+    int hostFd = open(hostPath, O_RDONLY);
+    if(hostFd == -1) {
+        return FAT32_ERR_HOST;
+    }
+
+    pthread_mutex_lock(&v->writeLock);
+    int result = putFile(v->fd, v->h, dirClus, hostFd, shortName);
+    /* The directory's chain may have grown */
+    __atomic_store_n(&v->chainsStale, true, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&v->writeLock);
+    close(hostFd);
+
+    switch(result) {
+    case PUT_OK:
+        return FAT32_OK;
+    case PUT_EXISTS:
+        return FAT32_ERR_EXISTS;
+    case PUT_NO_SPACE:
+        return FAT32_ERR_NO_SPACE;
+    case PUT_READ_FAILED:
+        return FAT32_ERR_HOST;
+    case PUT_TOO_BIG:
+        return FAT32_ERR_TOO_BIG;
+    default:
+        return FAT32_ERR_WRITE;
+    }
+}
+
+/* Compare a file in the image with the host file at hostPath. Returns
+    FAT32_OK when they are the same, or FAT32_ERR_DIFFERENT with
+    *differsAt set to the first byte that isn't. */
+int fat32Verify(fat32Vol *v, const fat32Entry *entry, const char *hostPath, uint64_t *differsAt) {
+    uint64_t started = v->h->stats != NULL ? statsNow() : 0;
+    int result = verifyFile(v->fd, v->h, &entry->raw, hostPath, differsAt);
+    statsSpan(v->h->stats, entry->name, started);
+    switch(result) {
+    case VERIFY_SAME:
+        return FAT32_OK;
+    case VERIFY_DIFFERENT:
+        return FAT32_ERR_DIFFERENT;
+    case VERIFY_OPEN_FAILED:
+        return FAT32_ERR_HOST;
+    default:
+        return FAT32_ERR_READ;
+    }
+}
+
+/* Whether GETs should report a checksum, see FAT32_OPT_CHECKSUM */
+bool fat32ChecksumsEnabled(fat32Vol *v) {
+    return (v->h->opts & FAT32_OPT_CHECKSUM) != 0;
+}
+
+/* Write back every FAT sector and FSInfo changed since the last sync,
+    then wait for the image to reach stable storage. */
+int fat32Sync(fat32Vol *v) {
+    if(!v->h->writable) {
+        return FAT32_OK;
+    }
+    pthread_mutex_lock(&v->writeLock);
+    int flushed = flushFAT(v->fd, v->h);
+    pthread_mutex_unlock(&v->writeLock);
+    if(flushed == -1 || syncImage(v->fd, v->h) == -1) {
+        return FAT32_ERR_WRITE;
+    }
+    return FAT32_OK;
+}
+
+/* Check the whole volume, see fsck.h. Pending FAT changes are written
+    back first so the copies on disk can be compared, and writers are
+    held off until the check is done. */
+void fat32Fsck(fat32Vol *v, fat32FsckReport *report, fat32FsckFn fn, void *arg) {
+    pthread_mutex_lock(&v->writeLock);
+    if(v->h->writable && flushFAT(v->fd, v->h) == -1) {
+        fprintf(stderr, "Warning: failed to write back the FAT before checking.\n");
+    }
+    checkVolume(v->fd, v->h, report, fn, arg);
+    pthread_mutex_unlock(&v->writeLock);
+}
+
+/* Short name of an FSCK_* problem kind */
+const char *fat32FsckProblemName(int problem) {
+    return fsckProblemName(problem);
+}
+
+/* Make fragmented files contiguous, see defrag.h. Other writers are
+    held off (keeping readers away is up to the caller), and nothing is
+    moved if FSCK finds chains shared by two entries or running into free
+    or bad clusters. Cached names hold first clusters, so they are
+    dropped, and so are the memoized chain lengths. */
+int fat32Defrag(fat32Vol *v, fat32DefragReport *report, fat32DefragFn fn, void *arg) {
+    memset(report, 0, sizeof(fat32DefragReport));
+    if(!v->h->writable) {
+        return FAT32_ERR_READONLY;
+    }
+    pthread_mutex_lock(&v->writeLock);
+    if(flushFAT(v->fd, v->h) == -1) {
+        pthread_mutex_unlock(&v->writeLock);
+        return FAT32_ERR_WRITE;
+    }
+    fat32FsckReport check;
+    checkVolume(v->fd, v->h, &check, NULL, NULL);
+    if(check.problems[FSCK_CROSS_LINK] > 0 || check.problems[FSCK_BAD_CHAIN] > 0) {
+        pthread_mutex_unlock(&v->writeLock);
+        return FAT32_ERR_DAMAGED;
+    }
+    defragVolume(v->fd, v->h, report, fn, arg);
+    dentryClear(v->dcache);
+    skipClear(v->skip);
+    __atomic_store_n(&v->chainsStale, true, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&v->writeLock);
+    return report->failed > 0 ? FAT32_ERR_WRITE : FAT32_OK;
+}
+
+/* A short description of a FAT32_* result */
+const char *fat32Strerror(int error) {
+    switch(error) {
+    case FAT32_OK: return "ok";
+    case FAT32_ERR_IO: return "can't read the boot sector";
+    case FAT32_ERR_FAT12: return "volume is FAT12";
+    case FAT32_ERR_FAT16: return "volume is FAT16";
+    case FAT32_ERR_FAT_SIG: return "FAT has incorrect signatures";
+    case FAT32_ERR_FSI_SIG: return "FSInfo signature is incorrect";
+    case FAT32_ERR_NOT_FOUND: return "not found";
+    case FAT32_ERR_CREATE: return "can't create host file";
+    case FAT32_ERR_READ: return "error reading the file";
+    case FAT32_ERR_READONLY: return "image is read-only";
+    case FAT32_ERR_BAD_NAME: return "not a valid 8.3 name";
+    case FAT32_ERR_EXISTS: return "file already exists";
+    case FAT32_ERR_NO_SPACE: return "not enough free space";
+    case FAT32_ERR_WRITE: return "error writing the image";
+    case FAT32_ERR_HOST: return "can't read host file";
+    case FAT32_ERR_NOT_DIR: return "not a directory";
+    case FAT32_ERR_DIFFERENT: return "contents differ";
+    case FAT32_ERR_DAMAGED: return "volume has cross-linked or broken chains, run FSCK";
+    case FAT32_ERR_TOO_BIG: return "file is larger than FAT32's 4 GiB limit";
+    default: return "unknown error";
+    }
+}
+
+bool fat32StatsEnabled(fat32Vol *v) {
+    return v->h->stats != NULL;
+}
+
+/* Time a client command: pass what fat32CommandBegin returned to
+    fat32CommandEnd once the command is done. Both do nothing when
+    stats are off. */
+uint64_t fat32CommandBegin(fat32Vol *v) {
+    return v->h->stats != NULL ? statsNow() : 0;
+}
+
+void fat32CommandEnd(fat32Vol *v, const char *name, uint64_t started) {
+    statsCommand(v->h->stats, name, started);
+}
+
+bool fat32GetCounters(fat32Vol *v, fat32Counters *counters) {
+    if(v->h->stats == NULL) {
+        return false;
+    }
+    statsSnapshot(v->h->stats, counters);
+    return true;
+}
+
+/* Latencies of up to max commands, in the order first seen */
+int fat32GetCommandStats(fat32Vol *v, fat32CommandStats *out, int max) {
+    if(v->h->stats == NULL) {
+        return 0;
+    }
+    return statsCommands(v->h->stats, out, max);
+}
+
+/* Latency below which the given fraction of the command's runs fell */
+uint64_t fat32CommandPercentile(const fat32CommandStats *command, double fraction) {
+    return statsPercentile(command, fraction);
+}
+
+/* The stats summary as one line of JSON, without a new line */
+void fat32WriteStats(fat32Vol *v, FILE *out) {
+    uint64_t hits = 0, misses = 0;
+    int used, capacity;
+    if(v->h->stats == NULL) {
+        fprintf(out, "null");
+        return;
+    }
+    if(v->h->cache != NULL) {
+        cacheCounters(v->h->cache, &hits, &misses, &used, &capacity);
+    }
+    statsWriteJSON(v->h->stats, out, hits, misses);
+}
@@ -0,0 +1,113 @@
+/* The public interface of libfat32: an opaque handle on an open FAT32
+* volume, and calls to look around in it and read files out of it.
+* Every call may be made from any number of threads at once; calls
+* that write to the image take turns.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef LIBFAT32_H
+#define LIBFAT32_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include "fat32types.h"
+
+/* Results of the fat32* calls */
+#define FAT32_OK 0
+#define FAT32_ERR_IO -1 // Couldn't read the boot sector
+#define FAT32_ERR_FAT12 -2 // Volume is FAT12
+#define FAT32_ERR_FAT16 -3 // Volume is FAT16
+#define FAT32_ERR_FAT_SIG -4 // First two FAT entries are wrong
+#define FAT32_ERR_FSI_SIG -5 // An FSInfo signature is wrong
+#define FAT32_ERR_NOT_FOUND -6 // No such entry
+#define FAT32_ERR_CREATE -7 // Host file exists or can't be created
+#define FAT32_ERR_READ -8 // Chain too short for the file, or an I/O error
+#define FAT32_ERR_READONLY -9 // Image wasn't opened for writing
+#define FAT32_ERR_BAD_NAME -10 // Name doesn't fit 8.3
+#define FAT32_ERR_EXISTS -11 // Name already used in the directory
+#define FAT32_ERR_NO_SPACE -12 // Not enough free clusters
+#define FAT32_ERR_WRITE -13 // Writing the image failed
+#define FAT32_ERR_HOST -14 // Host file can't be opened or read
+#define FAT32_ERR_NOT_DIR -15 // A path component other than the last is a file
+#define FAT32_ERR_DIFFERENT -16 // VERIFY found the host file isn't the same
+#define FAT32_ERR_DAMAGED -17 // Cross-linked or broken chains, run FSCK first
+#define FAT32_ERR_TOO_BIG -18 // Host file is over FAT32's 4 GiB file size limit
+
+typedef struct fat32Vol fat32Vol;
+
+/* One directory entry, decoded */
+struct fat32Entry {
+	char name[DIR_PRINT_NAME_LENGTH]; // "NAME.EXT"
+	uint8_t attr;
+	bool isDir;
+	uint32_t firstClus; // Root cluster for ".." entries that say 0
+	uint32_t size;
+	fat32Dir raw; // The entry as it is on disk
+};
+typedef struct fat32Entry fat32Entry;
+
+/* Called for every entry by fat32Readdir, return nonzero to stop early */
+typedef int (*fat32ReaddirFn)(const fat32Entry *entry, void *arg);
+
+/* Called by fat32MultiExtract for each file it copied, with a FAT32_* result */
+typedef void (*fat32ExtractFn)(const fat32Entry *file, int result, void *arg);
+
+/* Called by fat32Walk for every file and folder below the starting
+	directory, with its full path. Calls come from several threads at once. */
+typedef void (*fat32WalkFn)(const char *path, const fat32Entry *entry, void *arg);
+
+/* What a directory and everything below it hold */
+struct fat32DuTotals {
+	uint64_t size; // Sum of DIR_FileSize
+	uint64_t clusters; // Clusters allocated, the directories' own included
+	uint32_t files;
+	uint32_t dirs; // Not counting the directory itself
+};
+typedef struct fat32DuTotals fat32DuTotals;
+
+/* Called by fat32Du once per directory, in path order, from the caller's thread */
+typedef void (*fat32DuFn)(const char *path, const fat32DuTotals *totals, void *arg);
+
+fat32Vol *fat32Open(int fd, const fat32Options *options, int *error);
+void fat32Close(fat32Vol *v);
+
+const fat32BS *fat32BootSector(fat32Vol *v);
+const FSI *fat32FSInfo(fat32Vol *v);
+const fat32Dir *fat32VolumeEntry(fat32Vol *v);
+uint32_t fat32RootCluster(fat32Vol *v);
+uint32_t fat32TotalClusters(fat32Vol *v);
+uint32_t fat32FreeClusters(fat32Vol *v);
+uint32_t fat32ChainLength(fat32Vol *v, uint32_t firstClus);
+bool fat32CacheCounters(fat32Vol *v, uint64_t *hits, uint64_t *misses, int *used, int *capacity);
+void fat32DentryCounters(fat32Vol *v, uint64_t *hits, uint64_t *misses, int *used, int *capacity);
+
+int fat32Readdir(fat32Vol *v, uint32_t dirClus, fat32ReaddirFn fn, void *arg);
+int fat32Walk(fat32Vol *v, uint32_t dirClus, const char *path, fat32WalkFn fn, void *arg);
+int fat32Find(fat32Vol *v, const char *pattern, fat32WalkFn fn, void *arg);
+void fat32Du(fat32Vol *v, uint32_t dirClus, const char *path, fat32DuTotals *total, fat32DuFn fn, void *arg);
+int fat32Stat(fat32Vol *v, uint32_t dirClus, const char *name, fat32Entry *entry);
+int fat32Lookup(fat32Vol *v, uint32_t dirClus, const char *path, fat32Entry *entry);
+ssize_t fat32Read(fat32Vol *v, const fat32Entry *entry, void *buf, size_t len, uint64_t offset);
+int fat32Extract(fat32Vol *v, const fat32Entry *entry, const char *hostPath);
+int fat32ExtractChecksum(fat32Vol *v, const fat32Entry *entry, const char *hostPath, uint32_t *crc);
+int fat32MultiExtract(fat32Vol *v, uint32_t dirClus, const char *patterns, fat32ExtractFn fn, void *arg);
+int fat32Verify(fat32Vol *v, const fat32Entry *entry, const char *hostPath, uint64_t *differsAt);
+bool fat32ChecksumsEnabled(fat32Vol *v);
+int fat32Put(fat32Vol *v, uint32_t dirClus, const char *hostPath, const char *name);
+int fat32Sync(fat32Vol *v);
+void fat32Fsck(fat32Vol *v, fat32FsckReport *report, fat32FsckFn fn, void *arg);
+const char *fat32FsckProblemName(int problem);
+int fat32Defrag(fat32Vol *v, fat32DefragReport *report, fat32DefragFn fn, void *arg);
+const char *fat32Strerror(int error);
+
+bool fat32StatsEnabled(fat32Vol *v);
+uint64_t fat32CommandBegin(fat32Vol *v);
+void fat32CommandEnd(fat32Vol *v, const char *name, uint64_t started);
+bool fat32GetCounters(fat32Vol *v, fat32Counters *counters);
+int fat32GetCommandStats(fat32Vol *v, fat32CommandStats *out, int max);
+uint64_t fat32CommandPercentile(const fat32CommandStats *command, double fraction);
+void fat32WriteStats(fat32Vol *v, FILE *out);
+
+#endif
@@ -6,25 +6,80 @@
 #include <unistd.h>
 
 #include "shell.h"
+#include "batch.h"
+#include "libfat32.h"
 
 int main(int argc, char *argv[]) 
 {
 	int fd;
-	if (argc != 2) 
+	fat32Options options = { 0, FAT32_DEFAULT_CACHE_BLOCKS, FAT32_DEFAULT_PREFETCH };
+	const char *commands = NULL;
+	int c;
+	while ((c = getopt(argc, argv, "mwpksC:r:c:j:t:x:")) != -1)
 	{
-		printf("Usage: %s <file>\n", argv[0]);
+		switch (c)
+		{
+		case 'm': // mmap the image
+			options.flags |= FAT32_OPT_MMAP;
+			break;
+		case 'w': // allow writes to the image
+			options.flags |= FAT32_OPT_WRITE;
+			break;
+		case 'p': // pipelined reads/writes for large GETs
+			options.flags |= FAT32_OPT_PIPELINE;
+			break;
+		case 'k': // report the CRC32C of every GET
+			options.flags |= FAT32_OPT_CHECKSUM;
+			break;
+		case 'C': // clusters held by the block cache
+			options.cacheBlocks = atoi(optarg);
+			break;
+		case 'r': // clusters to hint ahead of reads, 0 turns hints off
+			options.prefetchClusters = atoi(optarg);
+			break;
+		case 'c': // batch mode, "-" reads the commands from stdin
+			commands = optarg;
+			break;
+		case 's': // count I/O and time commands, see STATS
+			options.flags |= FAT32_OPT_STATS;
+			break;
+		case 'j': // write the stats as JSON on exit
+			options.statsJson = optarg;
+			break;
+		case 't': // write a Chrome trace of the commands on exit
+			options.statsTrace = optarg;
+			break;
+		case 'x': // sidecar index, built if missing or out of date
+			options.indexPath = optarg;
+			break;
+		default:
+			printf("Usage: %s [-m] [-w] [-p] [-k] [-s] [-j stats.json] [-t trace.json] [-x index] [-C clusters] [-r clusters] [-c commands|-] <file>\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (argc - optind != 1) 
+	{
+		printf("Usage: %s [-m] [-w] [-p] [-k] [-s] [-j stats.json] [-t trace.json] [-x index] [-C clusters] [-r clusters] [-c commands|-] <file>\n", argv[0]);
 		exit(1);
 	}
 
-	char *file = argv[1];
- 	fd = open(file, O_RDWR);
+	char *file = argv[optind];
+ 	fd = open(file, (options.flags & FAT32_OPT_WRITE) ? O_RDWR : O_RDONLY);
 	if (-1 == fd) 
 	{
 		perror("opening file: ");
 		exit(1);
 	}
 
-	shellLoop(fd);
+	int status = 0;
+	if (commands != NULL) {
+		int failed = batchRun(fd, &options, commands);
+		status = failed == 0 ? 0 : (failed < 0 ? 2 : 1);
+	}
+	else {
+		shellLoop(fd, &options);
+	}
 
 	close(fd);
+	return status;
 }
@@ -0,0 +1,380 @@
+/* mkfat32 builds synthetic FAT32 images for benchmarking: a tree of
+* directories depth levels deep with fanout subdirectories and files
+* regular files in each, on an image of the given size. Clusters are
+* handed out in order; with -f, each new cluster has that percent
+* chance of skipping ahead over a few free ones instead, so chains come
+* out fragmented and the free space is left in holes. The same options
+* and seed always give the same image.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "fat32.h"
+
+#define BYTES_PER_SEC 512
+#define RESERVED_SECTORS 32
+#define NUM_FATS 2
+#define FSINFO_SECTOR 1
+#define BACKUP_BOOT_SECTOR 6
+#define ROOT_CLUSTER 2
+#define FAT_EOC 0x0FFFFFFF
+#define FAT_MEDIA_ENTRY 0x0FFFFFF8
+#define FSInfo_LeadSig 0x41615252
+#define FSInfo_StrucSig 0x61417272
+#define FSInfo_TrailSig 0xAA550000
+#define FRAG_MAX_SKIP 8 // Most free clusters one fragmentation skip leaves
+#define WRITE_CHUNK (1024*1024)
+#define SHORT_NAME_LENGTH 11
+
+/* Everything the image is built from */
+struct genParams {
+	uint32_t sizeMB;
+	int secPerClus; // 0 picks the largest that still makes FAT32
+	int fragPercent;
+	int depth;
+	int fanout;
+	int files; // Files per directory
+	uint32_t fileSize; // Mean file size, sizes are spread over 1..2x
+	uint32_t seed;
+};
+
+/* The image under construction */
+struct genImage {
+	int fd;
+	uint32_t secPerClus;
+	uint32_t clusterBytes;
+	uint32_t fatSectors;
+	uint32_t clusterCount;
+	uint32_t dataSector; // First sector of cluster 2
+	uint32_t *fat;
+	uint32_t next; // Next cluster the allocator looks at
+	uint64_t rng;
+	int fragPercent;
+	/* Totals reported at the end */
+	uint32_t dirs;
+	uint32_t fileCount;
+	uint64_t bytes;
+	uint32_t fragments; // Places where a chain jumps
+};
+
+static uint64_t nextRandom(uint64_t *state) {
+	/* xorshift64* */
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void fail(const char *message) {
+	fprintf(stderr, "mkfat32: %s\n", message);
+	exit(1);
+}
+
+static void writeAt(struct genImage *img, uint64_t offset, const void *buf, size_t len) {
+	size_t done = 0;
+	while(done < len) {
+		ssize_t written = pwrite(img->fd, (const char*)buf + done, len - done, offset + done);
+		if(written == -1 && errno == EINTR) {
+			continue;
+		}
+		if(written <= 0) {
+			perror("mkfat32: write failed");
+			exit(1);
+		}
+		done += written;
+	}
+}
+
+static uint64_t genOffset(struct genImage *img, uint32_t N) {
+	return ((uint64_t)img->dataSector + (uint64_t)(N - 2)*img->secPerClus)*BYTES_PER_SEC;
+}
+
+/* Take count clusters and link them into a chain, returns the first */
+static uint32_t allocChain(struct genImage *img, uint32_t count) {
+	uint32_t first = 0;
+	uint32_t prev = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		if(i > 0 && img->fragPercent > 0 && (int)(nextRandom(&img->rng) % 100) < img->fragPercent) {
+			img->next += 1 + nextRandom(&img->rng) % FRAG_MAX_SKIP;
+		}
+		if(img->next >= img->clusterCount + 2) {
+			fail("image too small for this tree, use a larger -s or fewer files");
+		}
+		uint32_t N = img->next++;
+		if(prev == 0) {
+			first = N;
+		}
+		else {
+			img->fat[prev] = N;
+			img->fragments += N != prev + 1;
+		}
+		prev = N;
+	}
+	img->fat[prev] = FAT_EOC;
+	return first;
+}
+
+/* Write len bytes of buf along the chain starting at N, one write per
+	run of consecutive clusters */
+static void writeChain(struct genImage *img, uint32_t N, const unsigned char *buf, uint64_t len) {
+	uint64_t done = 0;
+	while(done < len) {
+		uint32_t run = 1;
+		while((uint64_t)run*img->clusterBytes < len - done && img->fat[N + run - 1] == N + run) {
+			run++;
+		}
+		uint64_t chunk = (uint64_t)run*img->clusterBytes;
+		if(chunk > len - done) {
+			chunk = len - done;
+		}
+		writeAt(img, genOffset(img, N), buf + done, chunk);
+		done += chunk;
+		N = img->fat[N + run - 1];
+	}
+}
+
+static void setEntry(fat32Dir *entry, const char *shortName, uint8_t attr, uint32_t clus, uint32_t size) {
+	memset(entry, 0, sizeof(fat32Dir));
+	memcpy(entry->DIR_Name, shortName, SHORT_NAME_LENGTH);
+	entry->DIR_Attr = attr;
+	entry->DIR_FstClusHI = clus >> 16;
+	entry->DIR_FstClusLO = clus & 0xFFFF;
+	entry->DIR_FileSize = size;
+	entry->DIR_WrtDate = ((2020 - 1980) << 9) | (1 << 5) | 1;
+	entry->DIR_CrtDate = entry->DIR_WrtDate;
+	entry->DIR_LstAccDate = entry->DIR_WrtDate;
+}
+
+/* Allocate and fill one file, returns its first cluster */
+static uint32_t makeFile(struct genImage *img, const struct genParams *p, uint32_t size) {
+	if(size == 0) {
+		return 0;
+	}
+	uint32_t clusters = (size + img->clusterBytes - 1)/img->clusterBytes;
+	uint32_t first = allocChain(img, clusters);
+	unsigned char *buf = malloc(WRITE_CHUNK);
+	if(buf == NULL) {
+		fail("out of memory");
+	}
+	/* Write in chunks so big files don't need a buffer of their own size */
+	uint32_t N = first;
+	uint64_t done = 0;
+	while(done < size) {
+		uint64_t chunk = size - done > WRITE_CHUNK ? WRITE_CHUNK : size - done;
+		for(uint64_t i = 0; i < chunk; i += sizeof(uint64_t)) {
+			uint64_t word = nextRandom(&img->rng);
+			memcpy(buf + i, &word, chunk - i < sizeof(uint64_t) ? chunk - i : sizeof(uint64_t));
+		}
+		writeChain(img, N, buf, chunk);
+		for(uint64_t skip = 0; skip < chunk/img->clusterBytes; skip++) {
+			N = img->fat[N];
+		}
+		done += chunk;
+	}
+	free(buf);
+	img->fileCount++;
+	img->bytes += size;
+	return first;
+}
+
+/* Build the directory at clus and everything under it */
+static void makeDir(struct genImage *img, const struct genParams *p, uint32_t clus, uint32_t parent, int level, uint32_t *serial) {
+	bool isRoot = clus == ROOT_CLUSTER;
+	int subdirs = level < p->depth ? p->fanout : 0;
+	uint32_t entries = 2 + p->files + subdirs + 1; // dots, files, subdirs, end marker
+	uint32_t perCluster = img->clusterBytes/sizeof(fat32Dir);
+	uint32_t clusters = (entries + perCluster - 1)/perCluster;
+	if(isRoot) {
+		img->fat[ROOT_CLUSTER] = FAT_EOC;
+		if(clusters > 1) {
+			img->fat[ROOT_CLUSTER] = allocChain(img, clusters - 1);
+		}
+	}
+	fat32Dir *dir = calloc(clusters, img->clusterBytes);
+	if(dir == NULL) {
+		fail("out of memory");
+	}
+	img->dirs++;
+
+	int used = 0;
+	char shortName[SHORT_NAME_LENGTH + 1];
+	if(isRoot) {
+		setEntry(&dir[used++], "BENCHVOL   ", ATTR_VOLUME_ID, 0, 0);
+	}
+	else {
+		setEntry(&dir[used++], ".          ", ATTR_DIRECTORY, clus, 0);
+		setEntry(&dir[used++], "..         ", ATTR_DIRECTORY, parent == ROOT_CLUSTER ? 0 : parent, 0);
+	}
+	for(int i = 0; i < p->files; i++) {
+		uint32_t size = p->fileSize == 0 ? 0 : 1 + nextRandom(&img->rng) % (2*(uint64_t)p->fileSize);
+		snprintf(shortName, sizeof(shortName), "F%07uDAT", (*serial)++ % 10000000);
+		uint32_t first = makeFile(img, p, size);
+		setEntry(&dir[used++], shortName, ATTR_ARCHIVE, first, size);
+	}
+	for(int i = 0; i < subdirs; i++) {
+		snprintf(shortName, sizeof(shortName), "D%07u   ", (*serial)++ % 10000000);
+		uint32_t child = allocChain(img, 1);
+		/* The child's whole chain is taken now, ahead of its files */
+		uint32_t childEntries = 2 + p->files + (level + 1 < p->depth ? p->fanout : 0) + 1;
+		uint32_t childClusters = (childEntries + perCluster - 1)/perCluster;
+		if(childClusters > 1) {
+			img->fat[child] = allocChain(img, childClusters - 1);
+			img->fragments += img->fat[child] != child + 1;
+		}
+		setEntry(&dir[used++], shortName, ATTR_DIRECTORY, child, 0);
+		makeDir(img, p, child, clus, level + 1, serial);
+	}
+	writeChain(img, clus, (unsigned char*)dir, (uint64_t)clusters*img->clusterBytes);
+	free(dir);
+}
+
+/* Work out the geometry for the requested size */
+static void layout(struct genImage *img, const struct genParams *p) {
+	uint64_t totalSectors = (uint64_t)p->sizeMB*1024*1024/BYTES_PER_SEC;
+	if(totalSectors > UINT32_MAX) {
+		fail("image too large");
+	}
+	static const int choices[] = { 64, 32, 16, 8, 4, 2, 1 };
+	for(int c = 0; c < (int)(sizeof(choices)/sizeof(choices[0])); c++) {
+		uint32_t spc = p->secPerClus != 0 ? (uint32_t)p->secPerClus : (uint32_t)choices[c];
+		/* The FAT size and cluster count depend on each other, settle them */
+		uint32_t fatSectors = 1;
+		uint32_t clusters = 0;
+		for(int round = 0; round < 4; round++) {
+			uint64_t dataSectors = totalSectors - RESERVED_SECTORS - (uint64_t)NUM_FATS*fatSectors;
+			clusters = dataSectors/spc;
+			fatSectors = ((uint64_t)(clusters + 2)*sizeof(uint32_t) + BYTES_PER_SEC - 1)/BYTES_PER_SEC;
+		}
+		if(clusters >= FAT16_TOTAL_CLUSTERS) {
+			img->secPerClus = spc;
+			img->clusterBytes = spc*BYTES_PER_SEC;
+			img->fatSectors = fatSectors;
+			img->clusterCount = clusters;
+			img->dataSector = RESERVED_SECTORS + NUM_FATS*fatSectors;
+			return;
+		}
+		if(p->secPerClus != 0) {
+			break;
+		}
+	}
+	fail("image too small for FAT32, it needs at least 65525 clusters");
+}
+
+static void writeMetadata(struct genImage *img, const struct genParams *p, uint32_t freeClusters) {
+	fat32BS bs;
+	memset(&bs, 0, sizeof(fat32BS));
+	memcpy(bs.BS_jmpBoot, "\xEB\x58\x90", 3);
+	memcpy(bs.BS_OEMName, "MKFAT32 ", BS_OEMName_LENGTH);
+	bs.BPB_BytesPerSec = BYTES_PER_SEC;
+	bs.BPB_SecPerClus = img->secPerClus;
+	bs.BPB_RsvdSecCnt = RESERVED_SECTORS;
+	bs.BPB_NumFATs = NUM_FATS;
+	bs.BPB_Media = 0xF8;
+	bs.BPB_SecPerTrk = 63;
+	bs.BPB_NumHeads = 255;
+	bs.BPB_TotSec32 = (uint64_t)p->sizeMB*1024*1024/BYTES_PER_SEC;
+	bs.BPB_FATSz32 = img->fatSectors;
+	bs.BPB_RootClus = ROOT_CLUSTER;
+	bs.BPB_FSInfo = FSINFO_SECTOR;
+	bs.BPB_BkBootSec = BACKUP_BOOT_SECTOR;
+	bs.BS_DrvNum = 0x80;
+	bs.BS_BootSig = 0x29;
+	bs.BS_VolID = p->seed;
+	memcpy(bs.BS_VolLab, "BENCHVOL   ", BS_VolLab_LENGTH);
+	memcpy(bs.BS_FilSysType, "FAT32   ", BS_FilSysType_LENGTH);
+	bs.BS_SigA = 0x55;
+	bs.BS_SigB = 0xAA;
+	writeAt(img, 0, &bs, sizeof(fat32BS));
+	writeAt(img, (uint64_t)BACKUP_BOOT_SECTOR*BYTES_PER_SEC, &bs, sizeof(fat32BS));
+
+	FSI fsi;
+	memset(&fsi, 0, sizeof(FSI));
+	fsi.FSI_LeadSig = FSInfo_LeadSig;
+	fsi.FSI_StrucSig = FSInfo_StrucSig;
+	fsi.FSI_Free_Count = freeClusters;
+	fsi.FSI_Nxt_Free = img->next;
+	fsi.FSI_TrailSig = FSInfo_TrailSig;
+	writeAt(img, (uint64_t)FSINFO_SECTOR*BYTES_PER_SEC, &fsi, sizeof(FSI));
+	writeAt(img, (uint64_t)(BACKUP_BOOT_SECTOR + FSINFO_SECTOR)*BYTES_PER_SEC, &fsi, sizeof(FSI));
+
+	size_t fatBytes = (size_t)img->fatSectors*BYTES_PER_SEC;
+	for(int copy = 0; copy < NUM_FATS; copy++) {
+		writeAt(img, ((uint64_t)RESERVED_SECTORS + (uint64_t)copy*img->fatSectors)*BYTES_PER_SEC, img->fat, fatBytes);
+	}
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-s MB] [-c sectors/cluster] [-f frag%%] [-d depth] [-n fanout] [-F files/dir] [-S mean file bytes] [-r seed] <image>\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	struct genParams p = { 256, 0, 0, 2, 4, 16, 64*1024, 1 };
+	int c;
+	while((c = getopt(argc, argv, "s:c:f:d:n:F:S:r:")) != -1) {
+		switch(c) {
+		case 's': p.sizeMB = strtoul(optarg, NULL, 10); break;
+		case 'c': p.secPerClus = atoi(optarg); break;
+		case 'f': p.fragPercent = atoi(optarg); break;
+		case 'd': p.depth = atoi(optarg); break;
+		case 'n': p.fanout = atoi(optarg); break;
+		case 'F': p.files = atoi(optarg); break;
+		case 'S': p.fileSize = strtoul(optarg, NULL, 10); break;
+		case 'r': p.seed = strtoul(optarg, NULL, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+	if(argc - optind != 1 || p.fragPercent < 0 || p.fragPercent > 100 || p.depth < 0 || p.fanout < 0 || p.files < 0) {
+		usage(argv[0]);
+	}
+	if(p.secPerClus != 0 && (p.secPerClus > 128 || (p.secPerClus & (p.secPerClus - 1)) != 0)) {
+		fail("sectors per cluster must be a power of two up to 128");
+	}
+
+	struct genImage img;
+	memset(&img, 0, sizeof(img));
+	layout(&img, &p);
+	img.fragPercent = p.fragPercent;
+	img.rng = 0x9E3779B97F4A7C15ULL ^ p.seed;
+	img.next = ROOT_CLUSTER + 1;
+	img.fat = calloc((size_t)img.fatSectors*BYTES_PER_SEC, 1);
+	if(img.fat == NULL) {
+		fail("out of memory");
+	}
+	img.fat[0] = FAT_MEDIA_ENTRY;
+	img.fat[1] = 0xFFFFFFFF;
+
+	img.fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(img.fd == -1) {
+		perror("mkfat32: can't create image");
+		return 1;
+	}
+	if(ftruncate(img.fd, (off_t)p.sizeMB*1024*1024) == -1) {
+		perror("mkfat32: can't size image");
+		return 1;
+	}
+
+	uint32_t serial = 0;
+	makeDir(&img, &p, ROOT_CLUSTER, 0, 0, &serial);
+
+	uint32_t used = 0;
+	for(uint32_t N = 2; N < img.clusterCount + 2; N++) {
+		used += img.fat[N] != 0;
+	}
+	writeMetadata(&img, &p, img.clusterCount - used);
+	if(close(img.fd) == -1) {
+		perror("mkfat32: close failed");
+		return 1;
+	}
+	printf("%s: %u MB, %u bytes/cluster, %u clusters (%u used), %u dirs, %u files, %" PRIu64 " bytes, %u fragments\n",
+		argv[optind], p.sizeMB, img.clusterBytes, img.clusterCount, used, img.dirs, img.fileCount, img.bytes, img.fragments);
+	free(img.fat);
+	return 0;
+}
@@ -0,0 +1,248 @@
+/* pool.c runs tasks on a fixed set of worker threads. Every worker
+* owns a deque: tasks a worker submits go to the bottom of its own
+* deque and it pops them back LIFO, which keeps a recursive walk
+* depth first and cache warm. A worker with nothing left steals from
+* the top of another worker's deque, so one deep branch of a tree
+* doesn't leave the others idle. Tasks submitted from outside the
+* pool are spread over the deques round robin.
+* poolWait blocks until every submitted task, including ones
+* submitted by other tasks, has finished.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#include "pool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define DEQUE_INITIAL_CAPACITY 64
+
+struct poolJob {
+    poolTask fn;
+    void *arg;
+};
+
+/* Growable ring, the owner works the bottom and thieves take the top */
+struct poolDeque {
+    struct poolJob *jobs;
+    int capacity;
+    int top; // Index of the oldest job
+    int size;
+    pthread_mutex_t lock;
+};
+
+struct poolWorkerArg {
+    threadPool *p;
+    int index;
+};
+
+struct threadPool {
+    pthread_t threads[POOL_MAX_THREADS];
+    struct poolWorkerArg args[POOL_MAX_THREADS];
+    struct poolDeque deques[POOL_MAX_THREADS];
+    int threadCount;
+    int nextDeque; // Round robin target for outside submissions
+
+    int queued; // Jobs sitting in some deque, not yet claimed
+    int pending; // Queued plus running jobs
+
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t haveJob;
+    pthread_cond_t allDone;
+};
+
+/* Which pool and deque the calling thread works for, if any */
+static __thread threadPool *currentPool = NULL;
+static __thread int currentWorker = -1;
+
+static void dequePush(struct poolDeque *d, struct poolJob job) {
+    pthread_mutex_lock(&d->lock);
+    if(d->size == d->capacity) {
+        struct poolJob *jobs = malloc(2*d->capacity*sizeof(struct poolJob));
+        if(jobs == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", 2*d->capacity*sizeof(struct poolJob));
+            abort();
+        }
+        for(int i = 0; i < d->size; i++) {
+            jobs[i] = d->jobs[(d->top + i) % d->capacity];
+        }
+        free(d->jobs);
+        d->jobs = jobs;
+        d->top = 0;
+        d->capacity *= 2;
+    }
+    d->jobs[(d->top + d->size) % d->capacity] = job;
+    d->size++;
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* Owner side: newest job first */
+static bool dequePopBottom(struct poolDeque *d, struct poolJob *job) {
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if(d->size > 0) {
+        d->size--;
+        *job = d->jobs[(d->top + d->size) % d->capacity];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+/* Thief side: oldest job first, usually the biggest piece of work */
+static bool dequeStealTop(struct poolDeque *d, struct poolJob *job) {
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if(d->size > 0) {
+        *job = d->jobs[d->top];
+        d->top = (d->top + 1) % d->capacity;
+        d->size--;
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+/* Worker thread: claim a job, then find it in our deque or steal it */
+static void *poolWorker(void *arg) {
+    struct poolWorkerArg *wa = arg;
+    threadPool *p = wa->p;
+    currentPool = p;
+    currentWorker = wa->index;
+
+    while(true) {
+        pthread_mutex_lock(&p->lock);
+        while(p->queued == 0 && !p->stopping) {
+            pthread_cond_wait(&p->haveJob, &p->lock);
+        }
+        if(p->queued == 0) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        /* Claiming one here guarantees a job is waiting in some deque */
+        p->queued--;
+        pthread_mutex_unlock(&p->lock);
+
+        struct poolJob job;
+        bool found = dequePopBottom(&p->deques[wa->index], &job);
+        for(int i = 1; !found; i++) {
+            found = dequeStealTop(&p->deques[(wa->index + i) % p->threadCount], &job);
+        }
+
+        job.fn(job.arg);
+
+        pthread_mutex_lock(&p->lock);
+        p->pending--;
+        if(p->pending == 0) {
+            pthread_cond_broadcast(&p->allDone);
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+/* Twice the online CPUs, so I/O bound tasks keep the queue deep */
+int defaultPoolSize(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus < 1) {
+        cpus = 1;
+    }
+    return cpus*2 > POOL_MAX_THREADS ? POOL_MAX_THREADS : cpus*2;
+}
+
+threadPool *createPool(int threads) {
+    threadPool *p = malloc(sizeof(threadPool));
+    if(p == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(threadPool));
+        abort();
+    }
+    if(threads < 1) {
+        threads = 1;
+    }
+    if(threads > POOL_MAX_THREADS) {
+        threads = POOL_MAX_THREADS;
+    }
+    p->queued = 0;
+    p->pending = 0;
+    p->stopping = false;
+    p->nextDeque = 0;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->haveJob, NULL);
+    pthread_cond_init(&p->allDone, NULL);
+    for(int i = 0; i < threads; i++) {
+        struct poolDeque *d = &p->deques[i];
+        d->jobs = malloc(DEQUE_INITIAL_CAPACITY*sizeof(struct poolJob));
+        if(d->jobs == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", DEQUE_INITIAL_CAPACITY*sizeof(struct poolJob));
+            abort();
+        }
+        d->capacity = DEQUE_INITIAL_CAPACITY;
+        d->top = 0;
+        d->size = 0;
+        pthread_mutex_init(&d->lock, NULL);
+    }
+    /* Deques must exist before any worker can go looking for work */
+    p->threadCount = threads;
+    for(int i = 0; i < threads; i++) {
+        p->args[i].p = p;
+        p->args[i].index = i;
+        if(pthread_create(&p->threads[i], NULL, poolWorker, &p->args[i]) != 0) {
+            fprintf(stderr, "Fatal: failed to start worker thread %d.\n", i);
+            abort();
+        }
+    }
+    return p;
+}
+
+/* Queue fn(arg). From inside a task it lands on that worker's own deque. */
+void poolSubmit(threadPool *p, poolTask fn, void *arg) {
+    struct poolJob job = { fn, arg };
+    int target;
+    if(currentPool == p) {
+        target = currentWorker;
+    }
+    else {
+        pthread_mutex_lock(&p->lock);
+        target = p->nextDeque;
+        p->nextDeque = (p->nextDeque + 1) % p->threadCount;
+        pthread_mutex_unlock(&p->lock);
+    }
+    dequePush(&p->deques[target], job);
+
+    pthread_mutex_lock(&p->lock);
+    p->queued++;
+    p->pending++;
+    pthread_cond_signal(&p->haveJob);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Block until no jobs are queued or running */
+void poolWait(threadPool *p) {
+    pthread_mutex_lock(&p->lock);
+    while(p->pending > 0) {
+        pthread_cond_wait(&p->allDone, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+void destroyPool(threadPool *p) {
+    poolWait(p);
+    pthread_mutex_lock(&p->lock);
+    p->stopping = true;
+    pthread_cond_broadcast(&p->haveJob);
+    pthread_mutex_unlock(&p->lock);
+    for(int i = 0; i < p->threadCount; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+    for(int i = 0; i < p->threadCount; i++) {
+        free(p->deques[i].jobs);
+        pthread_mutex_destroy(&p->deques[i].lock);
+    }
+    pthread_cond_destroy(&p->allDone);
+    pthread_cond_destroy(&p->haveJob);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
@@ -0,0 +1,20 @@
+/* A fixed size, work-stealing pool of worker threads.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#define POOL_MAX_THREADS 16
+
+typedef void (*poolTask)(void *arg);
+
+typedef struct threadPool threadPool;
+
+int defaultPoolSize(void);
+threadPool *createPool(int threads);
+void poolSubmit(threadPool *p, poolTask fn, void *arg);
+void poolWait(threadPool *p);
+void destroyPool(threadPool *p);
+
+#endif
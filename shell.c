@@ -4,6 +4,21 @@
 * DIR: Display the info of the current folder you're at. 
 * CD: Goes into a new directory if that directory exists.
 * GET: Get a specific file from the current directory to your local directory.
+* CD, GET and EXPORT take paths too, like /A/B or ../C/FILE.TXT.
+* With -k, GET also prints the CRC32C of the data it copied.
+* MGET: Get every file in the current directory matching wildcard patterns.
+* EXPORT: Copy a folder and everything below it to a local path.
+* CACHE: Show how well the cluster cache is doing.
+* FREE: Count the free space from the FAT itself.
+* PUT: Copy a local file into the current directory (needs -w).
+* SYNC: Write the FAT changes held in memory back to the image.
+* STATS: Show the I/O counters and command latencies (needs -s).
+* FSCK: Check every directory and FAT chain, and the FAT copies.
+* FIND: List every file and folder on the volume matching a wildcard pattern.
+* DU: Total the sizes and allocated clusters of a folder and each folder below it.
+* VERIFY: Compare a file in the image with a local file, byte for byte.
+* DEFRAG: Move every fragmented file into one free run (needs -w).
+* CAT: Print part of a file, given a byte offset and length.
 * Press Ctrl+D to exit.
 * Author: Micah Hanmin Wang #3631308
 */
@@ -14,21 +29,40 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "shell.h"
-#include "fat32.h"
+#include "libfat32.h"
+#include "pool.h"
 #include <stdbool.h>
 #include <inttypes.h>
 
 #define BUF_SIZE 256
+#define FSCK_PRINT_MAX 100 // Problems FSCK lists, the rest are only counted
+#define DEFRAG_PRINT_MAX 100 // Files DEFRAG lists, the rest are only counted
+#define CAT_CHUNK (64*1024) // Bytes CAT reads at a time
 #define CMD_INFO "INFO"
 #define CMD_DIR "DIR"
 #define CMD_CD "CD"
 #define CMD_GET "GET"
 #define CMD_PUT "PUT"
+#define CMD_MGET "MGET"
+#define CMD_EXPORT "EXPORT"
+#define CMD_CACHE "CACHE"
+#define CMD_FREE "FREE"
+#define CMD_SYNC "SYNC"
+#define CMD_STATS "STATS"
+#define CMD_FSCK "FSCK"
+#define CMD_FIND "FIND"
+#define CMD_DU "DU"
+#define CMD_VERIFY "VERIFY"
+#define CMD_DEFRAG "DEFRAG"
+#define CMD_CAT "CAT"
 
 #define BYTE_TO_MB 1000000
 #define MB_TO_GB 1000
@@ -37,65 +71,55 @@
 #define BPB_END_SIG2 0xAA
 #define FIXED_MEDIA 0xF8
 #define NOT_FIXED_MEDIA 0xF0
-#define ATTR_VOLUME_ID 0x08
-#define ATTR_DIRECTORY 0x10
-#define ATTR_ARCHIEVE 0x20
-#define END_OF_CLUSTER 0x0FFFFFF8
-#define END_OF_CLUSTER_CHAIN 0x0FFFFFFF
-#define FSInfo_LeadSig 0x41615252
-#define FSInfo_StrucSig 0x61417272
-#define FSInfo_TrailSig 0xAA550000
-#define DIR_NAME_LENGTH 11
-
-void cleanupHead(fat32Head *h);
-
-void printInfo(fat32Head* h) {
+
+void printInfo(fat32Vol* v) {
+	const fat32BS *bs = fat32BootSector(v);
 	// Check if both Sz16 fields are equal to 0
-	if(h->bs->BPB_FATSz16 == 0 && h->bs-> BPB_TotSec16 == 0) {
+	if(bs->BPB_FATSz16 == 0 && bs-> BPB_TotSec16 == 0) {
 		// Then check the two signature bytes (0x55 0xAA), this tells you if you load it correctly.
-		if(h->bs->BS_SigA == BPB_END_SIG1 && h->bs->BS_SigB == BPB_END_SIG2) {
+		if(bs->BS_SigA == BPB_END_SIG1 && bs->BS_SigB == BPB_END_SIG2) {
 			printf("---- Device Info ----\n");
-			printf("OEM Name: %s\n", h->bs->BS_OEMName);
-			printf("Label: %*.*s\n", BS_VolLab_LENGTH, BS_VolLab_LENGTH, h->bs->BS_VolLab);
-			printf("File System Type: %*.*s\n", BS_FilSysType_LENGTH, BS_FilSysType_LENGTH, h->bs->BS_FilSysType);
-			printf("Media Type: 0x%X ", h->bs->BPB_Media);
-			if(h->bs->BPB_Media == FIXED_MEDIA) {
+			printf("OEM Name: %s\n", bs->BS_OEMName);
+			printf("Label: %*.*s\n", BS_VolLab_LENGTH, BS_VolLab_LENGTH, bs->BS_VolLab);
+			printf("File System Type: %*.*s\n", BS_FilSysType_LENGTH, BS_FilSysType_LENGTH, bs->BS_FilSysType);
+			printf("Media Type: 0x%X ", bs->BPB_Media);
+			if(bs->BPB_Media == FIXED_MEDIA) {
 				printf("(fixed)\n");
 			}
-			else if(h->bs->BPB_Media == NOT_FIXED_MEDIA) {
+			else if(bs->BPB_Media == NOT_FIXED_MEDIA) {
 				printf("not fixed\n");
 			}
 			else {
 				printf("\n");
 			}
-			unsigned long total_byte = (long)h->bs->BPB_BytesPerSec*(long)h->bs->BPB_TotSec32;
+			unsigned long total_byte = (long)bs->BPB_BytesPerSec*(long)bs->BPB_TotSec32;
 			double total_mb = (double)total_byte/BYTE_TO_MB;
 			double total_gb = total_mb/MB_TO_GB;
 			printf("Size: %lu (%dMB, %.3fGB)\n", total_byte, (int)total_mb, total_gb);
-			printf("Drive Number: %d (hard disk)\n\n", h->bs->BS_DrvNum);
+			printf("Drive Number: %d (hard disk)\n\n", bs->BS_DrvNum);
 
 			printf("--- Geometry ---\n");
-			printf("Bytes per Sector: %d\n", h->bs->BPB_BytesPerSec);
-			printf("Sectors per Cluster: %d\n", h->bs->BPB_SecPerClus);
-			printf("Total Sectors: %d\n", h->bs->BPB_TotSec32);
-			printf("Geom: Sectors per Track: %d\n", h->bs->BPB_SecPerTrk);
-			printf("Geom: Heads: %d\n", h->bs->BPB_NumHeads);
-			printf("Hidden Sectors: %d\n\n", h->bs->BPB_HiddSec);
+			printf("Bytes per Sector: %d\n", bs->BPB_BytesPerSec);
+			printf("Sectors per Cluster: %d\n", bs->BPB_SecPerClus);
+			printf("Total Sectors: %d\n", bs->BPB_TotSec32);
+			printf("Geom: Sectors per Track: %d\n", bs->BPB_SecPerTrk);
+			printf("Geom: Heads: %d\n", bs->BPB_NumHeads);
+			printf("Hidden Sectors: %d\n\n", bs->BPB_HiddSec);
 
 			printf("--- FS Info ---\n");
-			printf("Volume ID: %s\n", h->dir->DIR_Name);
-			printf("Version: %d:%d\n", h->bs->BPB_FSVerLow, h->bs->BPB_FSVerLow);
-			printf("Reserved Sectors: %d\n", h->bs->BPB_RsvdSecCnt);
-			printf("Number of FATs: %d\n", h->bs->BPB_NumFATs);
-			printf("FAT Size: %d\n", h->bs->BPB_FATSz32);
-			printf("Mirrored FAT: %d ", h->bs->BPB_ExtFlags);
-			if(h->bs->BPB_ExtFlags == 0){
+			printf("Volume ID: %s\n", fat32VolumeEntry(v)->DIR_Name);
+			printf("Version: %d:%d\n", bs->BPB_FSVerLow, bs->BPB_FSVerLow);
+			printf("Reserved Sectors: %d\n", bs->BPB_RsvdSecCnt);
+			printf("Number of FATs: %d\n", bs->BPB_NumFATs);
+			printf("FAT Size: %d\n", bs->BPB_FATSz32);
+			printf("Mirrored FAT: %d ", bs->BPB_ExtFlags);
+			if(bs->BPB_ExtFlags == 0){
 				printf("(yes)\n");
 			}
 			else {
 				printf("\n");
 			}
-			printf("Boot Sector Backup Sector No: %d\n", h->bs->BPB_BkBootSec);
+			printf("Boot Sector Backup Sector No: %d\n", bs->BPB_BkBootSec);
 		}
 	}
 	else {
@@ -103,343 +127,623 @@ void printInfo(fat32Head* h) {
 	}
 }
 
-void doDir(int fd, fat32Head* h, int curDirClus) {
-	int FirstDataSector = h->bs->BPB_RsvdSecCnt + h->bs->BPB_NumFATs * h->bs->BPB_FATSz32; // 1922+15423*2=32768
-	int currentSector = findFirstDataSectorOfClusterN(h, curDirClus, FirstDataSector);
-
-	// cluster[4096/32] = cluster[128] = 128 dir entries to go through in each cluster
-	int dirEntryNum = h->bs->BPB_BytesPerSec*h->bs->BPB_SecPerClus/sizeof(fat32Dir);
-	unsigned char *cluster[dirEntryNum];
-	int dirIndex = 0; //  0-127
-	// For each dir entry (32B) in the cluster (128 in total)
-	for(dirIndex = 0; dirIndex < dirEntryNum; dirIndex++) {
-		int seek = lseek(fd, currentSector*h->bs->BPB_BytesPerSec + dirIndex*32, SEEK_SET);
-		if(seek == -1) {
-        	perror("Seek failed.\n");
-    	}
-		cluster[dirEntryNum] = malloc(sizeof(fat32Dir));
-		if(cluster[dirEntryNum] == NULL) {
-			fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(fat32Dir));
-			abort();
-    	}
-		int readd = read(fd, cluster[dirEntryNum], sizeof(fat32Dir));
-		if(readd == -1) {
-        	perror("Read failed.\n");
-    	}
-		fat32Dir *dir = (fat32Dir*)(malloc(sizeof(fat32Dir)));
-		if(dir == NULL) {
-			fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(fat32Dir));
-			abort();
-    	}
-		memcpy(dir, cluster[dirEntryNum],  sizeof(fat32Dir)); // Forgive me, I didn't use casting
-
-		/* If we got an archieve, append dot to its name */
-		if(dir->DIR_Attr == ATTR_ARCHIEVE) {
-			int nameIndex = 0;
-			while(dir->DIR_Name[nameIndex] != ' ') {
-				nameIndex++;
-			}
-			dir->DIR_Name[nameIndex] = '.';
-		}
+/* Copy the argument following the first space of a command line into arg */
+void parseArgument(const char *buffer, char *arg) {
+	int i = 0;
+	while(buffer[i] != ' ' && buffer[i] != '\0') {
+		i++;
+	}
+	if(buffer[i] == ' ') {
+		i++; // Skip that space
+	}
+	int j = 0;
+	while(buffer[i] != '\0' && j < BUF_SIZE-1) {
+		arg[j] = buffer[i];
+		i++;
+		j++;
+	}
+	arg[j] = '\0';
+}
 
-		/* If we got a directory or an archieve, remove all spaces from its name and print its info */
-		if(dir->DIR_Attr == ATTR_DIRECTORY || dir->DIR_Attr == ATTR_ARCHIEVE) {
-			char nameNoSpace[DIR_NAME_LENGTH+1];
-			int i;
-			int j = 0;
-
-			for (i = 0; i < strlen(dir->DIR_Name); i++) {
-				if (dir->DIR_Name[i] != ' ') {
-					nameNoSpace[j] = dir->DIR_Name[i];
-					j++;
-				}
-			}
-			if(dir->DIR_Attr == ATTR_DIRECTORY) {
-				//dir
-				nameNoSpace[j-1] = '\0';
-				printf("<%s>\t\t%d\n", nameNoSpace, dir->DIR_FileSize);
-			}
-			else {
-				//archieve
-				nameNoSpace[j] = '\0';
-				printf("%s\t\t%d\n", nameNoSpace, dir->DIR_FileSize);
-			}
-		}
+/* Resolve path from the directory starting at dirClus. wantDir picks
+	between folders and files. */
+bool findEntry(fat32Vol* v, uint32_t dirClus, const char *path, bool wantDir, fat32Entry *found) {
+	return fat32Lookup(v, dirClus, path, found) == FAT32_OK && found->isDir == wantDir;
+}
 
-		free(cluster[dirEntryNum]);
-		free(dir);
-	}
-	uint32_t FATContent = getFATEntryForClusterN(fd, curDirClus, h);
-	/* Check if FAT entry of this cluster contains EOC */
-	if(FATContent > END_OF_CLUSTER) {
-		/* EOC = TRUE */
+static int printDirEntry(const fat32Entry *entry, void *arg) {
+	if(entry->isDir) {
+		printf("<%s>\t\t%d\n", entry->name, entry->size);
 	}
 	else {
-		/* Recursively call doDir with the next cluster # */
-		//printf("FATContent: %X\n", FATContent);
-		doDir(fd, h, (int)FATContent);
+		printf("%s\t\t%d\n", entry->name, entry->size);
 	}
+	return 0;
 }
 
-uint32_t doCD(int fd, fat32Head *h, uint32_t curDirClus, char *buffer) {
+void doDir(fat32Vol* v, uint32_t curDirClus) {
+	fat32Readdir(v, curDirClus, printDirEntry, NULL);
+}
+
+uint32_t doCD(fat32Vol* v, uint32_t curDirClus, char *buffer) {
 	/* Initialize folderName from buffer */
 	char folderName[BUF_SIZE];
-	int i = 0;
-	while(buffer[i] != ' ') {
-		i++;
-	}
-	int j = 0;
-	i++; // Skip that space
-	while(buffer[i] != '\0') {
-		folderName[j] = buffer[i];
-		i++;
-		j++;
-	}
-	folderName[j] = '\0';
-	
-	uint32_t updatedCluster = curDirClus;
-	int FirstDataSector = h->bs->BPB_RsvdSecCnt + h->bs->BPB_NumFATs * h->bs->BPB_FATSz32; // 1922+15423*2=32768
-	int currentSector = findFirstDataSectorOfClusterN(h, curDirClus, FirstDataSector);
-
-	if(curDirClus != 2 && strcmp(folderName, "..") == 0) {
-		return 2;
-	}
-
-	// cluster[4096/32] = cluster[128] = 128 dir entries to go through in each cluster
-	int dirEntryNum = h->bs->BPB_BytesPerSec*h->bs->BPB_SecPerClus/sizeof(fat32Dir);
-	unsigned char *cluster[dirEntryNum];
-	int dirIndex = 0; //  0-127
-	// For each dir entry (32B) in the cluster (128 in total)
-	for(dirIndex = 0; dirIndex < dirEntryNum; dirIndex++) {
-		int seek = lseek(fd, currentSector*h->bs->BPB_BytesPerSec + dirIndex*32, SEEK_SET);
-		if(seek == -1) {
-        	perror("Seek failed.\n");
-    	}
-		cluster[dirEntryNum] = malloc(sizeof(fat32Dir));
-		if(cluster[dirEntryNum] == NULL) {
-			fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(fat32Dir));
-			abort();
-    	}
-		int readd = read(fd, cluster[dirEntryNum], sizeof(fat32Dir));
-		if(readd == -1) {
-        	perror("Read failed.\n");
-    	}
-		fat32Dir *dir = (fat32Dir*)(malloc(sizeof(fat32Dir)));
-		if(dir == NULL) {
-			fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(fat32Dir));
-			abort();
-    	}
-		memcpy(dir, cluster[dirEntryNum], sizeof(fat32Dir)); // Forgive me, I didn't use casting
-
-		if(dir->DIR_Attr == 0x10) {
-			char nameNoSpace[DIR_NAME_LENGTH+1];
-			int i;
-			int j = 0;
-
-			for (i = 0; i < strlen(dir->DIR_Name); i++) {
-				if (dir->DIR_Name[i] != ' ') {
-					nameNoSpace[j] = dir->DIR_Name[i];
-					j++;
-				}
-			}
-			nameNoSpace[j-1] = '\0';
-
-			/* folderName matches */
-			if(strcmp(nameNoSpace, folderName) == 0) {
-				updatedCluster = (dir->DIR_FstClusHI<<16) + dir->DIR_FstClusLO;
-				free(cluster[dirEntryNum]);
-				free(dir);
-				return updatedCluster;
-			}
-		}
+	parseArgument(buffer, folderName);
 
-		free(cluster[dirEntryNum]);
-		free(dir);
+	fat32Entry dir;
+	if(findEntry(v, curDirClus, folderName, true, &dir)) {
+		return dir.firstClus;
 	}
 	printf("Error: folder not found\n");
 	return curDirClus;
 }
 
-void doDownload(int fd, fat32Head* h, int curDirClus, char *buffer) {
-	int nextClus = 0;
-	int fileSize = 0;
-	bool found = false;
-	/* Initialize folderName from buffer */
+void doDownload(fat32Vol* v, uint32_t curDirClus, char *buffer) {
+	/* Initialize fileName from buffer */
 	char fileName[BUF_SIZE];
-	int i = 0;
-	while(buffer[i] != ' ') {
-		i++;
+	parseArgument(buffer, fileName);
+
+	fat32Entry file;
+	if(!findEntry(v, curDirClus, fileName, false, &file)) {
+		printf("Error: file not found\n");
+		return;
 	}
-	int j = 0;
-	i++; // Skip that space
-	while(buffer[i] != '\0') {
-		fileName[j] = buffer[i];
-		i++;
-		j++;
+	/* The local copy is named after the last component of the path */
+	const char *slash = strrchr(fileName, '/');
+	const char *hostName = slash != NULL ? slash + 1 : fileName;
+	bool checksum = fat32ChecksumsEnabled(v);
+	uint32_t crc;
+	int result = fat32ExtractChecksum(v, &file, hostName, checksum ? &crc : NULL);
+	if(result == FAT32_OK && checksum) {
+		printf("Done. CRC32C %08" PRIx32 "\n", crc);
 	}
-	fileName[j] = '\0';
-
-	int FirstDataSector = h->bs->BPB_RsvdSecCnt + h->bs->BPB_NumFATs *h->bs->BPB_FATSz32; // 1922+15423*2=32768
-	int currentSector = findFirstDataSectorOfClusterN(h, curDirClus, FirstDataSector);
-
-	// cluster[4096/32] = cluster[128] = 128 dir entries to go through in each cluster
-	int dirEntryNum = h->bs->BPB_BytesPerSec*h->bs->BPB_SecPerClus/sizeof(fat32Dir);
-	unsigned char *cluster[dirEntryNum];
-	int dirIndex = 0; //  0-127
-	// For each dir entry (32B) in the cluster (128 in total)
-	for(dirIndex = 0; dirIndex < dirEntryNum; dirIndex++) {
-		int seek = lseek(fd, currentSector*h->bs->BPB_BytesPerSec + dirIndex*32, SEEK_SET);
-		if(seek == -1) {
-        	perror("Seek failed.\n");
-    	}
-		cluster[dirEntryNum] = malloc(sizeof(fat32Dir));
-		if(cluster[dirEntryNum] == NULL) {
-			fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(fat32Dir));
-			abort();
-    	}
-		int readd = read(fd, cluster[dirEntryNum], sizeof(fat32Dir));
-		if(readd == -1) {
-        	perror("Read failed.\n");
-    	}
-		fat32Dir *dir = (fat32Dir*)(malloc(sizeof(fat32Dir)));
-		if(dir == NULL) {
-			fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(fat32Dir));
-			abort();
-    	}
-		memcpy(dir, cluster[dirEntryNum], sizeof(fat32Dir)); // Forgive me, I didn't use casting
-
-		/* If the entry represents a file */
-		/* If we got an archieve, append dot to its name */
-		if(dir->DIR_Attr == ATTR_ARCHIEVE) {
-			int nameIndex = 0;
-			while(dir->DIR_Name[nameIndex] != ' ') {
-				nameIndex++;
-			}
-			dir->DIR_Name[nameIndex] = '.';
+	else if(result == FAT32_OK) {
+		printf("Done.\n");
+	}
+	else if(result == FAT32_ERR_CREATE) {
+		printf("Failed to create file '%s'\n", hostName);
+	}
+	else {
+		printf("There's some error reading the file '%s'\n", hostName);
+	}
+}
 
-			char nameNoSpace[DIR_NAME_LENGTH+1];
-			int i;
-			int j = 0;
+/* Report one file MGET copied, counting the failures in arg */
+static void reportExtracted(const fat32Entry *file, int result, void *arg) {
+	int *failed = arg;
+	if(result == FAT32_ERR_CREATE) {
+		printf("Failed to create file '%s'\n", file->name);
+		(*failed)++;
+	}
+	else if(result != FAT32_OK) {
+		printf("There's some error reading the file '%s'\n", file->name);
+		(*failed)++;
+	}
+}
 
-			for (i = 0; i < strlen(dir->DIR_Name); i++) {
-				if (dir->DIR_Name[i] != ' ') {
-					nameNoSpace[j] = dir->DIR_Name[i];
-					j++;
-				}
-			}
-			nameNoSpace[j] = '\0';
-			if(strcmp(nameNoSpace, fileName) == 0) {
-				nextClus = (dir->DIR_FstClusHI<<16) + dir->DIR_FstClusLO;
-				fileSize = dir->DIR_FileSize; // Store the fileSize here for later use (read & write!)
-				found = true;
-				break;
+/* MGET <pattern> [pattern...]: copy every matching file of the current
+	directory, several at once on a pool of workers */
+void doMultiDownload(fat32Vol* v, uint32_t curDirClus, char *buffer) {
+	char patterns[BUF_SIZE];
+	parseArgument(buffer, patterns);
+
+	/* Reported in directory order once everything has finished */
+	int failed = 0;
+	int matched = fat32MultiExtract(v, curDirClus, patterns, reportExtracted, &failed);
+	if(matched == 0) {
+		printf("Error: file not found\n");
+		return;
+	}
+	printf("%d of %d files copied.\n", matched - failed, matched);
+	printf("Done.\n");
+}
+
+/* Shared by every task of one EXPORT */
+struct exportContext {
+	fat32Vol *v;
+	threadPool *pool;
+	pthread_mutex_t lock; // Guards the counters and error output
+	int files;
+	int folders;
+	int errors;
+};
+
+/* One directory or file still to be exported */
+struct exportJob {
+	struct exportContext *ctx;
+	fat32Entry entry;
+	uint32_t clus; // First cluster of a directory job
+	char hostPath[PATH_MAX];
+};
+
+static void exportFail(struct exportContext *ctx, const char *what, const char *path) {
+	pthread_mutex_lock(&ctx->lock);
+	printf("Failed to %s '%s'\n", what, path);
+	ctx->errors++;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static void exportFileTask(void *arg) {
+	struct exportJob *job = arg;
+	struct exportContext *ctx = job->ctx;
+	int result = fat32Extract(ctx->v, &job->entry, job->hostPath);
+	if(result == FAT32_OK) {
+		pthread_mutex_lock(&ctx->lock);
+		ctx->files++;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+	else {
+		exportFail(ctx, result == FAT32_ERR_CREATE ? "create file" : "read file", job->hostPath);
+	}
+	free(job);
+}
+
+static void exportDirTask(void *arg);
+
+/* Queue one entry of the directory job arg is exporting */
+static int exportEntry(const fat32Entry *entry, void *arg) {
+	struct exportJob *job = arg;
+	struct exportContext *ctx = job->ctx;
+	if(strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+		return 0;
+	}
+	/* A subdirectory pointing back at the root or itself would loop forever */
+	if(entry->isDir && (entry->firstClus == fat32RootCluster(ctx->v) || entry->firstClus == job->clus)) {
+		return 0;
+	}
+	struct exportJob *child = malloc(sizeof(struct exportJob));
+	if(child == NULL) {
+		fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(struct exportJob));
+		abort();
+	}
+	child->ctx = ctx;
+	memcpy(&child->entry, entry, sizeof(fat32Entry));
+	child->clus = entry->firstClus;
+	if(snprintf(child->hostPath, PATH_MAX, "%s/%s", job->hostPath, entry->name) >= PATH_MAX) {
+		exportFail(ctx, "create", child->hostPath);
+		free(child);
+		return 0;
+	}
+	poolSubmit(ctx->pool, entry->isDir ? exportDirTask : exportFileTask, child);
+	return 0;
+}
+
+/* Recreate one directory on the host and queue everything inside it.
+	Sub-tasks go to this worker's own deque; idle workers steal them. */
+static void exportDirTask(void *arg) {
+	struct exportJob *job = arg;
+	struct exportContext *ctx = job->ctx;
+	if(mkdir(job->hostPath, 0777) == -1 && errno != EEXIST) {
+		exportFail(ctx, "create folder", job->hostPath);
+		free(job);
+		return;
+	}
+	pthread_mutex_lock(&ctx->lock);
+	ctx->folders++;
+	pthread_mutex_unlock(&ctx->lock);
+
+	fat32Readdir(ctx->v, job->clus, exportEntry, job);
+	free(job);
+}
+
+/* EXPORT <dir> <hostpath>: copy the folder at path dir, and everything
+	under it, to hostpath on the local machine. "." exports the current
+	directory itself. */
+void doExport(fat32Vol* v, uint32_t curDirClus, char *buffer, char *bufferRaw) {
+	char args[BUF_SIZE];
+	char argsRaw[BUF_SIZE];
+	parseArgument(buffer, args);
+	parseArgument(bufferRaw, argsRaw);
+
+	/* The folder name is matched upper case, the host path keeps its case */
+	char *space = strchr(args, ' ');
+	if(space == NULL) {
+		printf("Usage: EXPORT <dir> <hostpath>\n");
+		return;
+	}
+	*space = '\0';
+	char *hostPath = argsRaw + (space - args) + 1;
+
+	fat32Entry dir;
+	if(!findEntry(v, curDirClus, args, true, &dir)) {
+		printf("Error: folder not found\n");
+		return;
+	}
+	uint32_t clus = dir.firstClus;
+
+	struct exportContext ctx;
+	ctx.v = v;
+	ctx.files = 0;
+	ctx.folders = 0;
+	ctx.errors = 0;
+	pthread_mutex_init(&ctx.lock, NULL);
+	ctx.pool = createPool(defaultPoolSize());
+
+	struct exportJob *root = malloc(sizeof(struct exportJob));
+	if(root == NULL) {
+		fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(struct exportJob));
+		abort();
+	}
+	root->ctx = &ctx;
+	root->clus = clus;
+	snprintf(root->hostPath, PATH_MAX, "%s", hostPath);
+	poolSubmit(ctx.pool, exportDirTask, root);
+	destroyPool(ctx.pool);
+	pthread_mutex_destroy(&ctx.lock);
+
+	printf("%d folders, %d files exported, %d errors.\n", ctx.folders, ctx.files, ctx.errors);
+	printf("Done.\n");
+}
+
+void printCacheStats(fat32Vol* v) {
+	uint64_t hits, misses;
+	int used, capacity;
+	if(!fat32CacheCounters(v, &hits, &misses, &used, &capacity)) {
+		printf("Cache: off\n");
+	}
+	else {
+		printf("Cache: %d of %d clusters used\n", used, capacity);
+		printf("Hits: %" PRIu64 "\n", hits);
+		printf("Misses: %" PRIu64 "\n", misses);
+	}
+	fat32DentryCounters(v, &hits, &misses, &used, &capacity);
+	printf("Name cache: %d of %d entries used\n", used, capacity);
+	printf("Hits: %" PRIu64 "\n", hits);
+	printf("Misses: %" PRIu64 "\n", misses);
+}
+
+/* PUT <hostfile>: copy a local file into the current directory,
+	named after the last component of its path */
+void doUpload(fat32Vol* v, uint32_t curDirClus, char *bufferRaw) {
+	char hostPath[BUF_SIZE];
+	parseArgument(bufferRaw, hostPath);
+	if(hostPath[0] == '\0') {
+		printf("Usage: PUT <file>\n");
+		return;
+	}
+	const char *name = strrchr(hostPath, '/');
+	name = name != NULL ? name + 1 : hostPath;
+
+	int result = fat32Put(v, curDirClus, hostPath, name);
+	switch(result) {
+	case FAT32_OK:
+		printf("Done.\n");
+		break;
+	case FAT32_ERR_READONLY:
+		printf("Error: image is read-only, restart with -w\n");
+		break;
+	case FAT32_ERR_BAD_NAME:
+		printf("Error: '%s' is not a valid 8.3 name\n", name);
+		break;
+	case FAT32_ERR_EXISTS:
+		printf("Error: file already exists\n");
+		break;
+	case FAT32_ERR_NO_SPACE:
+		printf("Error: not enough free space\n");
+		break;
+	case FAT32_ERR_HOST:
+		printf("Error: can't read '%s'\n", hostPath);
+		break;
+	case FAT32_ERR_TOO_BIG:
+		printf("Error: '%s' is larger than FAT32's 4 GiB file size limit\n", hostPath);
+		break;
+	default:
+		printf("There's some error writing the file '%s'\n", name);
+		break;
+	}
+}
+
+/* STATS: I/O counters since the volume was opened, then the latency
+	of every command so far with its log2 histogram */
+void printStats(fat32Vol* v) {
+	fat32Counters c;
+	if(!fat32GetCounters(v, &c)) {
+		printf("Stats: off (start with -s)\n");
+		return;
+	}
+	printf("---- I/O ----\n");
+	printf("Image reads: %" PRIu64 " pread, %" PRIu64 " from the map\n", c.preads, c.mapReads);
+	printf("Bytes read: %" PRIu64 "\n", c.bytesRead);
+	printf("Kernel copies: %" PRIu64 " (%" PRIu64 " bytes)\n", c.kernelCopies, c.bytesCopied);
+	printf("Host writes: %" PRIu64 "\n", c.hostWrites);
+	printf("Image writes: %" PRIu64 " (%" PRIu64 " bytes)\n", c.imageWrites, c.bytesWritten);
+	printf("FAT lookups: %" PRIu64 "\n", c.fatLookups);
+	uint64_t hits, misses;
+	int used, capacity;
+	if(fat32CacheCounters(v, &hits, &misses, &used, &capacity)) {
+		printf("Cache: %" PRIu64 " hits, %" PRIu64 " misses\n", hits, misses);
+	}
+	printf("Allocations: %" PRIu64 " (%" PRIu64 " clusters)\n", c.allocations, c.clustersAllocated);
+	printf("FAT flush writes: %" PRIu64 "\n", c.fatFlushWrites);
+	printf("Prefetch hints: %" PRIu64 "\n", c.prefetches);
+
+	fat32CommandStats commands[STATS_MAX_COMMANDS];
+	int count = fat32GetCommandStats(v, commands, STATS_MAX_COMMANDS);
+	printf("\n---- Commands ----\n");
+	printf("%-8s %8s %10s %10s %10s %10s\n", "Command", "Count", "Mean us", "p50 <us", "p99 <us", "Max us");
+	for(int i = 0; i < count; i++) {
+		fat32CommandStats *cmd = &commands[i];
+		printf("%-8s %8" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n", cmd->name, cmd->count,
+			cmd->totalNs/cmd->count/1000, fat32CommandPercentile(cmd, 0.5), fat32CommandPercentile(cmd, 0.99), cmd->maxNs/1000);
+		printf("        ");
+		for(int b = 0; b < STATS_BUCKETS; b++) {
+			if(cmd->buckets[b] != 0) {
+				printf(" <%lluus:%" PRIu64, 1ULL << b, cmd->buckets[b]);
 			}
 		}
-		free(cluster[dirEntryNum]);
-		free(dir);
-	}
-
-	/* If the file name searched is found, then find all its clusters by reading the FAT entries */
-	if(found) {
-		/* Read each cluster until EOC */
-		uint32_t totalBytes = 0; //DIR_FileSize
-		uint32_t sector = findFirstDataSectorOfClusterN(h, nextClus, FirstDataSector);
-		while(getFATEntryForClusterN(fd, nextClus, h) != END_OF_CLUSTER_CHAIN) {
-			totalBytes += h->bs->BPB_BytesPerSec*h->bs->BPB_SecPerClus;
-			nextClus = getFATEntryForClusterN(fd, nextClus, h);
+		printf("\n");
+	}
+}
+
+/* FREE: free space from a scan of the FAT, next to what FSInfo claims */
+void printFree(fat32Vol* v) {
+	const fat32BS *bs = fat32BootSector(v);
+	uint64_t clusterSize = (uint64_t)bs->BPB_BytesPerSec*bs->BPB_SecPerClus;
+	uint32_t freeClusters = fat32FreeClusters(v);
+	uint32_t hint = fat32FSInfo(v)->FSI_Free_Count;
+	printf("Free Clusters: %u of %u\n", freeClusters, fat32TotalClusters(v));
+	printf("Bytes Free: %" PRIu64 "\n", freeClusters*clusterSize);
+	if(hint == 0xFFFFFFFF) {
+		printf("FSInfo Free Count: unknown\n");
+	}
+	else if(hint != freeClusters) {
+		printf("FSInfo Free Count: %u (stale)\n", hint);
+	}
+	else {
+		printf("FSInfo Free Count: %u\n", hint);
+	}
+}
+
+/* Print a problem as FSCK finds it, up to FSCK_PRINT_MAX of them */
+static void printFsckProblem(int problem, const char *path, uint32_t clus, void *arg) {
+	int *printed = arg;
+	if(*printed == FSCK_PRINT_MAX) {
+		return;
+	}
+	if(path != NULL) {
+		printf("%s: %s (cluster %u)\n", path, fat32FsckProblemName(problem), clus);
+	}
+	else {
+		printf("FAT: %s (cluster %u)\n", fat32FsckProblemName(problem), clus);
+	}
+	(*printed)++;
+}
+
+/* FSCK: check the whole volume, then sum up */
+void doFsck(fat32Vol* v) {
+	fat32FsckReport report;
+	int printed = 0;
+	fat32Fsck(v, &report, printFsckProblem, &printed);
+	uint32_t total = 0;
+	for(int i = 0; i < FSCK_PROBLEM_KINDS; i++) {
+		total += report.problems[i];
+	}
+	if(total > (uint32_t)printed) {
+		printf("... %u more\n", total - printed);
+	}
+	printf("Checked %u directories, %u files, %" PRIu64 " clusters in use.\n", report.dirs, report.files, report.clustersInUse);
+	if(total == 0) {
+		printf("Volume is clean.\n");
+		return;
+	}
+	for(int i = 0; i < FSCK_PROBLEM_KINDS; i++) {
+		if(report.problems[i] != 0) {
+			printf("%s: %u\n", fat32FsckProblemName(i), report.problems[i]);
 		}
-		/* This operation adds the last cluster size to the totalBytes */
-		totalBytes += h->bs->BPB_BytesPerSec*h->bs->BPB_SecPerClus;
-		char* buffer = malloc(totalBytes);
-		if(buffer == NULL) {
-			fprintf(stderr, "Fatal: failed to allocate %d bytes.\n", totalBytes);
-			abort();
-    	}
-		/* Seek to the first sector of the first cluster the file begins with */
-		int seek = lseek(fd, sector*h->bs->BPB_BytesPerSec, SEEK_SET);
-		if(seek == -1) {
-        	perror("Seek failed.\n");
-    	}
-		if(totalBytes >= fileSize) {
-			/* Bonus 2: Just 1 read! */
-			int readd = read(fd, buffer, fileSize);
-			if(readd == -1) {
-        		perror("Read failed.\n");
-    		}
-			int new_file = open(fileName, O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0777);
-			if(new_file < 0) {
-				printf("Failed to create file '%s'\n", fileName);
-			}
-			write(new_file, buffer, fileSize);
-			printf("Done.\n");
+	}
+	if(report.lostClusters != 0) {
+		printf("Lost clusters: %" PRIu64 "\n", report.lostClusters);
+	}
+	if(report.mirrorEntries != 0) {
+		printf("FAT entries differing between copies: %" PRIu64 "\n", report.mirrorEntries);
+	}
+	printf("%u problems found.\n", total);
+}
+
+/* Print a file as DEFRAG moves it, up to DEFRAG_PRINT_MAX of them */
+static void printMoved(const char *path, uint32_t before, uint32_t after, void *arg) {
+	int *printed = arg;
+	if(*printed == DEFRAG_PRINT_MAX) {
+		return;
+	}
+	printf("%s: %u extents -> %u\n", path, before, after);
+	(*printed)++;
+}
+
+/* DEFRAG: make fragmented files contiguous, then sum up */
+void doDefrag(fat32Vol* v) {
+	fat32DefragReport report;
+	int printed = 0;
+	int result = fat32Defrag(v, &report, printMoved, &printed);
+	if(result == FAT32_ERR_READONLY || result == FAT32_ERR_DAMAGED) {
+		printf("Error: %s\n", fat32Strerror(result));
+		return;
+	}
+	if(report.moved > (uint32_t)printed) {
+		printf("... %u more\n", report.moved - printed);
+	}
+	printf("%u of %u files were fragmented, %u moved (%" PRIu64 " clusters).\n", report.fragmented, report.files,
+		report.moved, report.clustersMoved);
+	printf("Extents: %" PRIu64 " before, %" PRIu64 " after.\n", report.extentsBefore, report.extentsAfter);
+	if(report.noRoom != 0) {
+		printf("Left alone, no free run long enough: %u\n", report.noRoom);
+	}
+	if(report.damaged != 0) {
+		printf("Left alone, chain doesn't match the size: %u\n", report.damaged);
+	}
+	if(result != FAT32_OK) {
+		printf("Error: %s (%u files not moved)\n", fat32Strerror(result), report.failed);
+	}
+}
+
+/* CAT <file> [offset [length]]: write length bytes of the file from
+	offset (the rest of it when left out) to the terminal */
+void doCat(fat32Vol* v, uint32_t curDirClus, char *buffer) {
+	char args[BUF_SIZE];
+	char fileName[BUF_SIZE];
+	uint64_t offset = 0;
+	uint64_t length = UINT64_MAX;
+	parseArgument(buffer, args);
+	if(sscanf(args, "%255s %" SCNu64 " %" SCNu64, fileName, &offset, &length) < 1) {
+		printf("Usage: CAT <file> [offset [length]]\n");
+		return;
+	}
+	fat32Entry file;
+	if(!findEntry(v, curDirClus, fileName, false, &file)) {
+		printf("Error: file not found\n");
+		return;
+	}
+	char *data = malloc(CAT_CHUNK);
+	if(data == NULL) {
+		fprintf(stderr, "Fatal: failed to allocate %d bytes.\n", CAT_CHUNK);
+		abort();
+	}
+	/* fat32Read stops at the end of the file */
+	while(length > 0) {
+		ssize_t readd = fat32Read(v, &file, data, length < CAT_CHUNK ? length : CAT_CHUNK, offset);
+		if(readd < 0) {
+			printf("\nError: %s\n", fat32Strerror(readd));
+			break;
 		}
-		else {
-			printf("There's some error reading the file '%s'\n", fileName);
+		if(readd == 0) {
+			break;
 		}
-		free(buffer);
+		fwrite(data, 1, readd, stdout);
+		offset += readd;
+		length -= readd;
+	}
+	printf("\n");
+	free(data);
+}
+
+/* Matches are printed as the workers find them */
+struct findOutput {
+	pthread_mutex_t lock;
+	int matches;
+};
+
+static void printFound(const char *path, const fat32Entry *entry, void *arg) {
+	struct findOutput *out = arg;
+	pthread_mutex_lock(&out->lock);
+	if(entry->isDir) {
+		printf("<%s>\t\t%u\t%u\n", path, entry->size, entry->firstClus);
 	}
 	else {
-		printf("Error: file not found\n");
+		printf("%s\t\t%u\t%u\n", path, entry->size, entry->firstClus);
 	}
+	out->matches++;
+	pthread_mutex_unlock(&out->lock);
 }
 
-void shellLoop(int fd) 
-{
-	int running = true;
-	uint32_t curDirClus;
+/* FIND <pattern>: search the whole volume, printing path, size and
+	first cluster of every match */
+void doFind(fat32Vol* v, char *buffer) {
+	char pattern[BUF_SIZE];
+	parseArgument(buffer, pattern);
+	if(pattern[0] == '\0') {
+		printf("Usage: FIND <pattern>\n");
+		return;
+	}
+	struct findOutput out;
+	pthread_mutex_init(&out.lock, NULL);
+	out.matches = 0;
+	int folders = fat32Find(v, pattern, printFound, &out);
+	pthread_mutex_destroy(&out.lock);
+	printf("%d matches in %d folders.\n", out.matches, folders);
+}
 
-	// Step 1: Initialize fat32Head
-	fat32Head *h = createHead(fd);
+static void printDuLine(const char *path, const fat32DuTotals *totals, void *arg) {
+	printf("%12" PRIu64 "\t%10" PRIu64 "\t%s\n", totals->size, totals->clusters, path);
+}
 
-	if (h == NULL) {
-		running = false;
-	}
-	else {// valid, grab the root cluster
-		;//TODO
-		// Grab the root cluster
-		curDirClus = h->bs->BPB_RootClus; // 2
-	}
-	
-	char buffer[BUF_SIZE];
-	char bufferRaw[BUF_SIZE];
-	int CountofClusters; // Clusters in total
-	int FirstDataSector = h->bs->BPB_RsvdSecCnt + h->bs->BPB_NumFATs * h->bs->BPB_FATSz32; // 1922+15423*2=32768
-
-	/* Step 2: Check if the total count of clusters (start from Cluster 2) 
-		falls in the range of FAT32 */
-	CountofClusters = checkIfFAT32(h);
-	if(CountofClusters < FAT12_TOTAL_CLUSTERS) {
-		/* Volume is FAT12 */
-		printf("Volume is FAT12\n");
-		running = false;
-	}
-	else if (CountofClusters < FAT16_TOTAL_CLUSTERS) {
-		/* Volume is FAT16 */
-		printf("Volume is FAT16\n");
-		running = false;
+/* DU [dir]: the logical size and allocated clusters of every folder
+	from dir (or the current one) down, each including its subfolders */
+void doDu(fat32Vol* v, uint32_t curDirClus, char *buffer) {
+	char folderName[BUF_SIZE];
+	parseArgument(buffer, folderName);
+	uint32_t clus = curDirClus;
+	if(folderName[0] != '\0') {
+		fat32Entry dir;
+		if(!findEntry(v, curDirClus, folderName, true, &dir)) {
+			printf("Error: folder not found\n");
+			return;
+		}
+		clus = dir.firstClus;
 	}
 	else {
-		/* Volume is FAT32 */
+		strcpy(folderName, ".");
 	}
+	const fat32BS *bs = fat32BootSector(v);
+	fat32DuTotals total;
+	printf("%12s\t%10s\t%s\n", "Bytes", "Clusters", "Folder");
+	fat32Du(v, clus, folderName, &total, printDuLine, NULL);
+	printf("%u files in %u folders, %" PRIu64 " bytes using %" PRIu64 " bytes on disk.\n", total.files, total.dirs + 1,
+		total.size, total.clusters*bs->BPB_BytesPerSec*bs->BPB_SecPerClus);
+}
 
-	/* Step 3: Check FAT signature */
-	if(!checkFATSig(fd, h)) {
-		printf("The FAT has incorrect signatures. Exiting now...\n");
-		running = false;
+/* VERIFY <file> <hostpath>: check a local copy against the image
+	without reading either twice */
+void doVerify(fat32Vol* v, uint32_t curDirClus, char *buffer, char *bufferRaw) {
+	char args[BUF_SIZE];
+	char argsRaw[BUF_SIZE];
+	parseArgument(buffer, args);
+	parseArgument(bufferRaw, argsRaw);
+
+	char *space = strchr(args, ' ');
+	if(space == NULL) {
+		printf("Usage: VERIFY <file> <hostpath>\n");
+		return;
 	}
+	*space = '\0';
+	char *hostPath = argsRaw + (space - args) + 1;
 
-	/* Step 4: Load FSI and check its signature entries */
-	loadFSI(fd, h);
-	if(h->fsi->FSI_LeadSig == FSInfo_LeadSig && h->fsi->FSI_StrucSig == FSInfo_StrucSig && h->fsi->FSI_TrailSig == FSInfo_TrailSig) {
-		/* Check if all FSInfo's signatures are correct. */
+	fat32Entry file;
+	if(!findEntry(v, curDirClus, args, false, &file)) {
+		printf("Error: file not found\n");
+		return;
+	}
+	uint64_t differsAt;
+	int result = fat32Verify(v, &file, hostPath, &differsAt);
+	if(result == FAT32_OK) {
+		printf("Same: %u bytes match.\n", file.size);
+	}
+	else if(result == FAT32_ERR_DIFFERENT) {
+		printf("Different: first differs at byte %" PRIu64 ".\n", differsAt);
 	}
 	else {
-		printf("AT least one FSInfo signature is incorrect! Exiting...\n");
-		running = false;
+		printf("Error: %s\n", fat32Strerror(result));
 	}
+}
+
+void shellLoop(int fd, const fat32Options *options) 
+{
+	int running = true;
+	uint32_t curDirClus;
+	int error;
 
-	/* Load the Root Dir struct located in Cluster 2, Sector 0. */
-	loadRootDir(fd, h, FirstDataSector);
+	// Step 1: Mount the volume, this checks the BPB, FAT and FSInfo
+	fat32Vol *v = fat32Open(fd, options, &error);
+
+	if (v == NULL) {
+		if(error == FAT32_ERR_FAT12) {
+			printf("Volume is FAT12\n");
+		}
+		else if(error == FAT32_ERR_FAT16) {
+			printf("Volume is FAT16\n");
+		}
+		else if(error == FAT32_ERR_FAT_SIG) {
+			printf("The FAT has incorrect signatures. Exiting now...\n");
+		}
+		else if(error == FAT32_ERR_FSI_SIG) {
+			printf("AT least one FSInfo signature is incorrect! Exiting...\n");
+		}
+		return;
+	}
+	// Grab the root cluster
+	curDirClus = fat32RootCluster(v); // 2
+	
+	char buffer[BUF_SIZE];
+	char bufferRaw[BUF_SIZE];
 
 	while(running) 
 	{
@@ -453,15 +757,17 @@ void shellLoop(int fd)
 		for (int i=0; i < strlen(bufferRaw)+1; i++) {
 			buffer[i] = toupper(bufferRaw[i]);
 		}
+		uint64_t started = fat32CommandBegin(v);
 		if (strncmp(buffer, CMD_INFO, strlen(CMD_INFO)) == 0) {
-			printInfo(h);
+			printInfo(v);
 		}
 		else if (strncmp(buffer, CMD_DIR, strlen(CMD_DIR)) == 0) {
 			// Starting sector after FAT
 			printf("\nDIRECTORY LISTING\n");
-			printf("VOL_ID: %s\n\n", h->dir->DIR_Name);
-			doDir(fd, h, curDirClus);
-			uint64_t bytesFree = (uint64_t)h->fsi->FSI_Free_Count*(uint64_t)h->bs->BPB_BytesPerSec*(uint64_t)h->bs->BPB_SecPerClus;
+			printf("VOL_ID: %s\n\n", fat32VolumeEntry(v)->DIR_Name);
+			doDir(v, curDirClus);
+			const fat32BS *bs = fat32BootSector(v);
+			uint64_t bytesFree = (uint64_t)fat32FreeClusters(v)*(uint64_t)bs->BPB_BytesPerSec*(uint64_t)bs->BPB_SecPerClus;
 			printf("---Bytes Free: %lu\n", bytesFree);
 			printf("---DONE\n");
 		}
@@ -473,7 +779,7 @@ void shellLoop(int fd)
 				printf("Error: folder not found\n");
 			}
 			else {
-				curDirClus = doCD(fd, h, curDirClus, buffer);
+				curDirClus = doCD(v, curDirClus, buffer);
 			}
 		}
 		else if (strncmp(buffer, CMD_GET, strlen(CMD_GET)) == 0) {
@@ -485,23 +791,84 @@ void shellLoop(int fd)
 				printf("Error: file not found\n");
 			}
 			else {
-				doDownload(fd, h, curDirClus, buffer);
+				doDownload(v, curDirClus, buffer);
+			}
+		}
+		else if (strncmp(buffer, CMD_MGET, strlen(CMD_MGET)) == 0) {
+			printf("\n");
+			if(strcmp(buffer, "MGET") == 0 || strcmp(buffer, "MGET ") == 0) {
+				printf("Error: file not found\n");
+			}
+			else {
+				doMultiDownload(v, curDirClus, buffer);
 			}
 		}
+		else if (strncmp(buffer, CMD_EXPORT, strlen(CMD_EXPORT)) == 0) {
+			printf("\n");
+			doExport(v, curDirClus, buffer, bufferRaw);
+		}
+		else if (strncmp(buffer, CMD_CACHE, strlen(CMD_CACHE)) == 0) {
+			printCacheStats(v);
+		}
+		else if (strncmp(buffer, CMD_FREE, strlen(CMD_FREE)) == 0) {
+			printFree(v);
+		}
 		else if (strncmp(buffer, CMD_PUT, strlen(CMD_PUT)) == 0) {
-			//doUpload(h, curDirClus, buffer, bufferRaw);
-			printf("Bonus marks!\n");
+			printf("\n");
+			doUpload(v, curDirClus, bufferRaw);
+		}
+		else if (strncmp(buffer, CMD_SYNC, strlen(CMD_SYNC)) == 0) {
+			if(fat32Sync(v) == FAT32_OK) {
+				printf("Synced.\n");
+			}
+			else {
+				printf("Error: sync failed\n");
+			}
+		}
+		else if (strncmp(buffer, CMD_STATS, strlen(CMD_STATS)) == 0) {
+			printStats(v);
+		}
+		else if (strncmp(buffer, CMD_VERIFY, strlen(CMD_VERIFY)) == 0) {
+			printf("\n");
+			doVerify(v, curDirClus, buffer, bufferRaw);
+		}
+		else if (strncmp(buffer, CMD_DU, strlen(CMD_DU)) == 0) {
+			printf("\n");
+			doDu(v, curDirClus, buffer);
+		}
+		else if (strncmp(buffer, CMD_FIND, strlen(CMD_FIND)) == 0) {
+			printf("\n");
+			doFind(v, buffer);
+		}
+		else if (strncmp(buffer, CMD_CAT, strlen(CMD_CAT)) == 0) {
+			printf("\n");
+			doCat(v, curDirClus, buffer);
+		}
+		else if (strncmp(buffer, CMD_DEFRAG, strlen(CMD_DEFRAG)) == 0) {
+			printf("\n");
+			doDefrag(v);
+		}
+		else if (strncmp(buffer, CMD_FSCK, strlen(CMD_FSCK)) == 0) {
+			printf("\n");
+			doFsck(v);
 		}
 		else {
 			printf("\nCommand not found\n");
 		}
+
+		/* Time the command under its first word */
+		if(started != 0 && buffer[0] != '\0') {
+			char name[STATS_NAME_LENGTH];
+			int n = 0;
+			while(buffer[n] != ' ' && buffer[n] != '\0' && n < STATS_NAME_LENGTH - 1) {
+				name[n] = buffer[n];
+				n++;
+			}
+			name[n] = '\0';
+			fat32CommandEnd(v, name, started);
+		}
 	}
 	printf("\nExited...\n");
 	
-	cleanupHead(h);
-}
-
-void cleanupHead(fat32Head *h) {
-	free(h->bs);
-	free(h);
+	fat32Close(v);
 }
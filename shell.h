@@ -1,9 +1,8 @@
 #ifndef SHELL_H
 #define SHELL_H
 
-#define FAT12_TOTAL_CLUSTERS 4085
-#define FAT16_TOTAL_CLUSTERS 65525
+#include "fat32types.h"
 
-void shellLoop(int fd);
+void shellLoop(int fd, const fat32Options *options);
 
 #endif
@@ -0,0 +1,361 @@
+/* sidecar.c saves what it takes a walk of the whole volume to learn
+* (every directory's entries, every file's extents, the free cluster
+* bitmap) into one file, and maps that file back in on later runs.
+* The file is a header followed by flat, sorted tables, so using it
+* is a binary search in the map with nothing to parse or allocate.
+* An index is only trusted for the image it was built from: BS_VolID,
+* the geometry and a hash of the whole FAT must all match. Any chain
+* change alters the FAT, so the hash catches nearly every edit made by
+* other tools. Writes made here mark the index stale right away and
+* the volume rewrites it on close.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include "sidecar.h"
+#include "freemap.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FAT_ENTRY_MASK 0x0FFFFFFF
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+/* An array that grows as it's appended to */
+struct growArray {
+    unsigned char *data;
+    size_t count;
+    size_t capacity;
+    size_t size; // Bytes per element
+};
+
+static void *growPush(struct growArray *a) {
+    if(a->count == a->capacity) {
+        a->capacity = a->capacity == 0 ? 64 : a->capacity*2;
+        a->data = realloc(a->data, a->capacity*a->size);
+        if(a->data == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", a->capacity*a->size);
+            abort();
+        }
+    }
+    return a->data + a->size*a->count++;
+}
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Hash of the whole FAT, two entries at a time */
+uint64_t sidecarFATHash(const uint32_t *fat, uint32_t entries) {
+    uint64_t hash = HASH_PRIME2 ^ entries;
+    uint32_t i = 0;
+    for(; i + 1 < entries; i += 2) {
+        uint64_t pair = (uint64_t)fat[i] | (uint64_t)fat[i + 1] << 32;
+        hash = rotl(hash ^ pair*HASH_PRIME1, 31)*HASH_PRIME2;
+    }
+    if(i < entries) {
+        hash = rotl(hash ^ fat[i]*HASH_PRIME1, 31)*HASH_PRIME2;
+    }
+    return hash ^ (hash >> 29);
+}
+
+/* Words of the free bitmap for this volume, as buildFreeMap sizes it */
+static uint32_t freeMapWords(fat32Head* h) {
+    uint64_t limit = (uint64_t)h->clusterCount + 2;
+    if(limit > h->fatEntries) {
+        limit = h->fatEntries;
+    }
+    return (limit + 63)/64;
+}
+
+static int compareDirs(const void *a, const void *b) {
+    uint32_t x = ((const struct sidecarDirRec*)a)->clus;
+    uint32_t y = ((const struct sidecarDirRec*)b)->clus;
+    return x < y ? -1 : x > y;
+}
+
+static int compareFiles(const void *a, const void *b) {
+    uint32_t x = ((const struct sidecarFileRec*)a)->firstClus;
+    uint32_t y = ((const struct sidecarFileRec*)b)->firstClus;
+    return x < y ? -1 : x > y;
+}
+
+static bool testAndSet(uint64_t *seen, uint32_t N) {
+    bool was = (seen[N/64] >> (N % 64)) & 1;
+    seen[N/64] |= 1ULL << (N % 64);
+    return was;
+}
+
+static bool writeTable(FILE *out, const void *data, size_t bytes) {
+    return bytes == 0 || fwrite(data, 1, bytes, out) == bytes;
+}
+
+/* Walk the whole tree from the root and write the index to path,
+    through a temporary file renamed into place. Returns false when it
+    can't be written. */
+bool writeSidecar(int fd, fat32Head* h, const char *path) {
+    struct growArray dirs = { NULL, 0, 0, sizeof(struct sidecarDirRec) };
+    struct growArray entries = { NULL, 0, 0, sizeof(fat32Dir) };
+    struct growArray files = { NULL, 0, 0, sizeof(struct sidecarFileRec) };
+    struct growArray extents = { NULL, 0, 0, sizeof(fat32Extent) };
+    struct growArray queue = { NULL, 0, 0, sizeof(uint32_t) };
+    uint64_t *seen = calloc(h->fatEntries/64 + 1, sizeof(uint64_t));
+    if(seen == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", (h->fatEntries/64 + 1)*sizeof(uint64_t));
+        abort();
+    }
+
+    /* Breadth first, each directory once even if the tree has loops */
+    *(uint32_t*)growPush(&queue) = h->bs->BPB_RootClus;
+    testAndSet(seen, h->bs->BPB_RootClus);
+    for(size_t q = 0; q < queue.count; q++) {
+        uint32_t clus = ((uint32_t*)queue.data)[q];
+        struct sidecarDirRec *rec = growPush(&dirs);
+        rec->clus = clus;
+        rec->firstEntry = entries.count;
+        rec->reserved = 0;
+
+        fat32DirIter it;
+        openDirIter(&it, fd, h, clus);
+        fat32Dir *dir;
+        while((dir = nextDirEntry(&it)) != NULL) {
+            memcpy(growPush(&entries), dir, sizeof(fat32Dir));
+            uint32_t first = ((uint32_t)dir->DIR_FstClusHI<<16) + dir->DIR_FstClusLO;
+            if(dir->DIR_Name[0] == '.' || first < 2 || first >= h->fatEntries || testAndSet(seen, first)) {
+                continue;
+            }
+            if(dir->DIR_Attr & ATTR_DIRECTORY) {
+                *(uint32_t*)growPush(&queue) = first;
+            }
+            else if(!(dir->DIR_Attr & ATTR_VOLUME_ID)) {
+                fat32Extent *list;
+                int count = buildExtents(fd, h, first, &list);
+                struct sidecarFileRec *file = growPush(&files);
+                file->firstClus = first;
+                file->firstExtent = extents.count;
+                file->extentCount = count;
+                file->reserved = 0;
+                for(int e = 0; e < count; e++) {
+                    memcpy(growPush(&extents), &list[e], sizeof(fat32Extent));
+                }
+                free(list);
+            }
+        }
+        closeDirIter(&it);
+        rec->entryCount = entries.count - rec->firstEntry;
+    }
+    free(seen);
+    free(queue.data);
+    qsort(dirs.data, dirs.count, dirs.size, compareDirs);
+    qsort(files.data, files.count, files.size, compareFiles);
+
+    struct sidecarHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+    header.version = SIDECAR_VERSION;
+    header.volID = h->bs->BS_VolID;
+    header.fatHash = sidecarFATHash(h->fat, h->fatEntries);
+    header.fatEntries = h->fatEntries;
+    header.clusterCount = h->clusterCount;
+    header.clusterBytes = clusterBytes(h);
+    header.dirCount = dirs.count;
+    header.entryCount = entries.count;
+    header.fileCount = files.count;
+    header.extentCount = extents.count;
+    header.dirsOffset = sizeof(header);
+    header.entriesOffset = header.dirsOffset + dirs.count*dirs.size;
+    header.filesOffset = header.entriesOffset + entries.count*entries.size;
+    header.extentsOffset = header.filesOffset + files.count*files.size;
+    header.freeMapOffset = header.extentsOffset + extents.count*extents.size;
+
+    char tmpPath[PATH_MAX];
+    snprintf(tmpPath, PATH_MAX, "%s.tmp", path);
+    FILE *out = fopen(tmpPath, "wb");
+    bool ok = out != NULL;
+    if(ok) {
+        /* The bitmap is copied under the lock PUT changes it under */
+        countFreeClusters(h);
+        pthread_mutex_lock(&h->lock);
+        header.freeMapWords = h->freeMapWords;
+        header.freeCount = h->freeCount;
+        header.fileSize = header.freeMapOffset + (uint64_t)h->freeMapWords*sizeof(uint64_t);
+        ok = writeTable(out, &header, sizeof(header))
+            && writeTable(out, dirs.data, dirs.count*dirs.size)
+            && writeTable(out, entries.data, entries.count*entries.size)
+            && writeTable(out, files.data, files.count*files.size)
+            && writeTable(out, extents.data, extents.count*extents.size)
+            && writeTable(out, h->freeMap, (size_t)h->freeMapWords*sizeof(uint64_t));
+        pthread_mutex_unlock(&h->lock);
+        ok = fclose(out) == 0 && ok;
+        ok = ok && rename(tmpPath, path) == 0;
+        if(!ok) {
+            unlink(tmpPath);
+        }
+    }
+    free(dirs.data);
+    free(entries.data);
+    free(files.data);
+    free(extents.data);
+    return ok;
+}
+
+/* Whether count records of size bytes at offset fit in the file */
+static bool tableFits(const struct sidecarHeader *header, uint64_t offset, uint64_t count, size_t size) {
+    return offset >= sizeof(struct sidecarHeader) && offset % 8 == 0 && offset + count*size <= header->fileSize;
+}
+
+/* Map in the index at path if it was built from this very image.
+    Returns NULL when it's missing, damaged or out of date. */
+sidecarIndex *openSidecar(fat32Head* h, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct sidecarHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if(map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const struct sidecarHeader *header = map;
+    bool valid = memcmp(header->magic, SIDECAR_MAGIC, sizeof(header->magic)) == 0
+        && header->version == SIDECAR_VERSION
+        && header->fileSize == (uint64_t)st.st_size
+        && header->volID == h->bs->BS_VolID
+        && header->fatEntries == h->fatEntries
+        && header->clusterCount == h->clusterCount
+        && header->clusterBytes == clusterBytes(h)
+        && header->freeMapWords == freeMapWords(h)
+        && tableFits(header, header->dirsOffset, header->dirCount, sizeof(struct sidecarDirRec))
+        && tableFits(header, header->entriesOffset, header->entryCount, sizeof(fat32Dir))
+        && tableFits(header, header->filesOffset, header->fileCount, sizeof(struct sidecarFileRec))
+        && tableFits(header, header->extentsOffset, header->extentCount, sizeof(fat32Extent))
+        && tableFits(header, header->freeMapOffset, header->freeMapWords, sizeof(uint64_t));
+    /* Last and dearest: the FAT must be the one the index was built from */
+    if(!valid || header->fatHash != sidecarFATHash(h->fat, h->fatEntries)) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    sidecarIndex *x = malloc(sizeof(sidecarIndex));
+    if(x == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(sidecarIndex));
+        abort();
+    }
+    x->map = map;
+    x->mapSize = st.st_size;
+    x->header = header;
+    x->dirs = (const struct sidecarDirRec*)(x->map + header->dirsOffset);
+    x->entries = (const fat32Dir*)(x->map + header->entriesOffset);
+    x->files = (const struct sidecarFileRec*)(x->map + header->filesOffset);
+    x->extents = (const fat32Extent*)(x->map + header->extentsOffset);
+    x->freeMap = (const uint64_t*)(x->map + header->freeMapOffset);
+    x->stale = false;
+    return x;
+}
+
+void closeSidecar(sidecarIndex *x) {
+    if(x == NULL) {
+        return;
+    }
+    munmap((void*)x->map, x->mapSize);
+    free(x);
+}
+
+/* The image is about to change, stop answering from the index */
+void sidecarMarkStale(sidecarIndex *x) {
+    __atomic_store_n(&x->stale, true, __ATOMIC_RELAXED);
+}
+
+static bool usable(sidecarIndex *x) {
+    return x != NULL && !__atomic_load_n(&x->stale, __ATOMIC_RELAXED);
+}
+
+/* Point *entries at the entries of the directory starting at dirClus, as
+    nextDirEntry would return them. Returns how many, or -1 when the
+    index can't say. */
+int sidecarDir(sidecarIndex *x, uint32_t dirClus, const fat32Dir **entries) {
+    if(!usable(x)) {
+        return -1;
+    }
+    uint32_t lo = 0;
+    uint32_t hi = x->header->dirCount;
+    while(lo < hi) {
+        uint32_t mid = lo + (hi - lo)/2;
+        if(x->dirs[mid].clus < dirClus) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if(lo == x->header->dirCount || x->dirs[lo].clus != dirClus
+        || (uint64_t)x->dirs[lo].firstEntry + x->dirs[lo].entryCount > x->header->entryCount) {
+        return -1;
+    }
+    *entries = &x->entries[x->dirs[lo].firstEntry];
+    return x->dirs[lo].entryCount;
+}
+
+/* Same contract as buildExtents, or -1 when the index can't say */
+int sidecarExtents(sidecarIndex *x, uint32_t firstClus, fat32Extent **extents) {
+    if(!usable(x)) {
+        return -1;
+    }
+    uint32_t lo = 0;
+    uint32_t hi = x->header->fileCount;
+    while(lo < hi) {
+        uint32_t mid = lo + (hi - lo)/2;
+        if(x->files[mid].firstClus < firstClus) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if(lo == x->header->fileCount || x->files[lo].firstClus != firstClus
+        || (uint64_t)x->files[lo].firstExtent + x->files[lo].extentCount > x->header->extentCount) {
+        return -1;
+    }
+    const struct sidecarFileRec *file = &x->files[lo];
+    size_t bytes = (file->extentCount > 0 ? file->extentCount : 1)*sizeof(fat32Extent);
+    *extents = malloc(bytes);
+    if(*extents == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", bytes);
+        abort();
+    }
+    memcpy(*extents, &x->extents[file->firstExtent], file->extentCount*sizeof(fat32Extent));
+    return file->extentCount;
+}
+
+/* Seed h's free bitmap from the index so FREE and PUT skip the FAT scan */
+bool sidecarLoadFreeMap(sidecarIndex *x, fat32Head* h) {
+    if(!usable(x)) {
+        return false;
+    }
+    size_t bytes = (size_t)x->header->freeMapWords*sizeof(uint64_t);
+    uint64_t *map = malloc(bytes > 0 ? bytes : sizeof(uint64_t));
+    if(map == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", bytes);
+        abort();
+    }
+    memcpy(map, x->freeMap, bytes);
+    pthread_mutex_lock(&h->lock);
+    free(h->freeMap);
+    h->freeMap = map;
+    h->freeMapWords = x->header->freeMapWords;
+    h->freeCount = x->header->freeCount;
+    pthread_mutex_unlock(&h->lock);
+    return true;
+}
@@ -0,0 +1,80 @@
+/* A sidecar index file next to an image: the directory tree, every
+* file's extents and the free cluster bitmap, saved so a later run can
+* map them in instead of walking the volume again.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "fat32.h"
+
+#define SIDECAR_MAGIC "FAT32IDX"
+#define SIDECAR_VERSION 1
+
+/* Start of the file. Every table offset is from the start of the file. */
+struct sidecarHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t volID; // BS_VolID of the image it was built from
+	uint64_t fatHash; // sidecarFATHash of the FAT it was built from
+	uint32_t fatEntries;
+	uint32_t clusterCount;
+	uint32_t clusterBytes;
+	uint32_t dirCount;
+	uint32_t entryCount;
+	uint32_t fileCount;
+	uint32_t extentCount;
+	uint32_t freeMapWords;
+	uint32_t freeCount;
+	uint32_t reserved;
+	uint64_t dirsOffset; // struct sidecarDirRec[dirCount], sorted by clus
+	uint64_t entriesOffset; // fat32Dir[entryCount], grouped by directory
+	uint64_t filesOffset; // struct sidecarFileRec[fileCount], sorted by firstClus
+	uint64_t extentsOffset; // fat32Extent[extentCount]
+	uint64_t freeMapOffset; // uint64_t[freeMapWords], as in fat32Head
+	uint64_t fileSize;
+};
+
+/* The entries of one directory */
+struct sidecarDirRec {
+	uint32_t clus; // First cluster of the directory
+	uint32_t firstEntry;
+	uint32_t entryCount;
+	uint32_t reserved;
+};
+
+/* The extents of one chain */
+struct sidecarFileRec {
+	uint32_t firstClus;
+	uint32_t firstExtent;
+	uint32_t extentCount;
+	uint32_t reserved;
+};
+
+/* An index mapped in by openSidecar */
+struct sidecarIndex {
+	const unsigned char *map;
+	size_t mapSize;
+	const struct sidecarHeader *header;
+	const struct sidecarDirRec *dirs;
+	const fat32Dir *entries;
+	const struct sidecarFileRec *files;
+	const fat32Extent *extents;
+	const uint64_t *freeMap;
+	bool stale; // The image was written since, lookups fall back to it
+};
+typedef struct sidecarIndex sidecarIndex;
+
+uint64_t sidecarFATHash(const uint32_t *fat, uint32_t entries);
+bool writeSidecar(int fd, fat32Head* h, const char *path);
+sidecarIndex *openSidecar(fat32Head* h, const char *path);
+void closeSidecar(sidecarIndex *x);
+void sidecarMarkStale(sidecarIndex *x);
+int sidecarDir(sidecarIndex *x, uint32_t dirClus, const fat32Dir **entries);
+int sidecarExtents(sidecarIndex *x, uint32_t firstClus, fat32Extent **extents);
+bool sidecarLoadFreeMap(sidecarIndex *x, fat32Head* h);
+
+#endif
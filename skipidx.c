@@ -0,0 +1,157 @@
+/* skipidx.c finds the cluster at position N of a chain without walking
+* the chain from its start every time. For each chain read at an
+* offset it records every K-th cluster (K = interval), so reaching any
+* position costs an array lookup and fewer than K FAT lookups. The
+* marks are filled in lazily, only as far as reads have gone, so a
+* read near the start of a huge file doesn't walk all of it.
+* A few chains are indexed at once; the least recently used one is
+* dropped to make room. One lock covers everything, held while a chain
+* is walked: that only reads the in-memory FAT. Chains of existing
+* files only change when they move, so anything that moves them must
+* call skipClear.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#include "skipidx.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/* The marks of one chain: marks[i] is the cluster at position i*K */
+struct skipIndex {
+    uint32_t firstClus; // 0 when the slot is free
+    uint32_t *marks;
+    uint32_t count;
+    uint32_t capacity;
+    bool ended; // The chain ended before the next mark
+    uint64_t lastUsed;
+};
+
+struct skipCache {
+    struct skipIndex *indexes;
+    int files;
+    uint32_t interval;
+    uint64_t clock; // Ticks once per seek, for LRU
+    pthread_mutex_t lock;
+};
+
+skipCache *createSkipCache(int files, uint32_t interval) {
+    if(files < 1 || interval < 1) {
+        return NULL;
+    }
+    skipCache *s = malloc(sizeof(skipCache));
+    struct skipIndex *indexes = calloc(files, sizeof(struct skipIndex));
+    if(s == NULL || indexes == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", sizeof(skipCache) + files*sizeof(struct skipIndex));
+        abort();
+    }
+    s->indexes = indexes;
+    s->files = files;
+    s->interval = interval;
+    s->clock = 0;
+    pthread_mutex_init(&s->lock, NULL);
+    return s;
+}
+
+void destroySkipCache(skipCache *s) {
+    if(s == NULL) {
+        return;
+    }
+    for(int i = 0; i < s->files; i++) {
+        free(s->indexes[i].marks);
+    }
+    pthread_mutex_destroy(&s->lock);
+    free(s->indexes);
+    free(s);
+}
+
+/* The index of firstClus, started afresh in the LRU slot if there is none */
+static struct skipIndex *indexFor(skipCache *s, uint32_t firstClus) {
+    struct skipIndex *victim = &s->indexes[0];
+    for(int i = 0; i < s->files; i++) {
+        struct skipIndex *x = &s->indexes[i];
+        if(x->firstClus == firstClus) {
+            return x;
+        }
+        if(x->lastUsed < victim->lastUsed) {
+            victim = x;
+        }
+    }
+    if(victim->marks == NULL) {
+        victim->capacity = 16;
+        victim->marks = malloc(victim->capacity*sizeof(uint32_t));
+        if(victim->marks == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", victim->capacity*sizeof(uint32_t));
+            abort();
+        }
+    }
+    victim->firstClus = firstClus;
+    victim->marks[0] = firstClus;
+    victim->count = 1;
+    victim->ended = false;
+    return victim;
+}
+
+static void addMark(struct skipIndex *x, uint32_t clus) {
+    if(x->count == x->capacity) {
+        x->capacity *= 2;
+        x->marks = realloc(x->marks, x->capacity*sizeof(uint32_t));
+        if(x->marks == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", x->capacity*sizeof(uint32_t));
+            abort();
+        }
+    }
+    x->marks[x->count++] = clus;
+}
+
+/* The cluster at position pos (0 for firstClus itself) of the chain
+    starting at firstClus, or 0 when the chain is shorter than that or
+    runs out of the FAT */
+uint32_t skipSeek(skipCache *s, int fd, fat32Head* h, uint32_t firstClus, uint32_t pos) {
+    if(firstClus < 2 || firstClus >= h->fatEntries) {
+        return 0;
+    }
+    pthread_mutex_lock(&s->lock);
+    struct skipIndex *x = indexFor(s, firstClus);
+    x->lastUsed = ++s->clock;
+
+    uint32_t mark = pos/s->interval;
+    if(mark >= x->count && x->ended) {
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    if(mark >= x->count) {
+        mark = x->count - 1;
+    }
+    uint32_t at = mark*s->interval;
+    uint32_t clus = x->marks[mark];
+    while(at < pos) {
+        clus = getFATEntryForClusterN(fd, clus, h);
+        if(clus < 2 || clus >= h->fatEntries) {
+            if(at/s->interval == x->count - 1) {
+                x->ended = true;
+            }
+            clus = 0;
+            break;
+        }
+        at++;
+        /* Positions past the last mark are new, record them */
+        if(at % s->interval == 0 && at/s->interval == x->count) {
+            addMark(x, clus);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return clus;
+}
+
+/* Forget every chain, after files were moved */
+void skipClear(skipCache *s) {
+    pthread_mutex_lock(&s->lock);
+    for(int i = 0; i < s->files; i++) {
+        s->indexes[i].firstClus = 0;
+        s->indexes[i].count = 0;
+        s->indexes[i].lastUsed = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,21 @@
+/* Sparse skip indexes of file chains, for reads at an offset.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef SKIPIDX_H
+#define SKIPIDX_H
+
+#include <inttypes.h>
+#include "fat32.h"
+
+#define SKIP_DEFAULT_FILES 64 // Chains indexed at once
+#define SKIP_DEFAULT_INTERVAL 64 // Every K-th cluster of a chain is recorded
+
+typedef struct skipCache skipCache;
+
+skipCache *createSkipCache(int files, uint32_t interval);
+void destroySkipCache(skipCache *s);
+uint32_t skipSeek(skipCache *s, int fd, fat32Head* h, uint32_t firstClus, uint32_t pos);
+void skipClear(skipCache *s);
+
+#endif
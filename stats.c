@@ -0,0 +1,259 @@
+/* stats.c keeps the optional instrumentation of a volume. Counters are
+* plain uint64_t fields bumped with relaxed atomic adds, so counting
+* never takes a lock. Command latencies go into log2 histograms (in
+* microseconds), and both commands and extractions are kept as spans
+* for a Chrome trace (chrome://tracing or Perfetto). The JSON summary
+* and the trace can be written out when the volume is closed.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#define _GNU_SOURCE
+
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/* Counter names, in the order of struct fat32Counters */
+static const char *counterNames[] = {
+    "preads", "mapReads", "bytesRead", "kernelCopies", "bytesCopied", "hostWrites",
+    "imageWrites", "bytesWritten", "fatLookups", "allocations", "clustersAllocated", "fatFlushWrites",
+    "prefetches"
+};
+#define COUNTER_COUNT (sizeof(fat32Counters)/sizeof(uint64_t))
+
+uint64_t statsNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static char *copyPath(const char *path) {
+    if(path == NULL) {
+        return NULL;
+    }
+    char *copy = strdup(path);
+    if(copy == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", strlen(path) + 1);
+        abort();
+    }
+    return copy;
+}
+
+/* jsonPath and tracePath may be NULL, the stats are then only kept in
+    memory for STATS */
+fat32Stats *createStats(const char *jsonPath, const char *tracePath) {
+    fat32Stats *s = calloc(1, sizeof(fat32Stats));
+    if(s == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", sizeof(fat32Stats));
+        abort();
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    s->epochNs = statsNow();
+    s->jsonPath = copyPath(jsonPath);
+    s->tracePath = copyPath(tracePath);
+    if(s->tracePath != NULL) {
+        s->events = malloc(STATS_TRACE_EVENTS*sizeof(struct statsEvent));
+        if(s->events == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", STATS_TRACE_EVENTS*sizeof(struct statsEvent));
+            abort();
+        }
+    }
+    return s;
+}
+
+static void dumpTo(const char *path, fat32Stats *s, bool trace, uint64_t cacheHits, uint64_t cacheMisses) {
+    FILE *out = fopen(path, "w");
+    if(out == NULL) {
+        perror("Can't write stats");
+        return;
+    }
+    if(trace) {
+        statsWriteTrace(s, out);
+    }
+    else {
+        statsWriteJSON(s, out, cacheHits, cacheMisses);
+        fputc('\n', out);
+    }
+    fclose(out);
+}
+
+/* Write out whatever was asked for at creation, then free everything */
+void destroyStats(fat32Stats *s, uint64_t cacheHits, uint64_t cacheMisses) {
+    if(s == NULL) {
+        return;
+    }
+    if(s->jsonPath != NULL) {
+        dumpTo(s->jsonPath, s, false, cacheHits, cacheMisses);
+    }
+    if(s->tracePath != NULL) {
+        dumpTo(s->tracePath, s, true, cacheHits, cacheMisses);
+    }
+    pthread_mutex_destroy(&s->lock);
+    free(s->events);
+    free(s->jsonPath);
+    free(s->tracePath);
+    free(s);
+}
+
+/* Keep a span for the trace, the lock must be held */
+static void addEvent(fat32Stats *s, const char *name, uint64_t startNs, uint64_t ns) {
+    if(s->events == NULL) {
+        return;
+    }
+    if(s->eventCount == STATS_TRACE_EVENTS) {
+        s->droppedEvents++;
+        return;
+    }
+    struct statsEvent *event = &s->events[s->eventCount++];
+    snprintf(event->name, STATS_NAME_LENGTH, "%s", name);
+    event->startNs = startNs;
+    event->ns = ns;
+    event->tid = syscall(SYS_gettid);
+}
+
+/* Record a command that started at startNs and has just finished */
+void statsCommand(fat32Stats *s, const char *name, uint64_t startNs) {
+    if(s == NULL) {
+        return;
+    }
+    uint64_t ns = statsNow() - startNs;
+    uint64_t us = ns/1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if(bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    fat32CommandStats *c = NULL;
+    for(int i = 0; i < s->commandCount && c == NULL; i++) {
+        if(strncmp(s->commands[i].name, name, STATS_NAME_LENGTH - 1) == 0) {
+            c = &s->commands[i];
+        }
+    }
+    if(c == NULL && s->commandCount < STATS_MAX_COMMANDS) {
+        c = &s->commands[s->commandCount++];
+        snprintf(c->name, STATS_NAME_LENGTH, "%s", name);
+    }
+    if(c != NULL) {
+        c->count++;
+        c->totalNs += ns;
+        if(ns > c->maxNs) {
+            c->maxNs = ns;
+        }
+        c->buckets[bucket]++;
+    }
+    addEvent(s, name, startNs, ns);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Record a span for the trace only, such as one file of an MGET */
+void statsSpan(fat32Stats *s, const char *name, uint64_t startNs) {
+    if(s == NULL || s->events == NULL) {
+        return;
+    }
+    uint64_t ns = statsNow() - startNs;
+    pthread_mutex_lock(&s->lock);
+    addEvent(s, name, startNs, ns);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void statsSnapshot(fat32Stats *s, fat32Counters *counters) {
+    const uint64_t *from = (const uint64_t*)&s->counters;
+    uint64_t *to = (uint64_t*)counters;
+    for(size_t i = 0; i < COUNTER_COUNT; i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
+
+/* Copy up to max commands' stats into out, returns how many */
+int statsCommands(fat32Stats *s, fat32CommandStats *out, int max) {
+    pthread_mutex_lock(&s->lock);
+    int count = s->commandCount < max ? s->commandCount : max;
+    memcpy(out, s->commands, count*sizeof(fat32CommandStats));
+    pthread_mutex_unlock(&s->lock);
+    return count;
+}
+
+/* Upper bound, in us, of the bucket holding the given fraction of runs */
+uint64_t statsPercentile(const fat32CommandStats *c, double fraction) {
+    uint64_t want = (uint64_t)(c->count*fraction + 0.5);
+    if(want == 0) {
+        want = 1;
+    }
+    uint64_t seen = 0;
+    for(int b = 0; b < STATS_BUCKETS; b++) {
+        seen += c->buckets[b];
+        if(seen >= want) {
+            return 1ULL << b;
+        }
+    }
+    return 1ULL << (STATS_BUCKETS - 1);
+}
+
+static void writeName(FILE *out, const char *name) {
+    fputc('"', out);
+    for(const unsigned char *p = (const unsigned char*)name; *p != '\0'; p++) {
+        if(*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        }
+        else if(*p < 0x20 || *p >= 0x7F) {
+            fprintf(out, "\\u%04x", *p);
+        }
+        else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/* The summary as one line of JSON: counters, cache and per-command
+    histograms keyed by each bucket's upper bound in us */
+void statsWriteJSON(fat32Stats *s, FILE *out, uint64_t cacheHits, uint64_t cacheMisses) {
+    fat32Counters counters;
+    statsSnapshot(s, &counters);
+    const uint64_t *values = (const uint64_t*)&counters;
+    fprintf(out, "{\"counters\":{");
+    for(size_t i = 0; i < COUNTER_COUNT; i++) {
+        fprintf(out, "%s\"%s\":%" PRIu64, i > 0 ? "," : "", counterNames[i], values[i]);
+    }
+    fprintf(out, ",\"cacheHits\":%" PRIu64 ",\"cacheMisses\":%" PRIu64 "},\"commands\":[", cacheHits, cacheMisses);
+
+    fat32CommandStats commands[STATS_MAX_COMMANDS];
+    int count = statsCommands(s, commands, STATS_MAX_COMMANDS);
+    for(int i = 0; i < count; i++) {
+        fat32CommandStats *c = &commands[i];
+        fprintf(out, "%s{\"name\":", i > 0 ? "," : "");
+        writeName(out, c->name);
+        fprintf(out, ",\"count\":%" PRIu64 ",\"totalUs\":%" PRIu64 ",\"maxUs\":%" PRIu64, c->count, c->totalNs/1000, c->maxNs/1000);
+        fprintf(out, ",\"histogramUs\":{");
+        bool first = true;
+        for(int b = 0; b < STATS_BUCKETS; b++) {
+            if(c->buckets[b] != 0) {
+                fprintf(out, "%s\"%llu\":%" PRIu64, first ? "" : ",", 1ULL << b, c->buckets[b]);
+                first = false;
+            }
+        }
+        fprintf(out, "}}");
+    }
+    fprintf(out, "]}");
+}
+
+/* The spans in Chrome's trace event format, times in us */
+void statsWriteTrace(fat32Stats *s, FILE *out) {
+    int pid = getpid();
+    pthread_mutex_lock(&s->lock);
+    fprintf(out, "{\"traceEvents\":[\n");
+    for(int i = 0; i < s->eventCount; i++) {
+        struct statsEvent *event = &s->events[i];
+        fprintf(out, "{\"name\":");
+        writeName(out, event->name);
+        fprintf(out, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}%s\n",
+            (event->startNs - s->epochNs)/1000.0, event->ns/1000.0, pid, event->tid,
+            i + 1 < s->eventCount ? "," : "");
+    }
+    fprintf(out, "],\"otherData\":{\"droppedEvents\":%" PRIu64 "}}\n", s->droppedEvents);
+    pthread_mutex_unlock(&s->lock);
+}
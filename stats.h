@@ -0,0 +1,58 @@
+/* Optional instrumentation: I/O counters, per-command latency
+* histograms and a trace of timed spans. Everything hangs off a
+* struct fat32Stats that only exists when stats were asked for, so
+* with them off each counting site costs one NULL test.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "fat32types.h"
+
+#define STATS_TRACE_EVENTS 100000 // Spans kept for the trace, later ones are dropped
+
+/* One finished span for the trace */
+struct statsEvent {
+	char name[STATS_NAME_LENGTH];
+	uint64_t startNs;
+	uint64_t ns;
+	int tid;
+};
+
+struct fat32Stats {
+	fat32Counters counters;
+	pthread_mutex_t lock; // Guards everything below
+	fat32CommandStats commands[STATS_MAX_COMMANDS];
+	int commandCount;
+	struct statsEvent *events;
+	int eventCount;
+	uint64_t droppedEvents;
+	uint64_t epochNs; // When the stats were created, trace times count from here
+	char *jsonPath; // Dumped to by destroyStats when set
+	char *tracePath;
+};
+typedef struct fat32Stats fat32Stats;
+
+#define STAT_ADD(stats, field, n) do { \
+		if((stats) != NULL) { \
+			__atomic_fetch_add(&(stats)->counters.field, (n), __ATOMIC_RELAXED); \
+		} \
+	} while(0)
+
+fat32Stats *createStats(const char *jsonPath, const char *tracePath);
+void destroyStats(fat32Stats *s, uint64_t cacheHits, uint64_t cacheMisses);
+uint64_t statsNow(void);
+void statsCommand(fat32Stats *s, const char *name, uint64_t startNs);
+void statsSpan(fat32Stats *s, const char *name, uint64_t startNs);
+void statsSnapshot(fat32Stats *s, fat32Counters *counters);
+int statsCommands(fat32Stats *s, fat32CommandStats *out, int max);
+uint64_t statsPercentile(const fat32CommandStats *c, double fraction);
+void statsWriteJSON(fat32Stats *s, FILE *out, uint64_t cacheHits, uint64_t cacheMisses);
+void statsWriteTrace(fat32Stats *s, FILE *out);
+
+#endif
@@ -0,0 +1,494 @@
+/* transfer.c copies a file's extents from the image into a host
+* file in fixed size chunks, so memory use does not grow with the
+* file. The kernel does the copy when it can (copy_file_range, then
+* sendfile), a mapped image is written straight from the map, and
+* everything else goes through one bounded buffer.
+* Large GETs can instead run pipelined: a reader thread fills a small
+* ring of cluster aligned buffers while the caller drains it to the
+* host file, so image reads and host writes overlap.
+* Either way the kernel is told about the extents coming up, a window
+* of h->prefetch clusters past the chunk being copied, so it can read
+* them ahead even where the chain jumps around the image.
+* When a checksum is asked for, the data has to pass through memory
+* anyway, so the kernel copies are skipped and each chunk is summed
+* while it is still in cache, just before it is written. VERIFY reads
+* the host file in the same chunks and compares it with memcmp.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "transfer.h"
+#include "stats.h"
+#include "checksum.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+/* How a run of bytes gets from the image to the host file */
+enum copyMethod {
+    COPY_FILE_RANGE,
+    COPY_SENDFILE,
+    COPY_BUFFERED
+};
+
+/* How far through a file's extents the read ahead hints have got */
+struct prefetchCursor {
+    int extent; // First extent with bytes not hinted yet
+    uint64_t within; // Bytes of that extent already hinted
+    uint64_t hinted; // File bytes hinted so far
+};
+
+/* Hint the window of the file past upTo, once less than half of it is
+    left hinted */
+static void prefetchAhead(int fd, fat32Head* h, const fat32Extent *extents, int extentCount, uint64_t fileSize,
+        struct prefetchCursor *c, uint64_t upTo) {
+    uint64_t window = (uint64_t)h->prefetch*clusterBytes(h);
+    if(window == 0 || c->hinted >= fileSize || c->hinted > upTo + window/2) {
+        return;
+    }
+    if(c->hinted < upTo) {
+        /* Already being read, don't hint behind the copy */
+        while(c->extent < extentCount && c->hinted < upTo) {
+            uint64_t left = (uint64_t)extents[c->extent].count*clusterBytes(h) - c->within;
+            uint64_t skip = upTo - c->hinted < left ? upTo - c->hinted : left;
+            c->within += skip;
+            c->hinted += skip;
+            if(skip == left) {
+                c->extent++;
+                c->within = 0;
+            }
+        }
+    }
+    uint64_t until = upTo + window < fileSize ? upTo + window : fileSize;
+    while(c->extent < extentCount && c->hinted < until) {
+        uint64_t left = (uint64_t)extents[c->extent].count*clusterBytes(h) - c->within;
+        uint64_t len = until - c->hinted < left ? until - c->hinted : left;
+        prefetchImage(fd, h, clusterOffset(h, extents[c->extent].clus) + c->within, len);
+        c->within += len;
+        c->hinted += len;
+        if(len == left) {
+            c->extent++;
+            c->within = 0;
+        }
+    }
+}
+
+/* write() all of len, retrying on short writes */
+static int writeAll(fat32Head* h, int outFd, const char *buf, size_t len) {
+    while(len > 0) {
+        ssize_t written = write(outFd, buf, len);
+        STAT_ADD(h->stats, hostWrites, 1);
+        if(written == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("Write failed.\n");
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/* Whether a failed in-kernel copy just means "not supported here" */
+static bool copyUnsupported(int err) {
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == EBADF;
+}
+
+/* Copy fileSize bytes described by extents into outFd, updating *crc
+    with them when crc isn't NULL. Returns 0 on success and -1 on a read
+    or write error. */
+int copyExtents(int fd, fat32Head* h, const fat32Extent *extents, int extentCount, uint64_t fileSize, int outFd, uint32_t *crc) {
+    enum copyMethod method = h->map != NULL || crc != NULL ? COPY_BUFFERED : COPY_FILE_RANGE;
+    char *buf = NULL;
+    uint64_t done = 0;
+    struct prefetchCursor ahead = { 0, 0, 0 };
+
+    for(int e = 0; e < extentCount && done < fileSize; e++) {
+        uint64_t len = (uint64_t)extents[e].count*clusterBytes(h);
+        if(len > fileSize - done) {
+            len = fileSize - done;
+        }
+        off_t offset = clusterOffset(h, extents[e].clus);
+        while(len > 0) {
+            size_t chunk = len > TRANSFER_CHUNK_SIZE ? TRANSFER_CHUNK_SIZE : len;
+            ssize_t moved = -1;
+            prefetchAhead(fd, h, extents, extentCount, fileSize, &ahead, done + chunk);
+
+            if(method == COPY_FILE_RANGE) {
+                moved = copy_file_range(fd, &offset, outFd, NULL, chunk, 0);
+                STAT_ADD(h->stats, kernelCopies, 1);
+                if(moved == -1 && copyUnsupported(errno)) {
+                    method = COPY_SENDFILE;
+                    continue;
+                }
+            }
+            else if(method == COPY_SENDFILE) {
+                moved = sendfile(outFd, fd, &offset, chunk);
+                STAT_ADD(h->stats, kernelCopies, 1);
+                if(moved == -1 && copyUnsupported(errno)) {
+                    method = COPY_BUFFERED;
+                    continue;
+                }
+            }
+            else {
+                /* A mapped image is its own buffer */
+                const char *src = imagePtr(h, offset, chunk);
+                if(src == NULL) {
+                    if(buf == NULL) {
+                        buf = malloc(TRANSFER_CHUNK_SIZE);
+                        if(buf == NULL) {
+                            fprintf(stderr, "Fatal: failed to allocate %d bytes.\n", TRANSFER_CHUNK_SIZE);
+                            abort();
+                        }
+                    }
+                    moved = readImage(fd, h, offset, buf, chunk);
+                    src = buf;
+                }
+                else {
+                    moved = chunk;
+                    STAT_ADD(h->stats, mapReads, 1);
+                    STAT_ADD(h->stats, bytesRead, chunk);
+                }
+                if(moved > 0 && crc != NULL) {
+                    *crc = crc32cUpdate(*crc, src, moved);
+                }
+                if(moved > 0 && writeAll(h, outFd, src, moved) == -1) {
+                    free(buf);
+                    return -1;
+                }
+                offset += moved > 0 ? moved : 0;
+            }
+
+            if(moved == -1 && errno == EINTR) {
+                continue;
+            }
+            if(moved <= 0) {
+                if(moved == -1) {
+                    perror("Copy failed.\n");
+                }
+                free(buf);
+                return -1;
+            }
+            if(method != COPY_BUFFERED) {
+                STAT_ADD(h->stats, bytesCopied, moved);
+            }
+            len -= moved;
+            done += moved;
+        }
+    }
+    free(buf);
+    return done == fileSize ? 0 : -1;
+}
+
+/* Ring of buffers shared by the reader thread and the writer */
+struct pipeline {
+    int fd;
+    fat32Head *h;
+    const fat32Extent *extents;
+    int extentCount;
+    uint64_t fileSize;
+
+    char *bufs[PIPELINE_BUFFERS];
+    size_t lens[PIPELINE_BUFFERS];
+    size_t bufSize;
+    int head; // Next buffer the reader fills
+    int tail; // Next buffer the writer drains
+    int count; // Filled buffers waiting for the writer
+
+    bool readerDone;
+    bool failed; // Set by either side to stop the other
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+};
+
+/* Reader thread: walk the extents and hand full buffers to the writer */
+static void *pipelineReader(void *arg) {
+    struct pipeline *p = arg;
+    uint64_t done = 0;
+    struct prefetchCursor ahead = { 0, 0, 0 };
+
+    for(int e = 0; e < p->extentCount && done < p->fileSize; e++) {
+        uint64_t len = (uint64_t)p->extents[e].count*clusterBytes(p->h);
+        if(len > p->fileSize - done) {
+            len = p->fileSize - done;
+        }
+        off_t offset = clusterOffset(p->h, p->extents[e].clus);
+        while(len > 0) {
+            pthread_mutex_lock(&p->lock);
+            while(p->count == PIPELINE_BUFFERS && !p->failed) {
+                pthread_cond_wait(&p->notFull, &p->lock);
+            }
+            bool failed = p->failed;
+            int slot = p->head;
+            pthread_mutex_unlock(&p->lock);
+            if(failed) {
+                return NULL;
+            }
+
+            /* Only this thread touches the slot until it is published */
+            size_t chunk = len > p->bufSize ? p->bufSize : len;
+            prefetchAhead(p->fd, p->h, p->extents, p->extentCount, p->fileSize, &ahead, done + chunk);
+            ssize_t readd = readImage(p->fd, p->h, offset, p->bufs[slot], chunk);
+
+            pthread_mutex_lock(&p->lock);
+            if(readd != (ssize_t)chunk) {
+                p->failed = true;
+                pthread_cond_signal(&p->notEmpty);
+                pthread_mutex_unlock(&p->lock);
+                return NULL;
+            }
+            p->lens[slot] = chunk;
+            p->head = (p->head + 1) % PIPELINE_BUFFERS;
+            p->count++;
+            pthread_cond_signal(&p->notEmpty);
+            pthread_mutex_unlock(&p->lock);
+
+            offset += chunk;
+            len -= chunk;
+            done += chunk;
+        }
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->readerDone = true;
+    pthread_cond_signal(&p->notEmpty);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* Same contract as copyExtents, but reads run on their own thread and
+    overlap with the writes done here. */
+int copyExtentsPipelined(int fd, fat32Head* h, const fat32Extent *extents, int extentCount, uint64_t fileSize, int outFd, uint32_t *crc) {
+    struct pipeline p;
+    memset(&p, 0, sizeof(p));
+    p.fd = fd;
+    p.h = h;
+    p.extents = extents;
+    p.extentCount = extentCount;
+    p.fileSize = fileSize;
+
+    /* Whole clusters per buffer, so every read starts on a cluster */
+    p.bufSize = TRANSFER_CHUNK_SIZE - TRANSFER_CHUNK_SIZE % clusterBytes(h);
+    if(p.bufSize == 0) {
+        p.bufSize = clusterBytes(h);
+    }
+    for(int i = 0; i < PIPELINE_BUFFERS; i++) {
+        if(posix_memalign((void**)&p.bufs[i], sysconf(_SC_PAGESIZE), p.bufSize) != 0) {
+            fprintf(stderr, "Fatal: failed to allocate %zu bytes.\n", p.bufSize);
+            abort();
+        }
+    }
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.notEmpty, NULL);
+    pthread_cond_init(&p.notFull, NULL);
+
+    pthread_t reader;
+    bool started = pthread_create(&reader, NULL, pipelineReader, &p) == 0;
+    if(!started) {
+        fprintf(stderr, "Creating reader thread failed.\n");
+        p.failed = true;
+    }
+
+    /* p.failed is only looked at under the lock while the reader runs */
+    uint64_t written = 0;
+    for(;;) {
+        pthread_mutex_lock(&p.lock);
+        while(p.count == 0 && !p.readerDone && !p.failed) {
+            pthread_cond_wait(&p.notEmpty, &p.lock);
+        }
+        if(p.count == 0 || p.failed) {
+            pthread_mutex_unlock(&p.lock);
+            break;
+        }
+        int slot = p.tail;
+        pthread_mutex_unlock(&p.lock);
+
+        if(crc != NULL) {
+            *crc = crc32cUpdate(*crc, p.bufs[slot], p.lens[slot]);
+        }
+        int result = writeAll(h, outFd, p.bufs[slot], p.lens[slot]);
+        written += p.lens[slot];
+
+        pthread_mutex_lock(&p.lock);
+        if(result == -1) {
+            p.failed = true;
+        }
+        p.tail = (p.tail + 1) % PIPELINE_BUFFERS;
+        p.count--;
+        pthread_cond_signal(&p.notFull);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    /* Whoever failed first, make sure the reader isn't left waiting */
+    pthread_mutex_lock(&p.lock);
+    pthread_cond_signal(&p.notFull);
+    pthread_mutex_unlock(&p.lock);
+    if(started) {
+        pthread_join(reader, NULL);
+    }
+
+    pthread_cond_destroy(&p.notFull);
+    pthread_cond_destroy(&p.notEmpty);
+    pthread_mutex_destroy(&p.lock);
+    for(int i = 0; i < PIPELINE_BUFFERS; i++) {
+        free(p.bufs[i]);
+    }
+    return !p.failed && written == fileSize ? 0 : -1;
+}
+
+/* Copy the file described by dir into a new host file at hostPath, and
+    when crc isn't NULL set *crc to the CRC32C of its data. Safe to run
+    for several files at once on the same head. */
+int extractFile(int fd, fat32Head* h, const fat32Dir *dir, const char *hostPath, uint32_t *crc) {
+    uint32_t firstClus = ((uint32_t)dir->DIR_FstClusHI<<16) + dir->DIR_FstClusLO;
+    uint32_t fileSize = dir->DIR_FileSize;
+
+    /* Collapse the chain into runs of consecutive clusters */
+    fat32Extent *extents;
+    int extentCount = buildExtents(fd, h, firstClus, &extents);
+    uint64_t totalBytes = 0;
+    for(int e = 0; e < extentCount; e++) {
+        totalBytes += (uint64_t)extents[e].count*clusterBytes(h);
+    }
+    if(totalBytes < fileSize) {
+        free(extents);
+        return EXTRACT_READ_FAILED;
+    }
+
+    int outFd = open(hostPath, O_WRONLY | O_CREAT | O_EXCL, 0777);
+    if(outFd < 0) {
+        free(extents);
+        return EXTRACT_CREATE_FAILED;
+    }
+    /* Streamed in bounded chunks, one extent at a time */
+    int result;
+    if(crc != NULL) {
+        *crc = 0;
+    }
+    if((h->opts & FAT32_OPT_PIPELINE) && fileSize >= PIPELINE_MIN_SIZE) {
+        result = copyExtentsPipelined(fd, h, extents, extentCount, fileSize, outFd, crc);
+    }
+    else {
+        result = copyExtents(fd, h, extents, extentCount, fileSize, outFd, crc);
+    }
+    close(outFd);
+    free(extents);
+    if(result != 0) {
+        /* Don't leave half a file behind, a retry would find it there */
+        unlink(hostPath);
+        return EXTRACT_READ_FAILED;
+    }
+    return EXTRACT_OK;
+}
+
+/* read() all of len from the host file, short only at its end */
+static ssize_t readAll(int inFd, char *buf, size_t len) {
+    size_t done = 0;
+    while(done < len) {
+        ssize_t got = read(inFd, buf + done, len - done);
+        if(got == -1 && errno == EINTR) {
+            continue;
+        }
+        if(got == -1) {
+            return -1;
+        }
+        if(got == 0) {
+            break;
+        }
+        done += got;
+    }
+    return done;
+}
+
+/* Compare the file described by dir with the host file at hostPath.
+    On VERIFY_DIFFERENT *differsAt is the first byte that isn't the same,
+    or the shorter length when one is a prefix of the other. */
+int verifyFile(int fd, fat32Head* h, const fat32Dir *dir, const char *hostPath, uint64_t *differsAt) {
+    uint32_t firstClus = ((uint32_t)dir->DIR_FstClusHI<<16) + dir->DIR_FstClusLO;
+    uint64_t fileSize = dir->DIR_FileSize;
+
+    int inFd = open(hostPath, O_RDONLY);
+    if(inFd < 0) {
+        return VERIFY_OPEN_FAILED;
+    }
+    struct stat st;
+    if(fstat(inFd, &st) == -1) {
+        close(inFd);
+        return VERIFY_READ_FAILED;
+    }
+    posix_fadvise(inFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    uint64_t hostSize = st.st_size;
+    uint64_t common = hostSize < fileSize ? hostSize : fileSize;
+
+    fat32Extent *extents;
+    int extentCount = buildExtents(fd, h, firstClus, &extents);
+    char *imageBuf = malloc(TRANSFER_CHUNK_SIZE);
+    char *hostBuf = malloc(TRANSFER_CHUNK_SIZE);
+    if(imageBuf == NULL || hostBuf == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %d bytes.\n", 2*TRANSFER_CHUNK_SIZE);
+        abort();
+    }
+    struct prefetchCursor ahead = { 0, 0, 0 };
+    uint64_t done = 0;
+    int result = VERIFY_SAME;
+
+    for(int e = 0; e < extentCount && done < common && result == VERIFY_SAME; e++) {
+        uint64_t len = (uint64_t)extents[e].count*clusterBytes(h);
+        if(len > common - done) {
+            len = common - done;
+        }
+        off_t offset = clusterOffset(h, extents[e].clus);
+        while(len > 0 && result == VERIFY_SAME) {
+            size_t chunk = len > TRANSFER_CHUNK_SIZE ? TRANSFER_CHUNK_SIZE : len;
+            prefetchAhead(fd, h, extents, extentCount, fileSize, &ahead, done + chunk);
+            const char *image = imagePtr(h, offset, chunk);
+            if(image == NULL) {
+                image = imageBuf;
+                if(readImage(fd, h, offset, imageBuf, chunk) != (ssize_t)chunk) {
+                    result = VERIFY_READ_FAILED;
+                    break;
+                }
+            }
+            if(readAll(inFd, hostBuf, chunk) != (ssize_t)chunk) {
+                result = VERIFY_READ_FAILED;
+                break;
+            }
+            if(memcmp(image, hostBuf, chunk) != 0) {
+                size_t i = 0;
+                while(image[i] == hostBuf[i]) {
+                    i++;
+                }
+                *differsAt = done + i;
+                result = VERIFY_DIFFERENT;
+                break;
+            }
+            offset += chunk;
+            len -= chunk;
+            done += chunk;
+        }
+    }
+    if(result == VERIFY_SAME && done < common) {
+        /* The chain ran out before the file size did */
+        result = VERIFY_READ_FAILED;
+    }
+    else if(result == VERIFY_SAME && hostSize != fileSize) {
+        *differsAt = common;
+        result = VERIFY_DIFFERENT;
+    }
+    free(hostBuf);
+    free(imageBuf);
+    free(extents);
+    close(inFd);
+    return result;
+}
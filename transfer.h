@@ -0,0 +1,31 @@
+/* Moving file data out of the image.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <inttypes.h>
+#include "fat32.h"
+
+#define TRANSFER_CHUNK_SIZE (1024*1024) // Largest single read/write/copy
+#define PIPELINE_BUFFERS 4 // Buffers in flight between reader and writer
+#define PIPELINE_MIN_SIZE (8*1024*1024) // Smaller files aren't worth a thread
+
+/* extractFile results */
+#define EXTRACT_OK 0
+#define EXTRACT_CREATE_FAILED 1 // Host file exists or can't be created
+#define EXTRACT_READ_FAILED 2 // Chain too short, or an I/O error
+
+/* verifyFile results */
+#define VERIFY_SAME 0
+#define VERIFY_DIFFERENT 1 // Contents or size differ
+#define VERIFY_OPEN_FAILED 2 // Host file can't be opened
+#define VERIFY_READ_FAILED 3 // Chain too short, or an I/O error
+
+int extractFile(int fd, fat32Head* h, const fat32Dir *dir, const char *hostPath, uint32_t *crc);
+int copyExtentsPipelined(int fd, fat32Head* h, const fat32Extent *extents, int extentCount, uint64_t fileSize, int outFd, uint32_t *crc);
+int copyExtents(int fd, fat32Head* h, const fat32Extent *extents, int extentCount, uint64_t fileSize, int outFd, uint32_t *crc);
+int verifyFile(int fd, fat32Head* h, const fat32Dir *dir, const char *hostPath, uint64_t *differsAt);
+
+#endif
@@ -0,0 +1,231 @@
+/* upload.c copies a host file into a directory of the image: clusters
+* come from the allocator in alloc.c (contiguous when possible), the
+* data is streamed in one extent at a time, the chain and FSInfo are
+* flushed, and only then is the directory entry written. An entry never
+* reaches the image pointing at a chain that isn't there yet; a crash
+* before it is written leaves lost clusters, which FSCK reports.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include "upload.h"
+#include "alloc.h"
+#include "transfer.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define SHORT_NAME_LENGTH 11
+#define SHORT_BASE_LENGTH 8
+#define SHORT_EXT_LENGTH 3
+#define FAT_EOC_MIN 0x0FFFFFF8
+#define FAT_YEAR_BASE 1980
+
+/* Characters that can't appear in a short name */
+static const char *badShortChars = "\"*+,/:;<=>?[\\]| ";
+
+/* Turn "name.ext" into the 11 byte space padded, upper case short name.
+    Returns false when it doesn't fit 8.3 or has characters 8.3 can't hold. */
+bool makeShortName(const char *name, char *shortName) {
+    const char *dot = strrchr(name, '.');
+    size_t baseLen = dot != NULL ? (size_t)(dot - name) : strlen(name);
+    size_t extLen = dot != NULL ? strlen(dot + 1) : 0;
+    if(baseLen == 0 || baseLen > SHORT_BASE_LENGTH || extLen > SHORT_EXT_LENGTH) {
+        return false;
+    }
+    memset(shortName, ' ', SHORT_NAME_LENGTH);
+    for(size_t i = 0; i < baseLen + extLen; i++) {
+        unsigned char c = i < baseLen ? name[i] : dot[1 + i - baseLen];
+        if(c < 0x20 || c == '.' || strchr(badShortChars, c) != NULL) {
+            return false;
+        }
+        shortName[i < baseLen ? i : SHORT_BASE_LENGTH + i - baseLen] = toupper(c);
+    }
+    /* 0xE5 in the first byte would read as a deleted entry */
+    if((unsigned char)shortName[0] == DIR_ENTRY_FREE) {
+        shortName[0] = 0x05;
+    }
+    return true;
+}
+
+/* FAT date and time for t, in local time */
+static void fatTimestamp(time_t t, uint16_t *date, uint16_t *time) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    int year = tm.tm_year + 1900 - FAT_YEAR_BASE;
+    if(year < 0) {
+        year = 0;
+    }
+    *date = (uint16_t)((year << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+    *time = (uint16_t)((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec/2));
+}
+
+/* Whether the directory already holds shortName */
+static bool nameTaken(int fd, fat32Head* h, uint32_t dirClus, const char *shortName) {
+    fat32DirIter it;
+    fat32Dir *dir;
+    bool taken = false;
+    openDirIter(&it, fd, h, dirClus);
+    while(!taken && (dir = nextDirEntry(&it)) != NULL) {
+        taken = memcmp(dir->DIR_Name, shortName, SHORT_NAME_LENGTH) == 0;
+    }
+    closeDirIter(&it);
+    return taken;
+}
+
+/* Image offset of the first unused entry slot in the directory. When
+    every cluster is full, a fresh zeroed cluster is linked on the end.
+    Returns -1 when that fails. */
+static off_t findFreeSlot(int fd, fat32Head* h, uint32_t dirClus) {
+    uint32_t clusBytes = clusterBytes(h);
+    unsigned char *buf = malloc(clusBytes);
+    if(buf == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %u bytes.\n", clusBytes);
+        abort();
+    }
+    uint32_t clus = dirClus == 0 ? h->bs->BPB_RootClus : dirClus;
+    uint32_t lastClus = clus;
+    uint32_t steps = 0;
+    while(clus >= 2 && clus < h->fatEntries && steps++ < h->fatEntries) {
+        if(readCluster(fd, h, clus, buf) != clusBytes) {
+            free(buf);
+            return -1;
+        }
+        for(uint32_t i = 0; i < clusBytes; i += sizeof(fat32Dir)) {
+            unsigned char first = buf[i];
+            if(first == DIR_ENTRY_END || first == DIR_ENTRY_FREE) {
+                free(buf);
+                return clusterOffset(h, clus) + i;
+            }
+        }
+        lastClus = clus;
+        clus = getFATEntryForClusterN(fd, clus, h);
+        if(clus >= FAT_EOC_MIN) {
+            break;
+        }
+    }
+
+    /* Directory is full, grow it by one cluster right after its last one */
+    fat32Extent *extents;
+    if(allocateExtents(h, 1, lastClus + 1, &extents) != 1) {
+        free(buf);
+        return -1;
+    }
+    uint32_t newClus = extents[0].clus;
+    free(extents);
+    memset(buf, 0, clusBytes);
+    if(writeImage(fd, h, clusterOffset(h, newClus), buf, clusBytes) != clusBytes) {
+        freeChain(h, newClus);
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    setFATEntry(h, lastClus, newClus);
+    return clusterOffset(h, newClus);
+}
+
+/* Stream the host file into the allocated extents */
+static int writeExtents(int fd, fat32Head* h, int hostFd, const fat32Extent *extents, int extentCount, uint64_t fileSize) {
+    char *buf = malloc(TRANSFER_CHUNK_SIZE);
+    if(buf == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %d bytes.\n", TRANSFER_CHUNK_SIZE);
+        abort();
+    }
+    uint64_t done = 0;
+    for(int e = 0; e < extentCount && done < fileSize; e++) {
+        uint64_t len = (uint64_t)extents[e].count*clusterBytes(h);
+        if(len > fileSize - done) {
+            len = fileSize - done;
+        }
+        off_t offset = clusterOffset(h, extents[e].clus);
+        while(len > 0) {
+            size_t chunk = len > TRANSFER_CHUNK_SIZE ? TRANSFER_CHUNK_SIZE : len;
+            ssize_t readd = pread(hostFd, buf, chunk, done);
+            if(readd == -1 && errno == EINTR) {
+                continue;
+            }
+            if(readd <= 0) {
+                free(buf);
+                return PUT_READ_FAILED;
+            }
+            if(writeImage(fd, h, offset, buf, readd) != readd) {
+                free(buf);
+                return PUT_WRITE_FAILED;
+            }
+            offset += readd;
+            len -= readd;
+            done += readd;
+        }
+    }
+    free(buf);
+    return PUT_OK;
+}
+
+/* Copy the open host file into the directory starting at dirClus, under
+    the 11 byte shortName. Returns a PUT_* result. */
+int putFile(int fd, fat32Head* h, uint32_t dirClus, int hostFd, const char *shortName) {
+    struct stat st;
+    if(fstat(hostFd, &st) == -1) {
+        return PUT_READ_FAILED;
+    }
+    if(st.st_size > UINT32_MAX) {
+        return PUT_TOO_BIG;
+    }
+    if(nameTaken(fd, h, dirClus, shortName)) {
+        return PUT_EXISTS;
+    }
+    uint64_t fileSize = st.st_size;
+    uint32_t clusters = (fileSize + clusterBytes(h) - 1)/clusterBytes(h);
+
+    /* Empty files get no clusters at all */
+    fat32Extent *extents = NULL;
+    int extentCount = 0;
+    uint32_t firstClus = 0;
+    if(clusters > 0) {
+        extentCount = allocateExtents(h, clusters, h->fsi->FSI_Nxt_Free, &extents);
+        if(extentCount < 0) {
+            return PUT_NO_SPACE;
+        }
+        firstClus = extents[0].clus;
+        int result = writeExtents(fd, h, hostFd, extents, extentCount, fileSize);
+        if(result != PUT_OK) {
+            freeChain(h, firstClus);
+            free(extents);
+            return result;
+        }
+    }
+
+    /* Data is in place, now the entry pointing at it */
+    free(extents);
+
+    off_t slot = findFreeSlot(fd, h, dirClus);
+    if(slot == -1) {
+        if(clusters > 0) {
+            freeChain(h, firstClus);
+        }
+        return PUT_WRITE_FAILED;
+    }
+    fat32Dir dir;
+    memset(&dir, 0, sizeof(fat32Dir));
+    memcpy(dir.DIR_Name, shortName, SHORT_NAME_LENGTH);
+    dir.DIR_Attr = ATTR_ARCHIVE;
+    fatTimestamp(st.st_mtime, &dir.DIR_WrtDate, &dir.DIR_WrtTime);
+    fatTimestamp(time(NULL), &dir.DIR_CrtDate, &dir.DIR_CrtTime);
+    dir.DIR_LstAccDate = dir.DIR_CrtDate;
+    dir.DIR_FstClusHI = firstClus >> 16;
+    dir.DIR_FstClusLO = firstClus & 0xFFFF;
+    dir.DIR_FileSize = fileSize;
+    if(flushFAT(fd, h) == -1 || writeImage(fd, h, slot, &dir, sizeof(fat32Dir)) != sizeof(fat32Dir)) {
+        if(clusters > 0) {
+            freeChain(h, firstClus);
+        }
+        return PUT_WRITE_FAILED;
+    }
+    return PUT_OK;
+}
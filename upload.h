@@ -0,0 +1,22 @@
+/* Writing host files into the image.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stdbool.h>
+#include "fat32.h"
+
+/* putFile results */
+#define PUT_OK 0
+#define PUT_EXISTS 1 // Name already used in the directory
+#define PUT_NO_SPACE 2 // Not enough free clusters
+#define PUT_READ_FAILED 3 // Reading the host file failed
+#define PUT_WRITE_FAILED 4 // Writing the image failed
+#define PUT_TOO_BIG 5 // Host file is over FAT32's 4 GiB file size limit
+
+bool makeShortName(const char *name, char *shortName);
+int putFile(int fd, fat32Head* h, uint32_t dirClus, int hostFd, const char *shortName);
+
+#endif
@@ -0,0 +1,275 @@
+/* walk.c visits every entry below a directory on a work-stealing pool:
+* each directory is one task that lists its chain and queues a task
+* per subdirectory on the worker's own deque, where idle workers steal
+* them. Directories are claimed in a shared bitmap with an atomic OR,
+* so a tree whose ".." or cross-linked entries loop is still walked
+* once. FIND is a walk that passes on the entries whose name (or, for
+* patterns with a '/', whose path) matches a wildcard pattern. DU walks
+* the same way but keeps a node per directory, totalled bottom-up once
+* every task is done.
+* Author: Micah Hanmin Wang #3631308
+*/
+
+#include "libfat32.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <pthread.h>
+
+/* Shared by every task of one walk */
+struct walkContext {
+    fat32Vol *v;
+    threadPool *pool;
+    fat32WalkFn fn;
+    void *arg;
+    uint64_t *claimed; // Bit N set once the directory at cluster N is queued
+    uint32_t limit; // Clusters the bitmap covers
+    int dirs; // Directories walked
+};
+
+/* One directory still to be listed */
+struct walkJob {
+    struct walkContext *ctx;
+    uint32_t clus;
+    char path[PATH_MAX];
+};
+
+/* Claim the directory at N, returns false if it already was */
+static bool claimDir(struct walkContext *ctx, uint32_t N) {
+    if(N >= ctx->limit) {
+        return false;
+    }
+    uint64_t bit = 1ULL << (N % 64);
+    return (__atomic_fetch_or(&ctx->claimed[N/64], bit, __ATOMIC_RELAXED) & bit) == 0;
+}
+
+static void walkDirTask(void *arg);
+
+static int walkEntry(const fat32Entry *entry, void *arg) {
+    struct walkJob *job = arg;
+    struct walkContext *ctx = job->ctx;
+    if(strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+        return 0;
+    }
+    char path[PATH_MAX];
+    if(snprintf(path, PATH_MAX, "%s/%s", strcmp(job->path, "/") == 0 ? "" : job->path, entry->name) >= PATH_MAX) {
+        return 0;
+    }
+    ctx->fn(path, entry, ctx->arg);
+    if(entry->isDir && claimDir(ctx, entry->firstClus)) {
+        struct walkJob *child = malloc(sizeof(struct walkJob));
+        if(child == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(struct walkJob));
+            abort();
+        }
+        child->ctx = ctx;
+        child->clus = entry->firstClus;
+        strcpy(child->path, path);
+        poolSubmit(ctx->pool, walkDirTask, child);
+    }
+    return 0;
+}
+
+static void walkDirTask(void *arg) {
+    struct walkJob *job = arg;
+    __atomic_fetch_add(&job->ctx->dirs, 1, __ATOMIC_RELAXED);
+    fat32Readdir(job->ctx->v, job->clus, walkEntry, job);
+    free(job);
+}
+
+/* Call fn for every entry below the directory starting at dirClus,
+    whose own path is path ("/" for the root). Returns the number of
+    directories walked, the starting one included. */
+int fat32Walk(fat32Vol *v, uint32_t dirClus, const char *path, fat32WalkFn fn, void *arg) {
+    struct walkContext ctx;
+    ctx.v = v;
+    ctx.fn = fn;
+    ctx.arg = arg;
+    ctx.limit = fat32TotalClusters(v) + 2;
+    ctx.dirs = 0;
+    ctx.claimed = calloc(ctx.limit/64 + 1, sizeof(uint64_t));
+    if(ctx.claimed == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", (ctx.limit/64 + 1)*sizeof(uint64_t));
+        abort();
+    }
+    ctx.pool = createPool(defaultPoolSize());
+
+    struct walkJob *root = malloc(sizeof(struct walkJob));
+    if(root == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(struct walkJob));
+        abort();
+    }
+    root->ctx = &ctx;
+    root->clus = dirClus;
+    snprintf(root->path, PATH_MAX, "%s", path);
+    claimDir(&ctx, dirClus);
+    poolSubmit(ctx.pool, walkDirTask, root);
+    destroyPool(ctx.pool);
+    free(ctx.claimed);
+    return ctx.dirs;
+}
+
+struct findContext {
+    const char *pattern;
+    bool wholePath; // Match the pattern against the path, not the name
+    fat32WalkFn fn;
+    void *arg;
+};
+
+static void findMatch(const char *path, const fat32Entry *entry, void *arg) {
+    struct findContext *find = arg;
+    if(find->wholePath ? fnmatch(find->pattern, path, FNM_PATHNAME) == 0 : fnmatch(find->pattern, entry->name, 0) == 0) {
+        find->fn(path, entry, find->arg);
+    }
+}
+
+/* Walk the whole volume from the root and call fn for every entry
+    matching pattern: a wildcard on the name ("*.TXT"), or on the full
+    path when it contains a '/' ("/A/B/F*"). Returns the directories
+    walked. */
+int fat32Find(fat32Vol *v, const char *pattern, fat32WalkFn fn, void *arg) {
+    struct findContext find = { pattern, strchr(pattern, '/') != NULL, fn, arg };
+    return fat32Walk(v, fat32RootCluster(v), "/", findMatch, &find);
+}
+
+/* A directory DU has reached. Only the task listing it writes its own
+    totals, the subtrees are added in once every task is done. */
+struct duNode {
+    char path[PATH_MAX];
+    uint32_t clus;
+    int parent; // Index in duContext.nodes, -1 for the starting directory
+    fat32DuTotals totals;
+};
+
+struct duContext {
+    fat32Vol *v;
+    threadPool *pool;
+    struct walkContext claims; // Just for its bitmap
+    struct duNode **nodes; // In the order they were reached, parents first
+    int count;
+    int capacity;
+    pthread_mutex_t lock; // Guards nodes and count
+};
+
+struct duJob {
+    struct duContext *ctx;
+    struct duNode *node;
+    int index; // Of node in duContext.nodes
+};
+
+static void duDirTask(void *arg);
+
+/* Add a directory to the list and queue the task that lists it */
+static void duQueue(struct duContext *ctx, const char *path, uint32_t clus, int parent) {
+    struct duNode *node = malloc(sizeof(struct duNode));
+    struct duJob *job = malloc(sizeof(struct duJob));
+    if(node == NULL || job == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", sizeof(struct duNode) + sizeof(struct duJob));
+        abort();
+    }
+    snprintf(node->path, PATH_MAX, "%s", path);
+    node->clus = clus;
+    node->parent = parent;
+    memset(&node->totals, 0, sizeof(fat32DuTotals));
+    node->totals.clusters = fat32ChainLength(ctx->v, clus);
+
+    pthread_mutex_lock(&ctx->lock);
+    if(ctx->count == ctx->capacity) {
+        ctx->capacity *= 2;
+        ctx->nodes = realloc(ctx->nodes, ctx->capacity*sizeof(struct duNode*));
+        if(ctx->nodes == NULL) {
+            fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", ctx->capacity*sizeof(struct duNode*));
+            abort();
+        }
+    }
+    job->index = ctx->count;
+    ctx->nodes[ctx->count++] = node;
+    pthread_mutex_unlock(&ctx->lock);
+
+    job->ctx = ctx;
+    job->node = node;
+    poolSubmit(ctx->pool, duDirTask, job);
+}
+
+static int duEntry(const fat32Entry *entry, void *arg) {
+    struct duJob *job = arg;
+    struct duContext *ctx = job->ctx;
+    if(strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+        return 0;
+    }
+    struct duNode *node = job->node;
+    if(!entry->isDir) {
+        node->totals.files++;
+        node->totals.size += entry->size;
+        node->totals.clusters += fat32ChainLength(ctx->v, entry->firstClus);
+        return 0;
+    }
+    node->totals.dirs++;
+    char path[PATH_MAX];
+    if(snprintf(path, PATH_MAX, "%s/%s", strcmp(node->path, "/") == 0 ? "" : node->path, entry->name) < PATH_MAX
+        && claimDir(&ctx->claims, entry->firstClus)) {
+        duQueue(ctx, path, entry->firstClus, job->index);
+    }
+    return 0;
+}
+
+static void duDirTask(void *arg) {
+    struct duJob *job = arg;
+    fat32Readdir(job->ctx->v, job->node->clus, duEntry, job);
+    free(job);
+}
+
+static int comparePaths(const void *a, const void *b) {
+    return strcmp((*(struct duNode* const*)a)->path, (*(struct duNode* const*)b)->path);
+}
+
+/* Total the directory starting at dirClus (whose path is path) and
+    everything below it into total, one task per directory. fn, when not
+    NULL, gets the totals of every directory in the subtree. Chain lengths
+    come from fat32ChainLength, so a second DU over the same files only
+    reads their directories. */
+void fat32Du(fat32Vol *v, uint32_t dirClus, const char *path, fat32DuTotals *total, fat32DuFn fn, void *arg) {
+    struct duContext ctx;
+    ctx.v = v;
+    ctx.claims.limit = fat32TotalClusters(v) + 2;
+    ctx.claims.claimed = calloc(ctx.claims.limit/64 + 1, sizeof(uint64_t));
+    ctx.capacity = 64;
+    ctx.count = 0;
+    ctx.nodes = malloc(ctx.capacity*sizeof(struct duNode*));
+    if(ctx.claims.claimed == NULL || ctx.nodes == NULL) {
+        fprintf(stderr, "Fatal: failed to allocate %lu bytes.\n", (ctx.claims.limit/64 + 1)*sizeof(uint64_t));
+        abort();
+    }
+    pthread_mutex_init(&ctx.lock, NULL);
+    ctx.pool = createPool(defaultPoolSize());
+    claimDir(&ctx.claims, dirClus);
+    duQueue(&ctx, path, dirClus, -1);
+    destroyPool(ctx.pool);
+
+    /* Children were added after their parent, so going backwards adds
+        every subtree in before its parent is added to its own */
+    for(int i = ctx.count - 1; i > 0; i--) {
+        fat32DuTotals *from = &ctx.nodes[i]->totals;
+        fat32DuTotals *to = &ctx.nodes[ctx.nodes[i]->parent]->totals;
+        to->size += from->size;
+        to->clusters += from->clusters;
+        to->files += from->files;
+        to->dirs += from->dirs;
+    }
+    *total = ctx.nodes[0]->totals;
+    if(fn != NULL) {
+        qsort(ctx.nodes, ctx.count, sizeof(struct duNode*), comparePaths);
+        for(int i = 0; i < ctx.count; i++) {
+            fn(ctx.nodes[i]->path, &ctx.nodes[i]->totals, arg);
+        }
+    }
+    for(int i = 0; i < ctx.count; i++) {
+        free(ctx.nodes[i]);
+    }
+    free(ctx.nodes);
+    free(ctx.claims.claimed);
+    pthread_mutex_destroy(&ctx.lock);
+}